@@ -0,0 +1,313 @@
+// Copyright (c) 2021 Matt Bolitho
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "pancake.hpp"
+
+#ifndef PANCAKE_BENCH_WORKLOADS
+    #define PANCAKE_BENCH_WORKLOADS "bench"
+#endif
+
+static char const* const UsageInformation = "\
+Usage: pancake_bench [options] [workload...]\n\
+Times each workload, or only the workloads named, through the virtual machine API.\n\
+Options:\n\
+--workloads <directory> - Load the workload programs from the directory (default: " PANCAKE_BENCH_WORKLOADS ").\n\
+--warmup <count>        - Run each workload this many times before timing it (default: 1).\n\
+--repetitions <count>   - Time each workload this many times (default: 5).\n\
+--jit                   - Compile the workloads to machine code before running them.\n\
+-O<level>               - Set the optimization level (0 to 3, default 3).\n\
+--save <path>           - Save the median times to the path, as a baseline for later runs.\n\
+--compare <path>        - Compare the median times against a baseline saved with --save.\n\
+--help                  - Display this text.";
+
+/// A program the benchmark times, with the input which sets how much work it does.
+struct Workload
+{
+    char const* name;
+    char const* input;
+};
+
+/// The workloads, each sized to run for a few hundred milliseconds.
+static Workload const Workloads[] =
+{
+    { "sieve", "100000" },
+    { "fibonacci", "20000000" },
+    { "digits", "1000000" },
+    { "reverse", "20000" },
+    { "counters", "3000000" },
+    { "panics", "5000000" }
+};
+
+/// Options given on the command line.
+struct Options
+{
+    std::vector<std::string> names{};
+    std::string workloadDirectory = PANCAKE_BENCH_WORKLOADS;
+    std::string savePath{};
+    std::string comparePath{};
+    std::size_t warmup = 1;
+    std::size_t repetitions = 5;
+    int optimizationLevel = Pancake::DefaultOptimizationLevel;
+    bool jit = false;
+};
+
+/// The timings of one workload.
+struct Result
+{
+    std::string name;
+    uint64_t instructions;
+    double median;
+    double minimum;
+};
+
+static bool TryParseCount(char const* const text, std::size_t& value)
+{
+    char* end = nullptr;
+    auto const parsed = std::strtoull(text, &end, 10);
+    if (end == text || *end != '\0')
+    {
+        return false;
+    }
+
+    value = static_cast<std::size_t>(parsed);
+    return true;
+}
+
+static bool ReadFile(std::string const& path, std::string& text)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::ostringstream contents{};
+    contents << file.rdbuf();
+    text = contents.str();
+    return true;
+}
+
+/// Times a workload, after counting the instructions it executes with a profiled run.
+/// @param options The options.
+/// @param workload The workload.
+/// @param result The timings.
+/// @returns True if the workload ran without a PANic.
+static bool RunWorkload(Options const& options, Workload const& workload, Result& result)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::string source{};
+    auto const path = options.workloadDirectory + "/" + workload.name + ".pnck";
+    if (!ReadFile(path, source))
+    {
+        std::cerr << "Could not open " << path << "." << std::endl;
+        return false;
+    }
+
+    try
+    {
+        auto const program = Pancake::PancakeInterpreter(Pancake::DefaultStackCapacity, options.optimizationLevel).Compile(source);
+
+        Pancake::PancakeVirtualMachine machine{};
+        Pancake::StringInputSource input{};
+        Pancake::StringOutputSink output{};
+        machine.SetInput(input);
+        machine.SetOutput(output);
+        machine.SetJitEnabled(options.jit);
+
+        auto const run = [&]
+        {
+            input.Reset(workload.input);
+            output.Clear();
+            machine.Load(program);
+            machine.Run();
+        };
+
+        machine.SetProfilingEnabled(true);
+        run();
+        machine.SetProfilingEnabled(false);
+        auto const& executions = machine.GetProfile().executions;
+        result.instructions = std::accumulate(executions.begin(), executions.end(), uint64_t(0));
+
+        for (std::size_t warmup = 0; warmup < options.warmup; ++warmup)
+        {
+            run();
+        }
+
+        std::vector<double> times{};
+        for (std::size_t repetition = 0; repetition < options.repetitions; ++repetition)
+        {
+            auto const start = Clock::now();
+            run();
+            times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+        }
+        std::sort(times.begin(), times.end());
+
+        result.name = workload.name;
+        result.median = times[times.size() / 2];
+        result.minimum = times.front();
+        return true;
+    }
+    catch (Pancake::PancakePanic const& pancakeException)
+    {
+        std::cerr << workload.name << ": " << pancakeException.what() << std::endl;
+        return false;
+    }
+}
+
+/// Reads the median times saved by an earlier run.
+static bool ReadBaseline(std::string const& path, std::map<std::string, double>& baseline)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::string name{};
+    double median = 0;
+    uint64_t instructions = 0;
+    while (file >> name >> median >> instructions)
+    {
+        baseline[name] = median;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options options{};
+    for (auto i = 1; i < argc; ++i)
+    {
+        auto const argument = std::string(argv[i]);
+
+        if (argument == "--help")
+        {
+            std::cout << UsageInformation << std::endl;
+            return 0;
+        }
+
+        if (argument == "--workloads" || argument == "--save" || argument == "--compare")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << argument << " expects a path." << std::endl;
+                return -1;
+            }
+            auto& path = argument == "--workloads" ? options.workloadDirectory : argument == "--save" ? options.savePath : options.comparePath;
+            path = argv[++i];
+            continue;
+        }
+
+        if (argument == "--warmup" || argument == "--repetitions")
+        {
+            auto& count = argument == "--warmup" ? options.warmup : options.repetitions;
+            if (i + 1 >= argc || !TryParseCount(argv[++i], count))
+            {
+                std::cerr << argument << " expects a number of runs." << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (argument == "--jit")
+        {
+            options.jit = true;
+            continue;
+        }
+
+        if (argument.size() >= 2 && argument[0] == '-' && argument[1] == 'O')
+        {
+            if (argument.size() != 3 || argument[2] < '0' || argument[2] > '0' + Pancake::MaxOptimizationLevel)
+            {
+                std::cerr << "-O expects an optimization level from 0 to " << Pancake::MaxOptimizationLevel << "." << std::endl;
+                return -1;
+            }
+            options.optimizationLevel = argument[2] - '0';
+            continue;
+        }
+
+        options.names.push_back(argument);
+    }
+    options.repetitions = std::max<std::size_t>(options.repetitions, 1);
+
+    std::map<std::string, double> baseline{};
+    if (!options.comparePath.empty() && !ReadBaseline(options.comparePath, baseline))
+    {
+        std::cerr << "Could not open baseline " << options.comparePath << "." << std::endl;
+        return -1;
+    }
+
+    std::printf("%-12s %16s %12s %12s %10s%s\n", "Workload", "Instructions", "Median (ms)", "Min (ms)", "MIPS", baseline.empty() ? "" : "     Change");
+
+    std::vector<Result> results{};
+    auto succeeded = true;
+    for (auto const& workload : Workloads)
+    {
+        if (!options.names.empty() && std::find(options.names.begin(), options.names.end(), workload.name) == options.names.end())
+        {
+            continue;
+        }
+
+        Result result{};
+        if (!RunWorkload(options, workload, result))
+        {
+            succeeded = false;
+            continue;
+        }
+
+        std::printf("%-12s %16llu %12.2f %12.2f %10.1f", result.name.c_str(), static_cast<unsigned long long>(result.instructions),
+            result.median * 1e3, result.minimum * 1e3, static_cast<double>(result.instructions) / result.median / 1e6);
+        auto const base = baseline.find(result.name);
+        if (base != baseline.end())
+        {
+            std::printf("   %+7.1f%%", (result.median - base->second) / base->second * 100.0);
+        }
+        std::printf("\n");
+        std::fflush(stdout);
+        results.push_back(result);
+    }
+
+    if (!options.savePath.empty())
+    {
+        std::ofstream file(options.savePath);
+        for (auto const& result : results)
+        {
+            file << result.name << ' ' << result.median << ' ' << result.instructions << '\n';
+        }
+        if (!file)
+        {
+            std::cerr << "Could not save baseline to " << options.savePath << "." << std::endl;
+            return -1;
+        }
+    }
+
+    return succeeded ? 0 : 1;
+}
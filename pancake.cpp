@@ -18,16 +18,909 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include "pancake.hpp"
 
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define PANCAKE_MAP_FILES 1
+#else
+    #define PANCAKE_MAP_FILES 0
+#endif
+
 constexpr static auto UsageInformation = "Pancake usage:\n\
 \n\
-pancake <path to input file>\n\
+pancake [options] <path to input file, compiled .pnckc file or .pncks snapshot, or - for stdin>\n\
+pancake --batch [options] <program> <input file>...\n\
+pancake --batch --corpus [options] <program>...\n\
 \n\
---version       - Display version number.\n\
---help          - Display this text.";
+--stack-size <words>    - Set the capacity of the operand stack.\n\
+--heap-size <words>     - Set the number of words in the heap (default 65536).\n\
+--call-depth <calls>    - Set how deeply subroutine calls can nest (default 4096).\n\
+-O<level>               - Set the optimization level (0 to 3, default 3).\n\
+--jit                   - Compile to machine code before running (x86-64 only).\n\
+--emit-c                - Write the program as a C translation unit to standard output, without running.\n\
+--emit-bytecode         - Write the compiled program (.pnckc) to standard output, without running.\n\
+--cache <directory>     - Reuse programs compiled by earlier runs, keyed on a hash of their source.\n\
+--snapshot <path>       - Run the program until it first reads input, then write its state to the path (.pncks) and stop.\n\
+                          Running the snapshot carries on from there.\n\
+--line-buffered         - Flush output at the end of every line.\n\
+--binary                - Read (,) and write (_) numbers as raw 8-byte little-endian words, and raise EndOfInput once\n\
+                          the input runs out. Standard input is mapped into memory when it is a file.\n\
+--check                 - Report instructions that always exhaust the stack, without running.\n\
+--trace                 - Write each instruction to stderr before it is executed.\n\
+--break <label>         - Write the stack and memory to stderr whenever the label is reached. Can be repeated.\n\
+                          Programs are compiled at -O2 at most, so that every store is kept.\n\
+--trace-buffer <count>  - Keep the last <count> instructions executed, and write them to stderr if the program PANics.\n\
+--trace-json <path>     - Write the spans between labels to the path as Chrome trace_event JSON, from a trace buffer of\n\
+                          1048576 instructions unless --trace-buffer is given.\n\
+--unchecked             - Skip stack checks. A program which exhausts or overflows the stack has undefined behavior.\n\
+--profile <path>        - Count what the program executes, report it on stderr and write collapsed stacks to the path.\n\
+--batch                 - Run the program once for each input file, in parallel, and report timings.\n\
+--corpus                - With --batch, run each program once with no input instead.\n\
+--warm-start            - With --batch, run the program until it first reads input once, and start every job from there.\n\
+--threads <count>       - Set the number of threads used by --batch (default: one per core).\n\
+--version               - Display version number.\n\
+--help                  - Display this text.";
+
+/// Options given on the command line.
+struct Options
+{
+    std::vector<std::string> paths{};
+    std::vector<std::string> breakpoints{};
+    std::string cacheDirectory{};
+    std::string profilePath{};
+    std::string traceJsonPath{};
+    std::string snapshotPath{};
+    std::size_t stackCapacity = Pancake::DefaultStackCapacity;
+    std::size_t heapSize = Pancake::DefaultHeapSize;
+    std::size_t returnStackCapacity = Pancake::DefaultReturnStackCapacity;
+    std::size_t threadCount = 0;
+    std::size_t traceBufferSize = 0;
+    int optimizationLevel = Pancake::DefaultOptimizationLevel;
+    bool check = false;
+    bool jit = false;
+    bool emitC = false;
+    bool emitBytecode = false;
+    bool lineBuffered = false;
+    bool binary = false;
+    bool batch = false;
+    bool corpus = false;
+    bool warmStart = false;
+    bool trace = false;
+    bool unchecked = false;
+};
+
+/// The text of a program or of its input, mapped into memory where possible so that it is never copied.
+class SourceFile final
+{
+    public:
+        SourceFile() = default;
+        SourceFile(SourceFile const&) = delete;
+        SourceFile& operator=(SourceFile const&) = delete;
+
+        ~SourceFile()
+        {
+#if PANCAKE_MAP_FILES
+            if (_mapping != nullptr)
+            {
+                munmap(_mapping, _mappingSize);
+            }
+#endif
+        }
+
+        /// Loads a program from a file, or from standard input if the path is "-".
+        /// @param path The path.
+        /// @returns True if the program was loaded.
+        bool Load(std::string const& path)
+        {
+            if (path == "-")
+            {
+                return ReadAll(stdin);
+            }
+
+#if PANCAKE_MAP_FILES
+            auto const descriptor = open(path.c_str(), O_RDONLY);
+            if (descriptor < 0)
+            {
+                return false;
+            }
+
+            auto const mapped = Map(descriptor, 0);
+            close(descriptor);
+            if (mapped)
+            {
+                return true;
+            }
+#endif
+
+            // Empty files, pipes and platforms without mmap are read instead.
+            auto* const file = std::fopen(path.c_str(), "rb");
+            if (file == nullptr)
+            {
+                return false;
+            }
+            auto const read = ReadAll(file);
+            std::fclose(file);
+            return read;
+        }
+
+        /// Maps the rest of standard input into memory, if it is a regular file.
+        /// @returns True if it was mapped. Otherwise standard input is left to be read as usual.
+        bool MapStandardInput()
+        {
+#if PANCAKE_MAP_FILES
+            auto const offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            return offset >= 0 && Map(STDIN_FILENO, static_cast<std::size_t>(offset));
+#else
+            return false;
+#endif
+        }
+
+        /// Gets the program text.
+        std::string_view Text() const noexcept
+        {
+            return _text;
+        }
+
+    private:
+        void* _mapping = nullptr;
+        std::size_t _mappingSize = 0;
+        std::string _buffer{};
+        std::string_view _text{};
+
+#if PANCAKE_MAP_FILES
+        bool Map(int const descriptor, std::size_t const offset)
+        {
+            struct stat status{};
+            if (fstat(descriptor, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size <= 0)
+            {
+                return false;
+            }
+
+            auto const size = static_cast<std::size_t>(status.st_size);
+            auto* const mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (mapping == MAP_FAILED)
+            {
+                return false;
+            }
+
+            _mapping = mapping;
+            _mappingSize = size;
+            _text = std::string_view(static_cast<char const*>(mapping), size).substr(std::min(offset, size));
+            return true;
+        }
+#endif
+
+        bool ReadAll(std::FILE* const file)
+        {
+            char chunk[1 << 16];
+            std::size_t count = 0;
+            while ((count = std::fread(chunk, 1, sizeof(chunk), file)) != 0)
+            {
+                _buffer.append(chunk, count);
+            }
+
+            _text = _buffer;
+            return std::ferror(file) == 0;
+        }
+};
+
+/// Parses a size given as a command line option value.
+/// @returns True if the value was a valid size.
+static bool TryParseSize(char const* text, std::size_t& value)
+{
+    char* end = nullptr;
+    auto const parsed = std::strtoull(text, &end, 10);
+    if (end == text || *end != '\0' || parsed == 0)
+    {
+        return false;
+    }
+
+    value = static_cast<std::size_t>(parsed);
+    return true;
+}
+
+/// Reports the profile of the last program run and writes its collapsed stacks for flame graph tools.
+/// @param options The options, holding the path the collapsed stacks are written to.
+/// @param interpreter The interpreter that ran the program.
+/// @param source The program source, or empty if it was run from a compiled program file.
+/// @returns True if the collapsed stacks were written.
+template <typename TInterpreter>
+static bool WriteProfile(Options const& options, TInterpreter const& interpreter, std::string_view const source)
+{
+    auto const& machine = interpreter.GetVirtualMachine();
+    if (machine.GetProgram() == nullptr)
+    {
+        return false;
+    }
+
+    std::cout.flush();
+    Pancake::PancakeProfiler::WriteReport(*machine.GetProgram(), machine.GetProfile(), source, std::cerr);
+
+    std::ofstream output(options.profilePath, std::ios::binary);
+    Pancake::PancakeProfiler::WriteCollapsedStacks(*machine.GetProgram(), machine.GetProfile(), output);
+    output.close();
+    if (!output)
+    {
+        std::cerr << "Could not write profile to " << options.profilePath << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Writes whatever was asked for about a program once it has run.
+/// @param options The options.
+/// @param interpreter The interpreter that ran the program.
+/// @param source The program source, or empty if it was run from a compiled program file.
+/// @returns The exit code.
+template <typename TInterpreter>
+static int FinishRun(Options const& options, TInterpreter const& interpreter, std::string_view const source)
+{
+    auto succeeded = true;
+    if (!options.profilePath.empty())
+    {
+        succeeded = WriteProfile(options, interpreter, source) && succeeded;
+    }
+
+    if constexpr (std::is_same_v<typename TInterpreter::VirtualMachine::TracePolicy, Pancake::RingTracer>)
+    {
+        auto const& machine = interpreter.GetVirtualMachine();
+        if (!options.traceJsonPath.empty() && machine.GetProgram() != nullptr)
+        {
+            std::ofstream output(options.traceJsonPath, std::ios::binary);
+            machine.GetTracer().WriteChromeTrace(*machine.GetProgram(), output);
+            output.close();
+            if (!output)
+            {
+                std::cerr << "Could not write trace to " << options.traceJsonPath << "." << std::endl;
+                succeeded = false;
+            }
+        }
+    }
+
+    return succeeded ? 0 : 1;
+}
+
+/// Loads a program from the compile cache, or compiles it and adds it to the cache.
+/// Cached programs are named by a hash of their source, the optimization level and the capacities of the stacks,
+/// since level 3 only rewrites code which cannot fill the stack and only calls which cannot fill the return stack are inlined.
+/// @returns The compiled program, or null if it does not compile.
+template <typename TInterpreter>
+static std::shared_ptr<Pancake::CompiledProgram const> CompileCached(Options const& options, TInterpreter const& interpreter, std::string_view const source)
+{
+    auto const hash = Pancake::PancakeBytecode::HashSource(source);
+    char name[96];
+    std::snprintf(name, sizeof(name), "%016llx-O%d-S%llu-C%llu.pnckc", static_cast<unsigned long long>(hash), options.optimizationLevel,
+        static_cast<unsigned long long>(options.stackCapacity), static_cast<unsigned long long>(options.returnStackCapacity));
+    auto const path = std::filesystem::path(options.cacheDirectory) / name;
+
+    SourceFile cached{};
+    Pancake::CompiledProgram compiledProgram{};
+    Pancake::PancakeBytecode::Origin origin{};
+    if (cached.Load(path.string()) && Pancake::PancakeBytecode::Read(cached.Text(), compiledProgram, &origin)
+        && origin.sourceHash == hash && origin.sourceLength == source.size() && origin.optimizationLevel == options.optimizationLevel
+        && origin.IsCompiledFor(options.stackCapacity, options.returnStackCapacity))
+    {
+        return std::make_shared<Pancake::CompiledProgram const>(std::move(compiledProgram));
+    }
+
+    std::shared_ptr<Pancake::CompiledProgram const> program{};
+    try
+    {
+        program = interpreter.Compile(source);
+    }
+    catch (Pancake::PancakePanic const&)
+    {
+        // The program is compiled again to report the error in the usual way.
+        return nullptr;
+    }
+
+    // Written under a temporary name and renamed, so that concurrent runs never read a partial file.
+    std::error_code error{};
+    std::filesystem::create_directories(options.cacheDirectory, error);
+    auto temporary = path;
+    temporary += "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    {
+        std::ofstream output(temporary, std::ios::binary);
+        Pancake::PancakeBytecode::Write(*program, source, options.optimizationLevel, options.stackCapacity, options.returnStackCapacity, output);
+        if (!output)
+        {
+            std::filesystem::remove(temporary, error);
+            return program;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+    {
+        std::filesystem::remove(temporary, error);
+    }
+
+    return program;
+}
+
+/// Checks that a snapshot can be restored into virtual machines with the stack capacities given on the command line,
+/// which its program may have been optimized for, and reports it if not.
+/// @returns True if the snapshot can be restored.
+static bool IsSnapshotFor(Options const& options, Pancake::PancakeSnapshot const& snapshot)
+{
+    if (snapshot.GetStackCapacity() != options.stackCapacity || snapshot.GetReturnStackCapacity() != options.returnStackCapacity)
+    {
+        std::cerr << "The snapshot was taken with --stack-size " << snapshot.GetStackCapacity() << " --call-depth "
+            << snapshot.GetReturnStackCapacity() << ", and can only be run with them." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// The highest optimization level programs with breakpoints are compiled at.
+/// -O3 removes stores to memory which is never loaded, so breakpoints would not show what the program stored.
+constexpr int MaxBreakpointOptimizationLevel = 2;
+
+/// Checks that a compiled program or snapshot can be run with the breakpoints given, if any, reporting why not.
+/// @param options The options.
+/// @param origin The origin of the compiled program.
+/// @returns True if there are no breakpoints, or the program was compiled at a level which keeps every store.
+static bool IsCompiledForBreakpoints(Options const& options, Pancake::PancakeBytecode::Origin const& origin)
+{
+    if (!options.breakpoints.empty() && origin.optimizationLevel > MaxBreakpointOptimizationLevel)
+    {
+        std::cerr << "The program was compiled with -O" << origin.optimizationLevel << ", and --break needs -O"
+            << MaxBreakpointOptimizationLevel << " or below to show its memory." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Runs many independent jobs, each a program and its input, across a pool of threads.
+/// Each worker owns a virtual machine and an output sink, and only compiled programs and snapshots are shared.
+class BatchRunner final
+{
+    public:
+        /// Initializes a new instance of the BatchRunner class.
+        /// @param options The command line options.
+        explicit BatchRunner(Options const& options)
+            : _options(options)
+        {
+        }
+
+        /// Runs every job, writing their output in the order they were given, followed by a timing report.
+        /// @returns True if every job ran without a PANic.
+        bool Run()
+        {
+            using Clock = std::chrono::steady_clock;
+
+            if (!CreateJobs())
+            {
+                return false;
+            }
+
+            auto threadCount = _options.threadCount != 0 ? _options.threadCount : std::size_t(std::thread::hardware_concurrency());
+            threadCount = std::max<std::size_t>(1, std::min(threadCount, _jobs.size()));
+
+            // Jobs are dealt out in turn, so each worker starts on the earliest jobs it was given
+            // and steals the latest jobs of others once its own run out.
+            _queues = std::vector<WorkQueue>(threadCount);
+            for (std::size_t job = 0; job < _jobs.size(); ++job)
+            {
+                _queues[job % threadCount].jobs.push_back(job);
+            }
+
+            auto const start = Clock::now();
+            std::vector<std::thread> workers{};
+            for (std::size_t worker = 0; worker < threadCount; ++worker)
+            {
+                workers.emplace_back([this, worker] { Work(worker); });
+            }
+
+            auto succeeded = true;
+            for (auto& job : _jobs)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_completionMutex);
+                    _completion.wait(lock, [&] { return job.done; });
+                }
+
+                std::cout << "==> " << job.path << " <==\n" << job.output;
+                if (!job.output.empty() && job.output.back() != '\n')
+                {
+                    std::cout << '\n';
+                }
+                if (!job.error.empty())
+                {
+                    std::cerr << job.path << ": " << job.error << std::endl;
+                    succeeded = false;
+                }
+                std::string().swap(job.output);
+            }
+            std::cout.flush();
+
+            for (auto& worker : workers)
+            {
+                worker.join();
+            }
+
+            auto const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            Report(threadCount, elapsed);
+            return succeeded;
+        }
+
+    private:
+        struct Job
+        {
+            std::string path;
+            std::string output{};
+            std::string error{};
+            double latency = 0;
+            bool done = false;
+        };
+
+        struct WorkQueue
+        {
+            std::mutex mutex{};
+            std::deque<std::size_t> jobs{};
+        };
+
+        Options const& _options;
+        std::shared_ptr<Pancake::CompiledProgram const> _program{};
+        Pancake::PancakeSnapshot _snapshot{};
+        std::string _prologue{};
+        std::vector<Job> _jobs{};
+        std::vector<WorkQueue> _queues{};
+        std::mutex _completionMutex{};
+        std::condition_variable _completion{};
+
+        bool CreateJobs()
+        {
+            if (_options.paths.empty() || (!_options.corpus && _options.paths.size() < 2))
+            {
+                std::cerr << "--batch expects a program and at least one input file, or --corpus and at least one program." << std::endl;
+                return false;
+            }
+
+            if (_options.corpus && _options.warmStart)
+            {
+                std::cerr << "--warm-start cannot be combined with --corpus." << std::endl;
+                return false;
+            }
+
+            if (_options.corpus)
+            {
+                // Each program is compiled by the worker which runs it.
+                for (auto const& path : _options.paths)
+                {
+                    _jobs.push_back({ path });
+                }
+                return true;
+            }
+
+            SourceFile source{};
+            if (!source.Load(_options.paths.front()))
+            {
+                std::cerr << "Could not open input file." << std::endl;
+                return false;
+            }
+
+            if (Pancake::PancakeBytecode::IsSnapshot(source.Text()))
+            {
+                // Every job carries on from the snapshot, whose earlier output was written when it was taken.
+                if (!Pancake::PancakeBytecode::ReadSnapshot(source.Text(), _snapshot))
+                {
+                    std::cerr << "Not a snapshot for this version of Pancake." << std::endl;
+                    return false;
+                }
+
+                if (!IsSnapshotFor(_options, _snapshot))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                try
+                {
+                    _program = Compile(source.Text());
+                }
+                catch (Pancake::PancakePanic const& pancakeException)
+                {
+                    std::cerr << "Pancake error: " << pancakeException.what() << std::endl;
+                    return false;
+                }
+
+                if (_options.warmStart)
+                {
+                    WarmUp();
+                }
+            }
+
+            for (auto path = _options.paths.begin() + 1; path != _options.paths.end(); ++path)
+            {
+                _jobs.push_back({ *path });
+            }
+            return true;
+        }
+
+        std::shared_ptr<Pancake::CompiledProgram const> Compile(std::string_view const source) const
+        {
+            return Pancake::PancakeInterpreter(_options.stackCapacity, _options.optimizationLevel, _options.returnStackCapacity).Compile(source);
+        }
+
+        /// Runs the program until it first waits for input, so that every job can start from a snapshot of that point
+        /// rather than repeating everything before it. Programs which halt or PANic first run from the start for every job.
+        void WarmUp()
+        {
+            Pancake::PancakeVirtualMachine machine(_options.stackCapacity, _options.returnStackCapacity);
+            machine.SetHeapSize(_options.heapSize);
+            Pancake::StringOutputSink output{};
+            Pancake::QueueInputSource pending{};
+            machine.SetOutput(output);
+            machine.SetInput(pending);
+            machine.SetJitEnabled(_options.jit);
+            try
+            {
+                machine.Load(_program);
+                machine.Run();
+            }
+            catch (Pancake::PancakePanic const&)
+            {
+                // Each job reports the PANic when it runs.
+            }
+
+            if (machine.IsWaitingForInput())
+            {
+                _snapshot = machine.Capture();
+                _prologue = output.Text();
+            }
+            machine.SetOutput(Pancake::StandardOutputSink());
+        }
+
+        bool TakeJob(std::size_t const worker, std::size_t& job)
+        {
+            for (std::size_t offset = 0; offset < _queues.size(); ++offset)
+            {
+                auto& queue = _queues[(worker + offset) % _queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.jobs.empty())
+                {
+                    continue;
+                }
+
+                if (offset == 0)
+                {
+                    job = queue.jobs.front();
+                    queue.jobs.pop_front();
+                }
+                else
+                {
+                    job = queue.jobs.back();
+                    queue.jobs.pop_back();
+                }
+                return true;
+            }
+
+            return false;
+        }
+
+        void Work(std::size_t const worker)
+        {
+            Pancake::PancakeVirtualMachine machine(_options.stackCapacity, _options.returnStackCapacity);
+            machine.SetHeapSize(_options.heapSize);
+            Pancake::StringOutputSink output{};
+            Pancake::StringInputSource input{};
+            machine.SetOutput(output);
+            machine.SetInput(input);
+            machine.SetJitEnabled(_options.jit);
+
+            std::size_t index = 0;
+            while (TakeJob(worker, index))
+            {
+                auto& job = _jobs[index];
+                auto const start = std::chrono::steady_clock::now();
+                output.Clear();
+                try
+                {
+                    SourceFile source{};
+                    if (_options.corpus)
+                    {
+                        if (!source.Load(job.path))
+                        {
+                            throw std::runtime_error("Could not open program file.");
+                        }
+                        machine.Load(Compile(source.Text()));
+                    }
+                    else
+                    {
+                        if (!source.Load(job.path))
+                        {
+                            throw std::runtime_error("Could not open input file.");
+                        }
+                        input.Reset(source.Text());
+                        if (_snapshot.Empty())
+                        {
+                            machine.Load(_program);
+                        }
+                        else
+                        {
+                            machine.Restore(_snapshot);
+                        }
+                    }
+                    machine.Run();
+                }
+                catch (Pancake::PancakePanic const& pancakeException)
+                {
+                    job.error = std::string("Pancake runtime error: ") + pancakeException.what();
+                }
+                catch (std::exception const& exception)
+                {
+                    job.error = exception.what();
+                }
+
+                // The program's output is flushed into the sink when it stops.
+                job.output = _prologue + output.Text();
+                job.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                input.Reset({});
+
+                {
+                    std::lock_guard<std::mutex> lock(_completionMutex);
+                    job.done = true;
+                }
+                _completion.notify_one();
+            }
+
+            machine.SetOutput(Pancake::StandardOutputSink());
+        }
+
+        void Report(std::size_t const threadCount, double const elapsed) const
+        {
+            std::vector<double> latencies{};
+            latencies.reserve(_jobs.size());
+            for (auto const& job : _jobs)
+            {
+                latencies.push_back(job.latency);
+            }
+            std::sort(latencies.begin(), latencies.end());
+
+            auto const percentile = [&](double const fraction)
+            {
+                auto const rank = static_cast<std::size_t>(fraction * static_cast<double>(latencies.size() - 1) + 0.5);
+                return latencies[rank] * 1e6;
+            };
+
+            std::fprintf(stderr, "Ran %zu jobs on %zu thread%s in %.3fs (%.0f jobs/s).\n",
+                _jobs.size(), threadCount, threadCount == 1 ? "" : "s", elapsed, static_cast<double>(_jobs.size()) / elapsed);
+            std::fprintf(stderr, "Job latency: p50 %.0fus, p90 %.0fus, p99 %.0fus, max %.0fus.\n",
+                percentile(0.5), percentile(0.9), percentile(0.99), latencies.back() * 1e6);
+        }
+};
+
+/// Writes the state of a virtual machine stopped at a breakpoint.
+/// @param machine The virtual machine.
+/// @param label The name of the label reached.
+template <typename TVirtualMachine>
+static void WriteBreakpoint(TVirtualMachine const& machine, std::string const& label)
+{
+    auto const& program = *machine.GetProgram();
+    auto const& stack = machine.GetStack();
+    std::cout.flush();
+    std::cerr << "Breakpoint at '" << label << "' (address " << machine.GetInstructionPointer()
+        << ", offset " << program.sourceOffsets[machine.GetInstructionPointer()] << ")\n";
+
+    std::cerr << "  Stack (" << stack.Size() << "):";
+    for (std::size_t depth = 0; depth < stack.Size() && depth < 16; ++depth)
+    {
+        std::cerr << ' ' << stack.Peek(depth);
+    }
+    std::cerr << (stack.Size() > 16 ? " ...\n" : "\n");
+
+    auto const& returnStack = machine.GetReturnStack();
+    if (!returnStack.Empty())
+    {
+        std::cerr << "  Return addresses (" << returnStack.Size() << "):";
+        for (std::size_t depth = 0; depth < returnStack.Size() && depth < 16; ++depth)
+        {
+            std::cerr << ' ' << returnStack.Peek(depth);
+        }
+        std::cerr << (returnStack.Size() > 16 ? " ...\n" : "\n");
+    }
+
+    std::cerr << "  Memory:";
+    for (std::size_t slot = 0; slot < program.variables.size(); ++slot)
+    {
+        if (machine.GetMemory().IsDefined(slot))
+        {
+            std::cerr << ' ' << program.variables[slot] << '=' << machine.GetMemory().Load(slot);
+        }
+    }
+    std::cerr << std::endl;
+}
+
+/// The number of instructions kept for --trace-json when no --trace-buffer size is given.
+constexpr std::size_t DefaultTraceJsonBufferSize = std::size_t(1) << 20;
+
+/// Sets up the tracer and breakpoints of a virtual machine built with them.
+/// @param options The options.
+/// @param machine The virtual machine.
+template <typename TVirtualMachine>
+static void ConfigureDebugging(Options const& options, TVirtualMachine& machine)
+{
+    if constexpr (std::is_same_v<typename TVirtualMachine::TracePolicy, Pancake::StreamTracer>)
+    {
+        machine.GetTracer().SetOutput(options.trace ? &std::cerr : nullptr);
+    }
+
+    if constexpr (std::is_same_v<typename TVirtualMachine::TracePolicy, Pancake::RingTracer>)
+    {
+        machine.GetTracer().SetCapacity(options.traceBufferSize != 0 ? options.traceBufferSize : DefaultTraceJsonBufferSize);
+    }
+
+    if constexpr (TVirtualMachine::BreakpointPolicy::Enabled)
+    {
+        for (auto const& label : options.breakpoints)
+        {
+            machine.GetBreakpoints().Add(label);
+        }
+        machine.GetBreakpoints().SetHandler([&machine](std::string const& label)
+        {
+            WriteBreakpoint(machine, label);
+        });
+    }
+}
+
+/// Runs, checks or translates a single program on a virtual machine of the given type.
+/// @param options The options.
+/// @param program The program source or compiled program file.
+/// @returns The exit code.
+template <typename TVirtualMachine>
+static int RunProgram(Options const& options, std::string_view const program)
+{
+    // Declared first, since the virtual machine reads from them until it is destroyed.
+    SourceFile standardInput{};
+    Pancake::StringInputSource mappedInput{};
+
+    auto interpreter = Pancake::BasicPancakeInterpreter<TVirtualMachine>(options.stackCapacity, options.optimizationLevel, options.returnStackCapacity);
+    interpreter.SetJitEnabled(options.jit);
+    interpreter.SetHeapSize(options.heapSize);
+    interpreter.SetFlushPolicy(options.lineBuffered ? Pancake::FlushPolicy::Line : Pancake::FlushPolicy::Buffered);
+    interpreter.SetProfilingEnabled(!options.profilePath.empty());
+    ConfigureDebugging(options, interpreter.GetVirtualMachine());
+    if constexpr (std::is_same_v<typename TVirtualMachine::IoPolicy, Pancake::BinaryIo>)
+    {
+        // Binary input is copied straight out of the mapping, rather than through stdio.
+        if (standardInput.MapStandardInput())
+        {
+            mappedInput.Reset(standardInput.Text());
+            interpreter.GetVirtualMachine().SetInput(mappedInput);
+        }
+    }
+
+    auto const isSnapshot = Pancake::PancakeBytecode::IsSnapshot(program);
+    if ((isSnapshot || Pancake::PancakeBytecode::IsBytecode(program)) && (options.check || options.emitBytecode || !options.snapshotPath.empty()))
+    {
+        std::cerr << "--check, --emit-bytecode and --snapshot need the program source." << std::endl;
+        return -1;
+    }
+
+    if (isSnapshot)
+    {
+        Pancake::PancakeSnapshot snapshot{};
+        Pancake::PancakeBytecode::Origin origin{};
+        if (!Pancake::PancakeBytecode::ReadSnapshot(program, snapshot, &origin))
+        {
+            std::cerr << "Not a snapshot for this version of Pancake." << std::endl;
+            return -1;
+        }
+
+        if (!IsSnapshotFor(options, snapshot) || !IsCompiledForBreakpoints(options, origin))
+        {
+            return -1;
+        }
+
+        if (options.emitC)
+        {
+            std::cerr << "--emit-c cannot start a program from a snapshot." << std::endl;
+            return -1;
+        }
+
+        interpreter.Interpret(snapshot);
+        return FinishRun(options, interpreter, {});
+    }
+
+    if (Pancake::PancakeBytecode::IsBytecode(program))
+    {
+        Pancake::CompiledProgram compiledProgram{};
+        Pancake::PancakeBytecode::Origin origin{};
+        if (!Pancake::PancakeBytecode::Read(program, compiledProgram, &origin))
+        {
+            std::cerr << "Not a compiled program for this version of Pancake." << std::endl;
+            return -1;
+        }
+
+        if (!origin.IsCompiledFor(options.stackCapacity, options.returnStackCapacity))
+        {
+            std::cerr << "The program was compiled for --stack-size " << origin.stackCapacity
+                << " --call-depth " << origin.returnStackCapacity << ", and can only be run with them." << std::endl;
+            return -1;
+        }
+
+        if (!IsCompiledForBreakpoints(options, origin))
+        {
+            return -1;
+        }
+
+        if (options.emitC)
+        {
+            interpreter.EmitC(compiledProgram, std::cout);
+            return 0;
+        }
+
+        interpreter.Interpret(std::make_shared<Pancake::CompiledProgram const>(std::move(compiledProgram)));
+        return FinishRun(options, interpreter, {});
+    }
+
+    if (options.check)
+    {
+        return interpreter.Check(program) ? 0 : 1;
+    }
+
+    if (options.emitC)
+    {
+        return interpreter.EmitC(program, std::cout) ? 0 : 1;
+    }
+
+    if (options.emitBytecode)
+    {
+        return interpreter.EmitBytecode(program, std::cout) ? 0 : 1;
+    }
+
+    if (!options.snapshotPath.empty())
+    {
+        // The snapshot is only written once the program has run far enough to capture it.
+        std::ostringstream snapshot{};
+        if (!interpreter.EmitSnapshot(program, snapshot))
+        {
+            return 1;
+        }
+
+        std::ofstream output(options.snapshotPath, std::ios::binary);
+        output << snapshot.str();
+        output.close();
+        if (!output)
+        {
+            std::cerr << "Could not write snapshot to " << options.snapshotPath << "." << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!options.cacheDirectory.empty())
+    {
+        if (auto compiledProgram = CompileCached(options, interpreter, program))
+        {
+            interpreter.Interpret(std::move(compiledProgram));
+            return FinishRun(options, interpreter, program);
+        }
+    }
+
+    interpreter.Interpret(program);
+    return FinishRun(options, interpreter, program);
+}
 
 int main(int argc, char** argv)
 {
@@ -36,34 +929,275 @@ int main(int argc, char** argv)
         std::cerr << UsageInformation << std::endl;
         return -1;
     }
-    auto const argument = std::string(argv[1]);
 
-    if (argument == "--help")
+    Options options{};
+    for (auto i = 1; i < argc; ++i)
     {
-        std::cout << UsageInformation << std::endl;
-        return 0;
+        auto const argument = std::string(argv[i]);
+
+        if (argument == "--help")
+        {
+            std::cout << UsageInformation << std::endl;
+            return 0;
+        }
+
+        if (argument == "--version")
+        {
+            std::cout << PANCAKE_VERSION << std::endl;
+            return 0;
+        }
+
+        if (argument == "--stack-size")
+        {
+            if (i + 1 >= argc || !TryParseSize(argv[++i], options.stackCapacity))
+            {
+                std::cerr << "--stack-size expects a positive number of words." << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (argument == "--heap-size")
+        {
+            if (i + 1 >= argc || !TryParseSize(argv[++i], options.heapSize))
+            {
+                std::cerr << "--heap-size expects a positive number of words." << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (argument == "--call-depth")
+        {
+            if (i + 1 >= argc || !TryParseSize(argv[++i], options.returnStackCapacity))
+            {
+                std::cerr << "--call-depth expects a positive number of calls." << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (argument == "--jit")
+        {
+            options.jit = true;
+            continue;
+        }
+
+        if (argument == "--emit-c")
+        {
+            options.emitC = true;
+            continue;
+        }
+
+        if (argument == "--emit-bytecode")
+        {
+            options.emitBytecode = true;
+            continue;
+        }
+
+        if (argument == "--cache")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "--cache expects a directory." << std::endl;
+                return -1;
+            }
+            options.cacheDirectory = argv[++i];
+            continue;
+        }
+
+        if (argument == "--snapshot")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "--snapshot expects a path." << std::endl;
+                return -1;
+            }
+            options.snapshotPath = argv[++i];
+            continue;
+        }
+
+        if (argument == "--trace")
+        {
+            options.trace = true;
+            continue;
+        }
+
+        if (argument == "--break")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "--break expects a label." << std::endl;
+                return -1;
+            }
+            options.breakpoints.emplace_back(argv[++i]);
+            continue;
+        }
+
+        if (argument == "--trace-buffer")
+        {
+            if (i + 1 >= argc || !TryParseSize(argv[++i], options.traceBufferSize))
+            {
+                std::cerr << "--trace-buffer expects a positive number of instructions." << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (argument == "--trace-json")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "--trace-json expects a path." << std::endl;
+                return -1;
+            }
+            options.traceJsonPath = argv[++i];
+            continue;
+        }
+
+        if (argument == "--unchecked")
+        {
+            options.unchecked = true;
+            continue;
+        }
+
+        if (argument == "--profile")
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "--profile expects a path." << std::endl;
+                return -1;
+            }
+            options.profilePath = argv[++i];
+            continue;
+        }
+
+        if (argument == "--line-buffered")
+        {
+            options.lineBuffered = true;
+            continue;
+        }
+
+        if (argument == "--binary")
+        {
+            options.binary = true;
+            continue;
+        }
+
+        if (argument == "--check")
+        {
+            options.check = true;
+            continue;
+        }
+
+        if (argument == "--batch")
+        {
+            options.batch = true;
+            continue;
+        }
+
+        if (argument == "--corpus")
+        {
+            options.corpus = true;
+            continue;
+        }
+
+        if (argument == "--warm-start")
+        {
+            options.warmStart = true;
+            continue;
+        }
+
+        if (argument == "--threads")
+        {
+            if (i + 1 >= argc || !TryParseSize(argv[++i], options.threadCount))
+            {
+                std::cerr << "--threads expects a positive number of threads." << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (argument.size() >= 2 && argument[0] == '-' && argument[1] == 'O')
+        {
+            if (argument.size() != 3 || argument[2] < '0' || argument[2] > '0' + Pancake::MaxOptimizationLevel)
+            {
+                std::cerr << "-O expects an optimization level from 0 to " << Pancake::MaxOptimizationLevel << "." << std::endl;
+                return -1;
+            }
+            options.optimizationLevel = argument[2] - '0';
+            continue;
+        }
+
+        options.paths.push_back(argument);
     }
 
-    if (argument == "--version")
+    if (options.binary && (options.batch || options.emitC))
     {
-        std::cout << PANCAKE_VERSION << std::endl;
-        return 0;
+        std::cerr << "--binary cannot be combined with --batch or --emit-c." << std::endl;
+        return -1;
+    }
+
+    if (options.batch)
+    {
+        return BatchRunner(options).Run() ? 0 : 1;
     }
 
-    std::ifstream input(argument);
-    if (!input.good())
+    SourceFile source{};
+    if (options.paths.empty() || !source.Load(options.paths.back()))
     {
         std::cerr << "Could not open input file." << std::endl;
         return -1;
     }
+    auto const program = source.Text();
+
+    // Each combination of features runs on a virtual machine built with only those features.
+    auto const ringTraced = options.traceBufferSize != 0 || !options.traceJsonPath.empty();
+    if (options.binary)
+    {
+        if (options.trace || ringTraced || !options.breakpoints.empty())
+        {
+            std::cerr << "--binary cannot be combined with tracing or --break." << std::endl;
+            return -1;
+        }
+        if (options.unchecked)
+        {
+            return RunProgram<Pancake::UncheckedBinaryPancakeVirtualMachine>(options, program);
+        }
+        return RunProgram<Pancake::BinaryPancakeVirtualMachine>(options, program);
+    }
 
-    std::stringstream programStream;
-    programStream << input.rdbuf();
-    auto program = programStream.str();
-    input.close();
+    if (options.unchecked)
+    {
+        if (options.trace || ringTraced || !options.breakpoints.empty())
+        {
+            std::cerr << "--unchecked cannot be combined with tracing or --break." << std::endl;
+            return -1;
+        }
+        return RunProgram<Pancake::UncheckedPancakeVirtualMachine>(options, program);
+    }
 
-    auto interpreter = Pancake::PancakeInterpreter();
-    interpreter.Interpret(program);
+    if (ringTraced)
+    {
+        if (options.trace || !options.breakpoints.empty())
+        {
+            std::cerr << "--trace-buffer and --trace-json cannot be combined with --trace or --break." << std::endl;
+            return -1;
+        }
+        return RunProgram<Pancake::RingTracedPancakeVirtualMachine>(options, program);
+    }
+
+    if (!options.breakpoints.empty())
+    {
+        auto debugOptions = options;
+        debugOptions.optimizationLevel = std::min(options.optimizationLevel, MaxBreakpointOptimizationLevel);
+        return RunProgram<Pancake::DebugPancakeVirtualMachine>(debugOptions, program);
+    }
+
+    if (options.trace)
+    {
+        return RunProgram<Pancake::TracedPancakeVirtualMachine>(options, program);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return RunProgram<Pancake::PancakeVirtualMachine>(options, program);
+}
@@ -24,30 +24,67 @@
 #define PANCAKE
 #define PANCAKE_VERSION "0.2.0"
 
+// Threaded dispatch uses the labels as values extension, so it is only
+// enabled by default for compilers which support it.
+#ifndef PANCAKE_THREADED_DISPATCH
+    #if defined(__GNUC__) || defined(__clang__)
+        #define PANCAKE_THREADED_DISPATCH 1
+    #else
+        #define PANCAKE_THREADED_DISPATCH 0
+    #endif
+#endif
+
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <string>
-#include <stack>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <vector>
 #include <unordered_map>
 #include <unordered_set>
+#include <map>
+#include <tuple>
 #include <iostream>
+#include <sstream>
+#include <iomanip>
 #include <stdexcept>
 #include <algorithm>
-#include <functional>
+#include <array>
+#include <exception>
+#include <iterator>
+#include <utility>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// The JIT compiler emits x86-64 code using the System V calling convention.
+#ifndef PANCAKE_JIT_AVAILABLE
+    #if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+        #define PANCAKE_JIT_AVAILABLE 1
+    #else
+        #define PANCAKE_JIT_AVAILABLE 0
+    #endif
+#endif
+
+#if PANCAKE_JIT_AVAILABLE
+    #include <sys/mman.h>
+#endif
 
 namespace Pancake
 {
     /// The size of a single word in the stack.
     using Word = uint64_t;
 
-    /// The type used for the operand stack.
-    using Stack = std::stack<Word>;
-
-    /// Memory is a store of named values.
-    using Memory = std::unordered_map<std::string, Word>;
-
     /// The type of the instruction pointer.
-    using InstructionPointer = std::string::size_type;
+    using InstructionPointer = std::size_t;
 
     /// Maps strings to instruction pointers.
     using InstructionPointerMap = std::unordered_map<std::string, InstructionPointer>;
@@ -59,6 +96,9 @@ namespace Pancake
         /// the requested operation.
         StackExhaustion,
 
+        /// Thrown when attempting to push to a full stack.
+        StackOverflow,
+
         /// Thrown when attempting to load an undefined variable.
         UndefinedVariable,
 
@@ -74,10 +114,52 @@ namespace Pancake
         /// Thrown when a string does not conform to the Pancake language.
         InvalidLanguage,
 
+        /// Thrown when input is not a number, or ends part way through a binary word.
+        InvalidInput,
+
+        /// Thrown when there is no more input. Handled by an InvalidInput handler if there is no EndOfInput handler.
+        EndOfInput,
+
+        /// Thrown when attempting to divide by zero or take a remainder modulo zero.
+        DivisionByZero,
+
+        /// Thrown when attempting to access a word outside of the heap.
+        HeapOutOfBounds,
+
+        /// Thrown when attempting to call a subroutine with a full return stack.
+        ReturnStackOverflow,
+
+        /// Thrown when attempting to return with an empty return stack.
+        ReturnStackExhaustion,
+
         /// Thrown by the user using the PANic (p{}) instruction.
         User
     };
 
+    /// The number of PANic types.
+    constexpr std::size_t PanicTypeCount = static_cast<std::size_t>(PanicType::User) + 1;
+
+    /// Gets the name a handler (h{}) uses to catch a PANic raised by the virtual machine itself.
+    /// @param type The PANic type.
+    /// @returns The name, or nullptr for PANics which cannot be handled.
+    constexpr char const* GetPanicHandlerName(PanicType const type) noexcept
+    {
+        switch (type)
+        {
+            case PanicType::StackExhaustion: return "StackExhaustion";
+            case PanicType::StackOverflow: return "StackOverflow";
+            case PanicType::UndefinedVariable: return "UndefinedVariable";
+            case PanicType::UnrecognisedOpcode: return "UnrecognisedOpcode";
+            case PanicType::InvalidInput: return "InvalidInput";
+            case PanicType::EndOfInput: return "EndOfInput";
+            case PanicType::DivisionByZero: return "DivisionByZero";
+            case PanicType::HeapOutOfBounds: return "HeapOutOfBounds";
+            case PanicType::ReturnStackOverflow: return "ReturnStackOverflow";
+            case PanicType::ReturnStackExhaustion: return "ReturnStackExhaustion";
+            default: return nullptr;
+        }
+    }
+
     /// Thrown when the Pancake virtual machine or interpreter PANics.
     class PancakePanic final : public std::runtime_error
     {
@@ -109,543 +191,7598 @@ namespace Pancake
             PanicType _type;
     };
 
-    /// A stack virtual machine architecture for the Pancake programming language.
-    class PancakeVirtualMachine final
+    /// The default number of words the operand stack can hold.
+    constexpr std::size_t DefaultStackCapacity = std::size_t(1) << 20;
+
+    /// A contiguous, fixed capacity operand stack.
+    /// The top word is cached outside of the buffer so that most operations touch at most one buffered word.
+    class OperandStack final
     {
         public:
-            /// Gets a value indicating whether or not a program is running on the virtual machine.
-            bool IsRunning() const noexcept
+            /// Initializes a new instance of the OperandStack class.
+            /// @param capacity The maximum number of words the stack can hold.
+            explicit OperandStack(std::size_t const capacity = DefaultStackCapacity)
+                : _capacity(capacity), _buffer(new Word[capacity + 1])
             {
-                return _running;
             }
 
-            /// Gets the current value of the instruction pointer.
-            std::string::size_type GetInstructionPointer() const noexcept
+            /// Gets the number of words on the stack.
+            std::size_t Size() const noexcept
             {
-                return _instructionPointer;
+                return _size;
             }
 
-            /// Initializes the virtual machine ready for instructions to be dispatched.
-            void InitializeForNewProgram(std::string const& program)
+            /// Gets a value indicating whether or not the stack is empty.
+            bool Empty() const noexcept
             {
-                _running = true;
-                _instructionPointer = 0;
-                _program = program;
-                _stack = Stack();
-                _memory = Memory();
-                _labels = InstructionPointerMap();
-                _panicHandlers = InstructionPointerMap();
+                return _size == 0;
             }
 
-            /// Dispatches the opcode with no arguments to the virtual machine.
-            /// @param opcode The opcode to dispatch.
-            void DispatchInstruction(char const opcode)
+            /// Gets a value indicating whether or not the stack is full.
+            bool Full() const noexcept
             {
-                switch (opcode)
-                {
-                    case '|':
-                        _running = false;
-                        break;
-
-                    case '^':
-                        _stack.push(0);
-                        break;
-
-                    case ';':
-                        VerifyUnaryOperation();
-                        _stack.pop();
-                        break;
-
-                    case '&':
-                        VerifyUnaryOperation();
-                        _stack.push(_stack.top());
-                        break;
+                return _size == _capacity;
+            }
 
-                    case '$':
-                    {
-                        VerifyBinaryOperation();
-                        auto const top = _stack.top();
-                        _stack.pop();
-                        auto const second = _stack.top();
-                        _stack.pop();
-                        _stack.push(top);
-                        _stack.push(second);
-                        break;
-                    }
+            /// Gets the maximum number of words the stack can hold.
+            std::size_t Capacity() const noexcept
+            {
+                return _capacity;
+            }
 
-                    case '~':
-                        ReverseStack();
-                        break;
+            /// Gets the largest number of words that have been on the stack since it was last cleared.
+            std::size_t HighWaterMark() const noexcept
+            {
+                return _highWaterMark;
+            }
 
-                    case '\'':
-                    {
-                        VerifyBinaryOperation();
-                        auto const top = _stack.top();
-                        _stack.pop();
-                        auto const second = _stack.top();
-                        _stack.push(top);
-                        _stack.push(second);
-                        break;
-                    }
+            /// Gets the top word of the stack. The stack must not be empty.
+            Word& Top() noexcept
+            {
+                return _top;
+            }
 
-                    case '+':
-                    {
-                        PerformBinaryOperation([](auto a, auto b) { return a + b; });
-                        break;
-                    }
+            /// Gets the second word of the stack. The stack must hold at least two words.
+            Word& Second() noexcept
+            {
+                return _buffer[_size - 1];
+            }
 
-                    case '-':
-                    {
-                        PerformBinaryOperation([](auto a, auto b) { return a - b; });
-                        break;
-                    }
+            /// Pushes a word to the stack.
+            /// @param value The word to push.
+            void Push(Word const value)
+            {
+                if (_size == _capacity)
+                {
+                    throw PancakePanic(PanicType::StackOverflow, "Attempted to push to a full stack.");
+                }
 
-                    case '*':
-                    {
-                        PerformBinaryOperation([](auto a, auto b) { return a * b; });
-                        break;
-                    }
+                PushUnchecked(value);
+            }
 
-                    case '/':
-                    {
-                        PerformBinaryOperation([](auto a, auto b) { return a / b; });
-                        break;
-                    }
+            /// Pushes a word to the stack. The stack must not be full.
+            /// @param value The word to push.
+            void PushUnchecked(Word const value) noexcept
+            {
+                // The buffer holds everything below the top word, offset by one so that
+                // pushing to and popping from an empty stack need no special case.
+                _buffer[_size] = _top;
+                _top = value;
+                ++_size;
+                if (_size > _highWaterMark)
+                {
+                    _highWaterMark = _size;
+                }
+            }
 
-                    case '%':
-                    {
-                        PerformBinaryOperation([](auto a, auto b) { return a % b; });
-                        break;
-                    }
+            /// Removes and returns the top word of the stack. The stack must not be empty.
+            Word Pop() noexcept
+            {
+                auto const value = _top;
+                --_size;
+                _top = _buffer[_size];
+                return value;
+            }
 
-                    case '>':
-                        VerifyUnaryOperation();
-                        ++_stack.top();
-                        break;
+            /// Reverses the words on the stack in place.
+            void Reverse() noexcept
+            {
+                if (_size < 2)
+                {
+                    return;
+                }
 
-                    case '<':
-                        VerifyUnaryOperation();
-                        --_stack.top();
-                        break;
+                _buffer[_size] = _top;
+                ReverseWords(_buffer.get() + 1, _size);
+                _top = _buffer[_size];
+            }
 
-                    case '[':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return a << b; });
-                        break;
+            /// Gets a word by its depth below the top of the stack, the top being at depth 0.
+            /// @param depth The depth, which must be less than the size of the stack.
+            Word Peek(std::size_t const depth) const noexcept
+            {
+                return depth == 0 ? _top : _buffer[_size - depth];
+            }
 
-                    case ']':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return a >> b; });
-                        break;
+            /// Removes every word from the stack.
+            void Clear() noexcept
+            {
+                _size = 0;
+                _highWaterMark = 0;
+            }
 
-                    case 'n':
-                    {
-                        VerifyUnaryOperation();
-                        auto const top = _stack.top();
-                        _stack.pop();
-                        _stack.push(~top);
-                        break;
-                    }
+        private:
+            template <typename TStackPolicy, typename TTracePolicy, typename TBreakpointPolicy, typename TIoPolicy>
+            friend class BasicPancakeVirtualMachine;
 
-                    case 'a':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return a & b; });
-                        break;
+            std::size_t _capacity;
+            std::unique_ptr<Word[]> _buffer;
+            std::size_t _size = 0;
+            std::size_t _highWaterMark = 0;
+            Word _top = 0;
 
-                    case 'o':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return a | b; });
-                        break;
+            static void ReverseWords(Word* const words, std::size_t const count) noexcept
+            {
+                auto* front = words;
+                auto* back = words + count;
 
-                    case 'x':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return a ^ b; });
-                        break;
+#if defined(__SSE2__)
+                // Swap two words at a time from each end, exchanging the halves of each pair.
+                while (back - front >= 4)
+                {
+                    back -= 2;
+                    auto const frontPair = _mm_loadu_si128(reinterpret_cast<__m128i const*>(front));
+                    auto const backPair = _mm_loadu_si128(reinterpret_cast<__m128i const*>(back));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(front), _mm_shuffle_epi32(backPair, _MM_SHUFFLE(1, 0, 3, 2)));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(back), _mm_shuffle_epi32(frontPair, _MM_SHUFFLE(1, 0, 3, 2)));
+                    front += 2;
+                }
+#endif
 
-                    case 'E':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a == (Word)b); });
-                        break;
+                std::reverse(front, back);
+            }
+    };
 
-                    case 'G':
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a > (Word)b); });
-                        break;
+    /// The default number of return addresses the return stack can hold, and so the deepest subroutine calls can nest.
+    constexpr std::size_t DefaultReturnStackCapacity = std::size_t(1) << 12;
 
-                    case 'L':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a < (Word)b); });
-                        break;
+    /// A contiguous, fixed capacity stack of the addresses subroutine calls return to.
+    class ReturnStack final
+    {
+        public:
+            /// Initializes a new instance of the ReturnStack class.
+            /// @param capacity The maximum number of return addresses the stack can hold.
+            explicit ReturnStack(std::size_t const capacity = DefaultReturnStackCapacity)
+                : _capacity(capacity), _buffer(new InstructionPointer[capacity])
+            {
+            }
 
-                    case 'g':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a >= (Word)b); });
-                        break;
+            /// Gets the number of return addresses on the stack.
+            std::size_t Size() const noexcept
+            {
+                return _size;
+            }
 
-                    case 'l':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a <= (Word)b); });
-                        break;
+            /// Gets a value indicating whether or not the stack is empty.
+            bool Empty() const noexcept
+            {
+                return _size == 0;
+            }
 
-                    case 'N':
-                    {
-                        VerifyUnaryOperation();
-                        auto const value = _stack.top();
-                        _stack.pop();
-                        _stack.push(!((Word)value));
-                        break;
-                    }
+            /// Gets a value indicating whether or not the stack is full.
+            bool Full() const noexcept
+            {
+                return _size == _capacity;
+            }
 
-                    case 'A':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a && (Word)b); });
-                        break;
+            /// Gets the maximum number of return addresses the stack can hold.
+            std::size_t Capacity() const noexcept
+            {
+                return _capacity;
+            }
 
-                    case 'O':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return ((Word)a || (Word)b); });
-                        break;
+            /// Pushes a return address to the stack. The stack must not be full.
+            /// @param address The address.
+            void Push(InstructionPointer const address) noexcept
+            {
+                _buffer[_size++] = address;
+            }
 
-                    case 'X':
-                        VerifyBinaryOperation();
-                        PerformBinaryOperation([](auto a, auto b) { return (!((Word)a) != !((Word)b)); });
-                        break;
+            /// Removes and returns the top return address of the stack. The stack must not be empty.
+            InstructionPointer Pop() noexcept
+            {
+                return _buffer[--_size];
+            }
 
-                    case '.':
-                        VerifyUnaryOperation();
-                        std::cout << static_cast<char>(_stack.top());
-                        _stack.pop();
-                        break;
+            /// Gets a return address by its depth below the top of the stack, the top being at depth 0.
+            /// @param depth The depth, which must be less than the size of the stack.
+            InstructionPointer Peek(std::size_t const depth) const noexcept
+            {
+                return _buffer[_size - 1 - depth];
+            }
 
-                    case '_':
-                        VerifyUnaryOperation();
-                        std::cout << std::to_string(_stack.top());
-                        _stack.pop();
-                        break;
+            /// Removes every return address from the stack.
+            void Clear() noexcept
+            {
+                _size = 0;
+            }
 
-                    case ',':
-                    {
-                        std::string value;
-                        std::cin >> value;
-                        _stack.push(static_cast<Word>(std::stoull(value)));
-                        break;
-                    }
+        private:
+            template <typename TStackPolicy, typename TTracePolicy, typename TBreakpointPolicy, typename TIoPolicy>
+            friend class BasicPancakeVirtualMachine;
 
-                    default:
-                        ThrowForUnrecognisedOpcode(opcode);
-                        break;
-                }
+            std::size_t _capacity;
+            std::unique_ptr<InstructionPointer[]> _buffer;
+            std::size_t _size = 0;
+    };
 
-                ++_instructionPointer;
+    /// Memory is a store of named values.
+    /// Names are interned into slots when a program is compiled, so the memory is a dense table of words.
+    class Memory final
+    {
+        public:
+            /// Clears the memory and sizes it for a program.
+            /// @param slotCount The number of slots the program uses.
+            void Reset(std::size_t const slotCount)
+            {
+                _values.assign(slotCount, 0);
+                _defined.assign((slotCount + 63) / 64, 0);
             }
 
-            /// Dispatches the opcode with a byte argument to the virtual machine.
-            /// @param opcode The opcode to dispatch.
-            /// @param value The byte value in the instruction.
-            void DispatchWordInstruction(char const opcode, Word const value)
+            /// Forgets every stored value without resizing the memory.
+            void Clear() noexcept
             {
-                if (opcode == '^')
-                {
-                    _stack.push(value);
-                    _instructionPointer += std::to_string(value).size() + 3; // todo - improve this
-                }
-                else
-                {
-                    ThrowForUnrecognisedOpcode(opcode);
-                }
+                std::fill(_defined.begin(), _defined.end(), 0);
             }
 
-            /// Dispatches the opcode with a label argument to the virtual machine.
-            /// @param opcode The opcode to dispatch.
-            /// @param label The label in the instruction.
-            void DispatchLabelInstruction(char const opcode, std::string const& label)
+            /// Gets a value indicating whether or not a value has been stored in a slot.
+            /// @param slot The slot.
+            bool IsDefined(std::size_t const slot) const noexcept
             {
-                switch (opcode)
-                {
-                    case 'p':
-                        if (!HandlePanic(label))
-                        {
-                            throw PancakePanic(PanicType::User, label);
-                        }
-                        break;
-
-                    case 'h':
-                        RegisterPanicHandler(label);
-                        break;
-
-                    case ':':
-                    {
-                        auto const jumpAddress = _instructionPointer + label.size() + 3;
-                        _labels[label] = jumpAddress;
-                        _instructionPointer = jumpAddress;
-                        break;
-                    }
+                return (_defined[slot / 64] >> (slot % 64)) & 1;
+            }
 
-                    case 'j':
-                        Jump(label);
-                        break;
+            /// Loads the value stored in a slot.
+            /// @param slot The slot.
+            Word Load(std::size_t const slot) const noexcept
+            {
+                return _values[slot];
+            }
 
-                    case 'z':
-                        VerifyUnaryOperation();
-                        ConditionalJump(_stack.top() == 0, label);
-                        break;
+            /// Stores a value in a slot.
+            /// @param slot The slot.
+            /// @param value The value.
+            void Store(std::size_t const slot, Word const value) noexcept
+            {
+                _values[slot] = value;
+                _defined[slot / 64] |= Word(1) << (slot % 64);
+            }
 
-                    case 'e':
-                    {
-                        VerifyBinaryOperation();
-                        auto const top = _stack.top();
-                        _stack.pop();
-                        ConditionalJump(top == _stack.top(), label);
-                        _stack.push(top);
-                        break;
-                    }
+        private:
+            template <typename TStackPolicy, typename TTracePolicy, typename TBreakpointPolicy, typename TIoPolicy>
+            friend class BasicPancakeVirtualMachine;
+            friend class PancakeBytecode;
 
-                    case '!':
-                        VerifyUnaryOperation();
-                        _memory[label] = _stack.top();
-                        _stack.pop();
-                        _instructionPointer += label.size() + 3;
-                        break;
+            std::vector<Word> _values{};
+            std::vector<Word> _defined{};
+    };
 
-                    case '?':
-                        VerifyRead(label);
-                        _stack.push(_memory[label]);
-                        _instructionPointer += label.size() + 3;
-                        break;
+    /// The default number of words in the heap.
+    constexpr std::size_t DefaultHeapSize = std::size_t(1) << 16;
 
-                    default:
-                        ThrowForUnrecognisedOpcode(opcode);
-                        break;
-                }
+    /// The heap is a contiguous, zero initialized array of words addressed by index.
+    /// Every access is bounds checked by the virtual machine before it reaches the heap.
+    /// The heap tracks how far it has been written, so clearing it only costs as much as the program used.
+    class Heap final
+    {
+        public:
+            /// Resizes the heap, setting every word to zero.
+            /// @param size The number of words.
+            void Reset(std::size_t const size)
+            {
+                _words.assign(size, 0);
+                _highWaterMark = 0;
             }
 
-        private:
-            bool _running = false;
-            InstructionPointer _instructionPointer = 0;
-            std::string _program;
-            Stack _stack{};
-            Memory _memory{};
-            InstructionPointerMap _labels{};
-            InstructionPointerMap _panicHandlers{};
+            /// Sets every word to zero without resizing the heap.
+            void Clear() noexcept
+            {
+                std::fill_n(_words.data(), _highWaterMark, 0);
+                _highWaterMark = 0;
+            }
 
-            void VerifyUnaryOperation() const
+            /// Gets the number of words from the start of the heap which may have been written since it was last cleared.
+            /// Every word after them is zero.
+            std::size_t HighWaterMark() const noexcept
             {
-                if (_stack.empty())
-                {
-                    throw PancakePanic(PanicType::StackExhaustion, "Attempted to perform unary operation on empty stack.");
-                }
+                return _highWaterMark;
             }
 
-            void VerifyBinaryOperation() const
+            /// Gets the number of words in the heap.
+            std::size_t Size() const noexcept
             {
-                if (_stack.size() < 2)
-                {
-                    throw PancakePanic(PanicType::StackExhaustion, "Attempted to perform binary operation with fewer than 2 values on the stack.");
-                }
+                return _words.size();
             }
 
-            void VerifyRead(std::string const& label) const
+            /// Gets a value indicating whether or not a range of words lies within the heap.
+            /// @param address The index of the first word.
+            /// @param count The number of words.
+            bool Contains(Word const address, Word const count) const noexcept
             {
-                if (_memory.find(label) == _memory.end())
-                {
-                    std::stringstream errorStream;
-                    errorStream << "No value stored with name '" << label << "' could be found in memory.\n";
-                    throw PancakePanic(PanicType::UndefinedVariable, errorStream.str());
-                }
+                return count <= _words.size() && address <= _words.size() - count;
             }
 
-            void PerformBinaryOperation(std::function<Word(Word, Word)> const& operation)
+            /// Loads a word.
+            /// @param address The index of the word, which must be within the heap.
+            Word Load(Word const address) const noexcept
             {
-                // Note: the function operands are given in the order (top, second).
+                return _words[address];
+            }
 
-                VerifyBinaryOperation();
-                auto const a = _stack.top();
-                _stack.pop();
-                auto const b = _stack.top();
-                _stack.pop();
-                _stack.push(operation(a, b));
+            /// Stores a word.
+            /// @param address The index of the word, which must be within the heap.
+            /// @param value The value.
+            void Store(Word const address, Word const value) noexcept
+            {
+                _words[address] = value;
+                Touch(address + 1);
             }
 
-            void ReverseStack()
+            /// Sets a range of words to a value.
+            /// @param address The index of the first word. The range must be within the heap.
+            /// @param count The number of words.
+            /// @param value The value.
+            void Fill(Word const address, Word const count, Word const value) noexcept
             {
-                std::stack<Word> newStack{};
-                while (!_stack.empty())
-                {
-                    newStack.push(_stack.top());
-                    _stack.pop();
-                }
-                _stack = newStack;
+                std::fill_n(_words.data() + address, count, value);
+                Touch(address + count);
             }
 
-            void Jump(std::string const& label)
+            /// Copies a range of words, which may overlap the destination.
+            /// @param destination The index of the first word written. The range must be within the heap.
+            /// @param source The index of the first word read. The range must be within the heap.
+            /// @param count The number of words.
+            void Copy(Word const destination, Word const source, Word const count) noexcept
             {
-                if (_labels.find(label) != _labels.end())
+                if (count != 0)
                 {
-                    _instructionPointer = _labels[label];
-                    return;
+                    std::memmove(_words.data() + destination, _words.data() + source, count * sizeof(Word));
+                    Touch(destination + count);
                 }
+            }
 
-                std::stringstream expectedLabelStringStream;
-                expectedLabelStringStream << ":{" << label << "}";
-                auto labelInstruction = expectedLabelStringStream.str();
-                auto foundIndex = _program.find(labelInstruction);
-                if (foundIndex == std::string::npos)
-                {
-                    throw PancakePanic(PanicType::UndefinedLabel, std::string("Cannot jump to label '") + label + "' as it does not exist.");
-                }
+        private:
+            template <typename TStackPolicy, typename TTracePolicy, typename TBreakpointPolicy, typename TIoPolicy>
+            friend class BasicPancakeVirtualMachine;
 
-                auto jumpIndex = foundIndex + labelInstruction.size();
-                _labels[label] = jumpIndex;
-                _instructionPointer = jumpIndex;
-            }
+            std::vector<Word> _words{};
+            std::size_t _highWaterMark = 0;
 
-            void ConditionalJump(bool const condition, std::string const& label)
+            void Touch(Word const end) noexcept
             {
-                // If the condition is true, we need to find the label and jump there.
-                // Otherwise we need to do the usual instruction pointer arithmetic
-                // over the current instruction, label and curly brace characters.
-
-                if (condition)
-                {
-                    Jump(label);
-                }
-                else
-                {
-                    _instructionPointer += label.size() + 3;
-                }
+                _highWaterMark = std::max(_highWaterMark, static_cast<std::size_t>(end));
             }
+    };
 
-            bool HandlePanic(std::string const& panic)
-            {
-                if (_panicHandlers.find(panic) != _panicHandlers.end()) 
-                {
-                    _instructionPointer = _panicHandlers[panic];
-                    return true;
-                }
+    /// A destination for the text written by programs.
+    class OutputSink
+    {
+        public:
+            virtual ~OutputSink() = default;
 
-                std::stringstream expectedHandlerStringStream;
-                expectedHandlerStringStream << "h{" << panic << "}";
-                auto handlerInstruction = expectedHandlerStringStream.str();
-                auto foundIndex = _program.find(expectedHandlerStringStream.str());
-                if (foundIndex == std::string::npos)
-                {
-                    return false;
-                }   
+            /// Writes a run of characters. Sinks may throw, e.g. if one which collects output runs out of memory.
+            /// @param text The characters.
+            /// @param length The number of characters.
+            virtual void Write(char const* text, std::size_t length) = 0;
 
-                auto jumpIndex = foundIndex + handlerInstruction.size();
-                _panicHandlers[panic] = jumpIndex;
-                _instructionPointer = jumpIndex;
+            /// Makes everything written so far visible to readers of the sink.
+            virtual void Flush() noexcept
+            {
+            }
+    };
 
-                return true;
+    /// Writes output to a C file.
+    class FileOutputSink final : public OutputSink
+    {
+        public:
+            /// Initializes a new instance of the FileOutputSink class.
+            /// @param file The file output is written to.
+            explicit FileOutputSink(std::FILE* const file) noexcept
+                : _file(file)
+            {
             }
 
-            void RegisterPanicHandler(std::string const& handlerLabel) 
+            void Write(char const* const text, std::size_t const length) override
             {
-                auto const handlerAddress = _instructionPointer + handlerLabel.size() + 3;
-                if (_panicHandlers.find(handlerLabel) != _panicHandlers.end()) 
-                {
-                    throw PancakePanic(PanicType::MultiplePanicHandlers, std::string("Multiple PANic handlers for '") + handlerLabel + "'.");
-                }
-                _panicHandlers[handlerLabel] = handlerAddress;
-                _instructionPointer = handlerAddress;
+                std::fwrite(text, 1, length, _file);
             }
 
-            static void ThrowForUnrecognisedOpcode(char const opcode)
+            void Flush() noexcept override
             {
-                std::stringstream errorStream;
-                errorStream << "Unrecognised opcode - '" << opcode << "'.\n";
-                throw PancakePanic(PanicType::UnrecognisedOpcode, errorStream.str());
+                std::fflush(_file);
             }
+
+        private:
+            std::FILE* _file;
     };
 
-    /// Interprets Pancake programs.
-    class PancakeInterpreter final
+    /// Collects output in a string.
+    class StringOutputSink final : public OutputSink
     {
         public:
-            /// Runs the instructions in the given program until they
-            /// are exhausted or an error is encountered.
-            /// @param program The string containing the program.
-            void Interpret(std::string& program)
+            /// Gets the output collected since the sink was last cleared.
+            std::string const& Text() const noexcept
             {
-                try
-                {
-                    PreProcessProgram(program);
-                    _virtualMachine.InitializeForNewProgram(program);
+                return _text;
+            }
 
-                    while (_virtualMachine.IsRunning())
-                    {
-                        auto const instructionPointer = _virtualMachine.GetInstructionPointer();
-                        auto const instruction = program[instructionPointer];
-                        if (instruction == '\0')
-                        {
-                            break;
-                        }
+            /// Discards the collected output, keeping the allocated storage.
+            void Clear() noexcept
+            {
+                _text.clear();
+            }
 
-                        if (program[instructionPointer + 1] == '{')
-                        {
-                            auto nextClosingBraceIndex = program.find('}', instructionPointer);
-                            if (nextClosingBraceIndex == std::string::npos)
+            void Write(char const* const text, std::size_t const length) override
+            {
+                _text.append(text, length);
+            }
+
+        private:
+            std::string _text{};
+    };
+
+    /// Gets the sink which writes to standard output.
+    inline OutputSink& StandardOutputSink() noexcept
+    {
+        static FileOutputSink sink(stdout);
+        return sink;
+    }
+
+    /// A source of the text read by programs.
+    class InputSource
+    {
+        public:
+            /// Returned by Get when no more input is available yet, but the input has not ended.
+            static constexpr int Pending = EOF - 1;
+
+            virtual ~InputSource() = default;
+
+            /// Reads the next character.
+            /// @returns The character as an unsigned char converted to an int, EOF at the end of the input,
+            /// or Pending if the next character is not available yet.
+            virtual int Get() noexcept = 0;
+
+            /// Reads up to count characters, for readers which consume the input in blocks.
+            /// @param buffer The buffer the characters are copied to.
+            /// @param count The maximum number of characters read, which must not be zero.
+            /// @returns The number of characters read, or EOF or Pending if none could be read.
+            virtual std::ptrdiff_t Read(char* const buffer, std::size_t const count) noexcept
+            {
+                std::size_t size = 0;
+                while (size < count)
+                {
+                    auto const character = Get();
+                    if (character == EOF || character == Pending)
+                    {
+                        return size != 0 ? static_cast<std::ptrdiff_t>(size) : character;
+                    }
+                    buffer[size++] = static_cast<char>(character);
+                }
+                return static_cast<std::ptrdiff_t>(size);
+            }
+    };
+
+    /// Reads input from a C file.
+    class FileInputSource final : public InputSource
+    {
+        public:
+            /// Initializes a new instance of the FileInputSource class.
+            /// @param file The file input is read from.
+            explicit FileInputSource(std::FILE* const file) noexcept
+                : _file(file)
+            {
+            }
+
+            int Get() noexcept override
+            {
+                return std::getc(_file);
+            }
+
+            std::ptrdiff_t Read(char* const buffer, std::size_t const count) noexcept override
+            {
+                auto const size = std::fread(buffer, 1, count, _file);
+                return size != 0 ? static_cast<std::ptrdiff_t>(size) : EOF;
+            }
+
+        private:
+            std::FILE* _file;
+    };
+
+    /// Reads input from a string which is not owned by the source.
+    class StringInputSource final : public InputSource
+    {
+        public:
+            /// Initializes a new instance of the StringInputSource class.
+            /// @param text The input.
+            explicit StringInputSource(std::string_view const text = {}) noexcept
+                : _text(text)
+            {
+            }
+
+            /// Replaces the input and reads it from the start.
+            /// @param text The input.
+            void Reset(std::string_view const text) noexcept
+            {
+                _text = text;
+                _position = 0;
+            }
+
+            int Get() noexcept override
+            {
+                return _position < _text.size() ? static_cast<unsigned char>(_text[_position++]) : EOF;
+            }
+
+            std::ptrdiff_t Read(char* const buffer, std::size_t const count) noexcept override
+            {
+                auto const size = std::min(count, _text.size() - _position);
+                if (size == 0)
+                {
+                    return EOF;
+                }
+                std::memcpy(buffer, _text.data() + _position, size);
+                _position += size;
+                return static_cast<std::ptrdiff_t>(size);
+            }
+
+        private:
+            std::string_view _text;
+            std::size_t _position = 0;
+    };
+
+    /// Reads input which is added while programs run, for programs which are suspended rather than
+    /// blocked while they wait for it. Input can be added from any thread.
+    class QueueInputSource final : public InputSource
+    {
+        public:
+            /// Adds input to the end of the queue.
+            /// @param text The input.
+            void Append(std::string_view const text)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _text.erase(0, _position);
+                _position = 0;
+                _text.append(text);
+            }
+
+            /// Marks the end of the input, after anything already queued has been read.
+            void Close() noexcept
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _closed = true;
+            }
+
+            int Get() noexcept override
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_position < _text.size())
+                {
+                    return static_cast<unsigned char>(_text[_position++]);
+                }
+                return _closed ? EOF : Pending;
+            }
+
+            std::ptrdiff_t Read(char* const buffer, std::size_t const count) noexcept override
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto const size = std::min(count, _text.size() - _position);
+                if (size == 0)
+                {
+                    return _closed ? EOF : Pending;
+                }
+                std::memcpy(buffer, _text.data() + _position, size);
+                _position += size;
+                return static_cast<std::ptrdiff_t>(size);
+            }
+
+        private:
+            std::mutex _mutex{};
+            std::string _text{};
+            std::size_t _position = 0;
+            bool _closed = false;
+    };
+
+    /// Gets the source which reads from standard input.
+    inline InputSource& StandardInputSource() noexcept
+    {
+        static FileInputSource source(stdin);
+        return source;
+    }
+
+    /// The default number of bytes of output held before it is written.
+    constexpr std::size_t DefaultOutputBufferSize = std::size_t(1) << 16;
+
+    /// Enumerates when buffered output is written, in addition to when the buffer is full,
+    /// before input is read and when a program terminates or PANics.
+    enum class FlushPolicy
+    {
+        /// Output is written only when one of the events above happens.
+        Buffered,
+
+        /// Output is also written at the end of every line.
+        Line
+    };
+
+    /// Buffers the text written by a program.
+    /// Numbers are formatted by hand, so writing never allocates.
+    class OutputBuffer final
+    {
+        public:
+            /// Initializes a new instance of the OutputBuffer class.
+            /// @param sink The sink output is written to, which must outlive the buffer.
+            /// @param capacity The number of bytes held before output is written.
+            explicit OutputBuffer(OutputSink& sink = StandardOutputSink(), std::size_t const capacity = DefaultOutputBufferSize)
+                : _sink(&sink), _capacity(capacity), _buffer(new char[capacity])
+            {
+            }
+
+            OutputBuffer(OutputBuffer const&) = delete;
+            OutputBuffer& operator=(OutputBuffer const&) = delete;
+
+            ~OutputBuffer()
+            {
+                // A destructor cannot report a sink which fails, so what is left is only written if it can be.
+                try
+                {
+                    Flush();
+                }
+                catch (...)
+                {
+                }
+            }
+
+            /// Sets when output is written.
+            /// @param policy The flush policy.
+            void SetFlushPolicy(FlushPolicy const policy) noexcept
+            {
+                _policy = policy;
+            }
+
+            /// Flushes any buffered output and writes to another sink from now on.
+            /// @param sink The sink, which must outlive the buffer.
+            void SetSink(OutputSink& sink)
+            {
+                Flush();
+                _sink = &sink;
+            }
+
+            /// Writes a single character.
+            /// @param character The character.
+            void Put(char const character)
+            {
+                if (_size == _capacity)
+                {
+                    Flush();
+                }
+
+                _buffer[_size++] = character;
+                if (character == '\n' && _policy == FlushPolicy::Line)
+                {
+                    Flush();
+                }
+            }
+
+            /// Writes a run of characters.
+            /// @param text The characters.
+            /// @param length The number of characters.
+            void Write(char const* const text, std::size_t const length)
+            {
+                if (length > _capacity - _size)
+                {
+                    Flush();
+                    if (length >= _capacity)
+                    {
+                        _sink->Write(text, length);
+                        _sink->Flush();
+                        return;
+                    }
+                }
+
+                std::memcpy(_buffer.get() + _size, text, length);
+                _size += length;
+                if (_policy == FlushPolicy::Line && std::memchr(text, '\n', length) != nullptr)
+                {
+                    Flush();
+                }
+            }
+
+            /// Writes a word as a decimal number.
+            /// @param value The word.
+            void WriteNumber(Word value)
+            {
+                char digits[20];
+                auto* const end = digits + sizeof(digits);
+                auto* start = end;
+                do
+                {
+                    *--start = static_cast<char>('0' + value % 10);
+                    value /= 10;
+                } while (value != 0);
+
+                Write(start, static_cast<std::size_t>(end - start));
+            }
+
+            /// Writes a word as eight raw bytes, least significant first.
+            /// @param value The word.
+            void WriteWord(Word const value)
+            {
+                char bytes[sizeof(Word)];
+                for (std::size_t i = 0; i < sizeof(Word); ++i)
+                {
+                    bytes[i] = static_cast<char>(static_cast<unsigned char>(value >> (i * 8)));
+                }
+
+                // Bypasses Write, since a newline byte inside a word is not the end of a line.
+                if (_capacity - _size < sizeof(Word))
+                {
+                    Flush();
+                    if (_capacity < sizeof(Word))
+                    {
+                        _sink->Write(bytes, sizeof(Word));
+                        return;
+                    }
+                }
+                std::memcpy(_buffer.get() + _size, bytes, sizeof(Word));
+                _size += sizeof(Word);
+            }
+
+            /// Writes any buffered output to the sink.
+            void Flush()
+            {
+                // The buffer is emptied first, so output a failed write could not take is dropped rather than written twice.
+                if (_size != 0)
+                {
+                    auto const size = std::exchange(_size, 0);
+                    _sink->Write(_buffer.get(), size);
+                }
+                _sink->Flush();
+            }
+
+        private:
+            OutputSink* _sink;
+            std::size_t _capacity;
+            std::unique_ptr<char[]> _buffer;
+            std::size_t _size = 0;
+            FlushPolicy _policy = FlushPolicy::Buffered;
+    };
+
+    /// Enumerates the results of reading a number from the input.
+    enum class InputStatus
+    {
+        /// A number was read.
+        Number,
+
+        /// The next token was not a decimal number which fits in a word.
+        Invalid,
+
+        /// There was no more input.
+        EndOfInput,
+
+        /// The input ended part way through a binary word.
+        Truncated,
+
+        /// The rest of the next token is not available yet. Reading again continues the token.
+        Pending
+    };
+
+    /// Reads whitespace separated decimal numbers from an input source.
+    class InputReader final
+    {
+        public:
+            /// Initializes a new instance of the InputReader class.
+            /// @param source The source input is read from, which must outlive the reader.
+            explicit InputReader(InputSource& source = StandardInputSource()) noexcept
+                : _source(&source)
+            {
+            }
+
+            /// Reads from another source from now on.
+            /// @param source The source, which must outlive the reader.
+            void SetSource(InputSource& source) noexcept
+            {
+                _source = &source;
+                _inToken = false;
+                _valid = true;
+                _value = 0;
+            }
+
+            /// Reads the next whitespace separated token as a decimal number.
+            /// An invalid token is consumed so that reading can continue after it.
+            /// @param value Set to the number read.
+            /// @returns Whether or not a number was read.
+            InputStatus ReadNumber(Word& value) noexcept
+            {
+                constexpr auto maximum = static_cast<Word>(-1);
+                for (;;)
+                {
+                    auto const character = _source->Get();
+                    if (character == InputSource::Pending)
+                    {
+                        return InputStatus::Pending;
+                    }
+
+                    if (character == EOF || IsSpace(character))
+                    {
+                        if (!_inToken)
+                        {
+                            if (character == EOF)
+                            {
+                                return InputStatus::EndOfInput;
+                            }
+                            continue;
+                        }
+
+                        auto const valid = _valid;
+                        value = _value;
+                        _inToken = false;
+                        _valid = true;
+                        _value = 0;
+                        return valid ? InputStatus::Number : InputStatus::Invalid;
+                    }
+
+                    _inToken = true;
+                    auto const digit = static_cast<Word>(character - '0');
+                    if (character < '0' || character > '9' || _value > (maximum - digit) / 10)
+                    {
+                        _valid = false;
+                        continue;
+                    }
+                    _value = _value * 10 + digit;
+                }
+            }
+
+            /// Gets whether the next number can be read without reading from the source.
+            /// @returns False, since text is read from the source a character at a time.
+            bool HasBufferedInput() const noexcept
+            {
+                return false;
+            }
+
+        private:
+            InputSource* _source;
+
+            // The token being read, kept between calls so that a pending read can be continued.
+            bool _inToken = false;
+            bool _valid = true;
+            Word _value = 0;
+
+            static bool IsSpace(int const character) noexcept
+            {
+                return character == ' ' || (character >= '\t' && character <= '\r');
+            }
+    };
+
+    /// The default number of bytes of input read from the source at a time by a BinaryInputReader.
+    constexpr std::size_t DefaultInputBufferSize = std::size_t(1) << 16;
+
+    /// Reads words as eight raw bytes, least significant first, from an input source.
+    /// The source is read in blocks, so a word is only converted rather than parsed.
+    class BinaryInputReader final
+    {
+        public:
+            /// Initializes a new instance of the BinaryInputReader class.
+            /// @param source The source input is read from, which must outlive the reader.
+            /// @param capacity The number of bytes read from the source at a time.
+            explicit BinaryInputReader(InputSource& source = StandardInputSource(), std::size_t const capacity = DefaultInputBufferSize)
+                : _source(&source), _capacity(std::max(capacity, sizeof(Word))), _buffer(new char[_capacity])
+            {
+            }
+
+            /// Reads from another source from now on, discarding any buffered input.
+            /// @param source The source, which must outlive the reader.
+            void SetSource(InputSource& source) noexcept
+            {
+                _source = &source;
+                _position = 0;
+                _size = 0;
+            }
+
+            /// Reads the next word.
+            /// @param value Set to the word read.
+            /// @returns Whether or not a word was read. The bytes of a truncated word are discarded.
+            InputStatus ReadNumber(Word& value) noexcept
+            {
+                while (_size - _position < sizeof(Word))
+                {
+                    if (_position != 0)
+                    {
+                        std::memmove(_buffer.get(), _buffer.get() + _position, _size - _position);
+                        _size -= _position;
+                        _position = 0;
+                    }
+
+                    auto const count = _source->Read(_buffer.get() + _size, _capacity - _size);
+                    if (count == InputSource::Pending)
+                    {
+                        return InputStatus::Pending;
+                    }
+
+                    if (count == EOF)
+                    {
+                        auto const truncated = _size != 0;
+                        _size = 0;
+                        return truncated ? InputStatus::Truncated : InputStatus::EndOfInput;
+                    }
+                    _size += static_cast<std::size_t>(count);
+                }
+
+                auto const* const bytes = reinterpret_cast<unsigned char const*>(_buffer.get() + _position);
+                value = 0;
+                for (std::size_t i = 0; i < sizeof(Word); ++i)
+                {
+                    value |= static_cast<Word>(bytes[i]) << (i * 8);
+                }
+                _position += sizeof(Word);
+                return InputStatus::Number;
+            }
+
+            /// Gets whether the next word can be read without reading from the source.
+            /// @returns Whether or not a whole word is buffered.
+            bool HasBufferedInput() const noexcept
+            {
+                return _size - _position >= sizeof(Word);
+            }
+
+        private:
+            InputSource* _source;
+            std::size_t _capacity;
+            std::unique_ptr<char[]> _buffer;
+
+            // The unread bytes are those in [_position, _size).
+            std::size_t _position = 0;
+            std::size_t _size = 0;
+    };
+
+    /// Enumerates the operations understood by the Pancake virtual machine.
+    enum class Opcode : uint8_t
+    {
+        /// Terminates the program (`|`).
+        Terminate,
+
+        /// Pushes the operand to the stack (`^`).
+        Push,
+
+        /// Removes the top value of the stack (`;`).
+        Pop,
+
+        /// Duplicates the top value of the stack (`&`).
+        Duplicate,
+
+        /// Swaps the top two values of the stack (`$`).
+        Swap,
+
+        /// Reverses the values on the stack (`~`).
+        Reverse,
+
+        /// Pushes a copy of the second value of the stack (`'`).
+        Over,
+
+        /// Arithmetic operations (`+`, `-`, `*`, `/`, `%`, `>`, `<`).
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Modulo,
+        Increment,
+        Decrement,
+
+        /// Bitwise operations (`[`, `]`, `n`, `a`, `o`, `x`).
+        LeftShift,
+        RightShift,
+        BitwiseNot,
+        BitwiseAnd,
+        BitwiseOr,
+        BitwiseXor,
+
+        /// Logical operations (`E`, `G`, `L`, `g`, `l`, `N`, `A`, `O`, `X`).
+        Equal,
+        Greater,
+        Less,
+        GreaterOrEqual,
+        LessOrEqual,
+        LogicalNot,
+        LogicalAnd,
+        LogicalOr,
+        LogicalXor,
+
+        /// I/O operations (`.`, `_`, `,`).
+        OutputCharacter,
+        OutputLiteral,
+        Input,
+
+        /// Raises the PANic whose name index is the operand (`p{}`).
+        Panic,
+
+        /// Jumps to the instruction address in the operand (`j{}`, `z{}`, `e{}`).
+        Jump,
+        JumpIfZero,
+        JumpIfEqual,
+
+        /// Calls the subroutine at the instruction address in the operand, and returns
+        /// to the instruction after the most recent call (`c{}`, `r`).
+        Call,
+        Return,
+
+        /// Stores to and loads from the memory slot in the operand (`!{}`, `?{}`).
+        Store,
+        Load,
+
+        /// Heap operations (`@`, `#`, `F`, `C`).
+        HeapLoad,
+        HeapStore,
+        HeapFill,
+        HeapCopy,
+
+        /// Superinstructions produced by the optimizer from common sequences.
+        /// `^{N}+`, `^{N}*` and `^{N}%` with N in the operand.
+        AddImmediate,
+        MultiplyImmediate,
+        ModuloImmediate,
+
+        /// A run of `>` and `<` adding the operand to the top of the stack.
+        IncrementBy,
+
+        /// `?{x}>!{x}` and `?{x}<!{x}` with the memory slot in the operand.
+        IncrementVariable,
+        DecrementVariable,
+
+        /// `&z{}` with the jump address in the operand.
+        DuplicateJumpIfZero,
+
+        /// `$;`, removing the second value of the stack.
+        Nip,
+
+        /// A run of `^{N}.` printing the literal string whose index is the operand.
+        OutputString,
+
+        /// Raises an UnrecognisedOpcode PANic for the character in the operand.
+        Unrecognised
+    };
+
+    /// The number of opcodes.
+    constexpr std::size_t OpcodeCount = static_cast<std::size_t>(Opcode::Unrecognised) + 1;
+
+    /// Gets the name of an opcode, as used in its enumerator.
+    /// @param opcode The opcode.
+    constexpr char const* GetOpcodeName(Opcode const opcode) noexcept
+    {
+        constexpr char const* names[] =
+        {
+            "Terminate", "Push", "Pop", "Duplicate", "Swap", "Reverse", "Over", "Add", "Subtract", "Multiply", "Divide", "Modulo",
+            "Increment", "Decrement", "LeftShift", "RightShift", "BitwiseNot", "BitwiseAnd", "BitwiseOr", "BitwiseXor", "Equal",
+            "Greater", "Less", "GreaterOrEqual", "LessOrEqual", "LogicalNot", "LogicalAnd", "LogicalOr", "LogicalXor",
+            "OutputCharacter", "OutputLiteral", "Input", "Panic", "Jump", "JumpIfZero", "JumpIfEqual", "Call", "Return", "Store", "Load",
+            "HeapLoad", "HeapStore", "HeapFill", "HeapCopy", "AddImmediate", "MultiplyImmediate", "ModuloImmediate", "IncrementBy", "IncrementVariable", "DecrementVariable",
+            "DuplicateJumpIfZero", "Nip", "OutputString", "Unrecognised"
+        };
+        static_assert(sizeof(names) / sizeof(names[0]) == OpcodeCount, "Every opcode must have a name.");
+
+        return static_cast<std::size_t>(opcode) < OpcodeCount ? names[static_cast<std::size_t>(opcode)] : "Invalid";
+    }
+
+    /// Gets a value indicating whether or not an opcode jumps to the address in its operand.
+    /// @param opcode The opcode.
+    constexpr bool IsJump(Opcode const opcode) noexcept
+    {
+        return opcode == Opcode::Jump
+            || opcode == Opcode::Call
+            || opcode == Opcode::JumpIfZero
+            || opcode == Opcode::JumpIfEqual
+            || opcode == Opcode::DuplicateJumpIfZero;
+    }
+
+    /// Gets a value indicating whether or not an opcode accesses the heap.
+    /// @param opcode The opcode.
+    constexpr bool IsHeapAccess(Opcode const opcode) noexcept
+    {
+        return opcode == Opcode::HeapLoad
+            || opcode == Opcode::HeapStore
+            || opcode == Opcode::HeapFill
+            || opcode == Opcode::HeapCopy;
+    }
+
+    /// The effect an instruction has on the depth of the operand stack.
+    struct StackEffect
+    {
+        /// The depth the stack must have for the instruction not to PANic.
+        std::size_t required;
+
+        /// The change in depth after the instruction succeeds.
+        int change;
+    };
+
+    /// Gets the effect an opcode has on the depth of the operand stack.
+    /// @param opcode The opcode.
+    constexpr StackEffect GetStackEffect(Opcode const opcode) noexcept
+    {
+        switch (opcode)
+        {
+            case Opcode::Push:
+            case Opcode::Input:
+            case Opcode::Load:
+                return { 0, 1 };
+
+            case Opcode::Pop:
+            case Opcode::OutputCharacter:
+            case Opcode::OutputLiteral:
+            case Opcode::Store:
+                return { 1, -1 };
+
+            case Opcode::Duplicate:
+            case Opcode::DuplicateJumpIfZero:
+                return { 1, 1 };
+
+            case Opcode::Increment:
+            case Opcode::Decrement:
+            case Opcode::BitwiseNot:
+            case Opcode::LogicalNot:
+            case Opcode::JumpIfZero:
+            case Opcode::AddImmediate:
+            case Opcode::MultiplyImmediate:
+            case Opcode::ModuloImmediate:
+            case Opcode::IncrementBy:
+            case Opcode::HeapLoad:
+                return { 1, 0 };
+
+            case Opcode::Swap:
+            case Opcode::JumpIfEqual:
+                return { 2, 0 };
+
+            case Opcode::Over:
+                return { 2, 1 };
+
+            case Opcode::HeapStore:
+                return { 2, -2 };
+
+            case Opcode::HeapFill:
+            case Opcode::HeapCopy:
+                return { 3, -3 };
+
+            case Opcode::Add:
+            case Opcode::Subtract:
+            case Opcode::Multiply:
+            case Opcode::Divide:
+            case Opcode::Modulo:
+            case Opcode::LeftShift:
+            case Opcode::RightShift:
+            case Opcode::BitwiseAnd:
+            case Opcode::BitwiseOr:
+            case Opcode::BitwiseXor:
+            case Opcode::Equal:
+            case Opcode::Greater:
+            case Opcode::Less:
+            case Opcode::GreaterOrEqual:
+            case Opcode::LessOrEqual:
+            case Opcode::LogicalAnd:
+            case Opcode::LogicalOr:
+            case Opcode::LogicalXor:
+            case Opcode::Nip:
+                return { 2, -1 };
+
+            default:
+                return { 0, 0 };
+        }
+    }
+
+    /// Gets a value indicating whether or not the virtual machine can raise a PANic of a type while running an opcode.
+    /// @param opcode The opcode.
+    /// @param type The PANic type.
+    constexpr bool CanRaise(Opcode const opcode, PanicType const type) noexcept
+    {
+        switch (type)
+        {
+            case PanicType::StackExhaustion:
+                return GetStackEffect(opcode).required > 0;
+
+            case PanicType::StackOverflow:
+                return GetStackEffect(opcode).change > 0
+                    || opcode == Opcode::AddImmediate || opcode == Opcode::MultiplyImmediate || opcode == Opcode::ModuloImmediate
+                    || opcode == Opcode::IncrementVariable || opcode == Opcode::DecrementVariable || opcode == Opcode::OutputString;
+
+            case PanicType::UndefinedVariable:
+                return opcode == Opcode::Load || opcode == Opcode::IncrementVariable || opcode == Opcode::DecrementVariable;
+
+            case PanicType::UnrecognisedOpcode:
+                return opcode == Opcode::Unrecognised;
+
+            case PanicType::InvalidInput:
+            case PanicType::EndOfInput:
+                return opcode == Opcode::Input;
+
+            case PanicType::DivisionByZero:
+                return opcode == Opcode::Divide || opcode == Opcode::Modulo || opcode == Opcode::ModuloImmediate;
+
+            case PanicType::HeapOutOfBounds:
+                return IsHeapAccess(opcode);
+
+            case PanicType::ReturnStackOverflow:
+                return opcode == Opcode::Call;
+
+            case PanicType::ReturnStackExhaustion:
+                return opcode == Opcode::Return;
+
+            default:
+                return false;
+        }
+    }
+
+    /// A single decoded virtual machine instruction.
+    struct Instruction
+    {
+        /// Initializes a new instance of the Instruction struct.
+        Instruction() = default;
+
+        /// Initializes a new instance of the Instruction struct.
+        /// @param opcode The operation to perform.
+        /// @param operand The decoded argument.
+        constexpr Instruction(Opcode const opcode, Word const operand) noexcept
+            : opcode(opcode), operand(operand)
+        {
+        }
+
+        /// The operation to perform.
+        Opcode opcode = Opcode::Terminate;
+
+        /// Whether or not the stack depth must be checked before the instruction runs.
+        /// This is cleared where analysis proves the stack is always deep enough.
+        bool checkStack = true;
+
+        /// The decoded argument. This is the value to push, the jump address
+        /// or the name index, depending on the opcode.
+        Word operand = 0;
+    };
+
+    /// The handler address of a PANic which has no handler.
+    constexpr InstructionPointer NoPanicHandler = static_cast<InstructionPointer>(-1);
+
+    /// A Pancake program lowered into instructions for the virtual machine.
+    struct CompiledProgram
+    {
+        /// The instructions. The program always ends with a Terminate instruction.
+        std::vector<Instruction> instructions{};
+
+        /// The offset into the source of each instruction.
+        std::vector<std::size_t> sourceOffsets{};
+
+        /// The names used by labels and PANics, indexed by operand.
+        std::vector<std::string> names{};
+
+        /// The name of each memory slot, indexed by operand.
+        std::vector<std::string> variables{};
+
+        /// The handler address for a PANic of each name, or NoPanicHandler.
+        std::vector<InstructionPointer> panicHandlers{};
+
+        /// The literal strings printed by OutputString instructions, indexed by operand.
+        std::vector<std::string> strings{};
+
+        /// The handler address for each type of PANic raised by the virtual machine itself, or NoPanicHandler.
+        std::vector<InstructionPointer> builtInPanicHandlers = std::vector<InstructionPointer>(PanicTypeCount, NoPanicHandler);
+
+        /// The name of each label, in the order the labels are defined in the source.
+        std::vector<std::string> labelNames{};
+
+        /// The address of each label, indexed like labelNames.
+        std::vector<InstructionPointer> labelAddresses{};
+    };
+
+    /// Calls a function with the address of every instruction which can run directly after another.
+    /// PANics lead to their handler, if they have one. Terminating and unrecognised instructions have no successors.
+    /// Calls lead to their subroutine, and returns to the instruction after every call.
+    /// @param program The program.
+    /// @param address The address of the instruction.
+    /// @param function The function to call with each successor address.
+    template <typename TFunction>
+    void ForEachSuccessor(CompiledProgram const& program, InstructionPointer const address, TFunction const& function)
+    {
+        auto const& instruction = program.instructions[address];
+        switch (instruction.opcode)
+        {
+            case Opcode::Terminate:
+            case Opcode::Unrecognised:
+                return;
+
+            case Opcode::Panic:
+            {
+                auto const handlerAddress = program.panicHandlers[instruction.operand];
+                if (handlerAddress != NoPanicHandler)
+                {
+                    function(handlerAddress);
+                }
+                return;
+            }
+
+            case Opcode::Jump:
+            case Opcode::Call:
+                function(static_cast<InstructionPointer>(instruction.operand));
+                return;
+
+            case Opcode::Return:
+                // Any call can be the one returned from, so each instruction after a call is a successor.
+                for (InstructionPointer site = 0; site + 1 < program.instructions.size(); ++site)
+                {
+                    if (program.instructions[site].opcode == Opcode::Call)
+                    {
+                        function(site + 1);
+                    }
+                }
+                return;
+
+            default:
+                if (IsJump(instruction.opcode))
+                {
+                    function(static_cast<InstructionPointer>(instruction.operand));
+                }
+                function(address + 1);
+                return;
+        }
+    }
+
+    /// Calls a function with the address of every handler an instruction can reach by raising a built-in PANic.
+    /// The stack is left as it was before the instruction, or one word deeper when a fused push is completed first.
+    /// @param program The program.
+    /// @param address The address of the instruction.
+    /// @param function The function to call with each handler address.
+    template <typename TFunction>
+    void ForEachBuiltInPanicHandler(CompiledProgram const& program, InstructionPointer const address, TFunction const& function)
+    {
+        auto const opcode = program.instructions[address].opcode;
+        for (std::size_t type = 0; type < PanicTypeCount; ++type)
+        {
+            auto const handlerAddress = program.builtInPanicHandlers[type];
+            if (handlerAddress != NoPanicHandler && CanRaise(opcode, static_cast<PanicType>(type)))
+            {
+                function(handlerAddress);
+            }
+        }
+    }
+
+    /// Bounds on the depth of the operand stack before each instruction of a program,
+    /// found by data flow analysis over every path through the program.
+    class StackDepthAnalysis final
+    {
+        public:
+            /// The maximum depth before an instruction which can be reached with any depth.
+            static constexpr std::size_t Unbounded = static_cast<std::size_t>(-1);
+
+            /// Analyzes a compiled program.
+            /// @param program The program.
+            explicit StackDepthAnalysis(CompiledProgram const& program)
+                : _minimum(program.instructions.size(), Unreached), _maximum(program.instructions.size(), 0)
+            {
+                // Both bounds start at the first instruction with an empty stack. Minimums only
+                // fall and maximums only rise, and past DepthLimit the maximum is widened to
+                // Unbounded, so this reaches a fixed point.
+
+                std::vector<InstructionPointer> pending{ 0 };
+                _minimum[0] = 0;
+                while (!pending.empty())
+                {
+                    auto const address = pending.back();
+                    pending.pop_back();
+
+                    auto const effect = GetStackEffect(program.instructions[address].opcode);
+                    auto const minimum = std::min(std::max(_minimum[address], effect.required) + effect.change, DepthLimit);
+                    auto maximum = _maximum[address];
+                    if (maximum != Unbounded)
+                    {
+                        maximum = std::max(maximum, effect.required) + effect.change;
+                        if (maximum > DepthLimit)
+                        {
+                            maximum = Unbounded;
+                        }
+                    }
+
+                    auto const merge = [&](InstructionPointer const successor, std::size_t const minimum, std::size_t const maximum)
+                    {
+                        if (_minimum[successor] == Unreached)
+                        {
+                            _minimum[successor] = minimum;
+                            _maximum[successor] = maximum;
+                            pending.push_back(successor);
+                        }
+                        else if (minimum < _minimum[successor] || maximum > _maximum[successor])
+                        {
+                            _minimum[successor] = std::min(_minimum[successor], minimum);
+                            _maximum[successor] = std::max(_maximum[successor], maximum);
+                            pending.push_back(successor);
+                        }
+                    };
+
+                    ForEachSuccessor(program, address, [&](InstructionPointer const successor)
+                    {
+                        merge(successor, minimum, maximum);
+                    });
+
+                    // A built-in PANic leaves the stack as it was, or one deeper after a fused push.
+                    auto const panicMaximum = _maximum[address] >= DepthLimit ? Unbounded : _maximum[address] + 1;
+                    ForEachBuiltInPanicHandler(program, address, [&](InstructionPointer const handler)
+                    {
+                        merge(handler, _minimum[address], panicMaximum);
+                    });
+                }
+            }
+
+            /// Gets a value indicating whether or not any path through the program reaches an instruction.
+            /// @param address The address of the instruction.
+            bool IsReachable(InstructionPointer const address) const noexcept
+            {
+                return _minimum[address] != Unreached;
+            }
+
+            /// Gets the smallest depth the stack can have before a reachable instruction.
+            /// @param address The address of the instruction.
+            std::size_t GetMinimumDepth(InstructionPointer const address) const noexcept
+            {
+                return _minimum[address];
+            }
+
+            /// Gets the largest depth the stack can have before a reachable instruction, or Unbounded.
+            /// @param address The address of the instruction.
+            std::size_t GetMaximumDepth(InstructionPointer const address) const noexcept
+            {
+                return _maximum[address];
+            }
+
+        private:
+            static constexpr std::size_t Unreached = static_cast<std::size_t>(-1);
+            static constexpr std::size_t DepthLimit = 64;
+
+            std::vector<std::size_t> _minimum;
+            std::vector<std::size_t> _maximum;
+    };
+
+#if PANCAKE_JIT_AVAILABLE
+    /// The state shared between the virtual machine and code generated by the JIT compiler.
+    /// Generated code keeps the operand stack in registers and writes it back here when it exits.
+    struct JitContext
+    {
+        /// The top word of the operand stack.
+        Word top;
+
+        /// The address one past the last buffered word of the operand stack.
+        Word* stackPointer;
+
+        /// The start of the operand stack buffer.
+        Word* stackBase;
+
+        /// The stack pointer of a full operand stack.
+        Word* stackLimit;
+
+        /// The highest stack pointer reached.
+        Word* highWaterMark;
+
+        /// The memory slot values.
+        Word* memory;
+
+        /// The bitmap of defined memory slots.
+        Word* memoryDefined;
+
+        /// The heap words.
+        Word* heap;
+
+        /// The number of words in the heap.
+        Word heapSize;
+
+        /// The number of words from the start of the heap which may have been written.
+        Word heapHighWaterMark;
+
+        /// The address one past the top return address of the return stack.
+        InstructionPointer* returnStackPointer;
+
+        /// The start of the return stack buffer.
+        InstructionPointer* returnStackBase;
+
+        /// The return stack pointer of a full return stack.
+        InstructionPointer* returnStackLimit;
+
+        /// The address of the instruction the generated code exited at.
+        Word exitAddress;
+
+        /// The virtual machine running the generated code.
+        void* machine;
+    };
+
+    /// The reason generated code returned to the virtual machine.
+    enum class JitStatus : int
+    {
+        /// The program terminated.
+        Halted = 0,
+
+        /// The instruction at the exit address must be run by the interpreter.
+        Fallback = 1
+    };
+
+    /// The runtime functions called by generated code. They cannot throw, as exceptions cannot unwind through generated code,
+    /// so each returns nonzero if writing failed, and generated code then exits to the virtual machine after the instruction.
+    struct JitRuntime
+    {
+        Word (*outputCharacter)(JitContext*, Word) noexcept;
+        Word (*outputLiteral)(JitContext*, Word) noexcept;
+        Word (*outputString)(JitContext*, Word) noexcept;
+    };
+
+    /// Translates compiled programs into x86-64 machine code.
+    ///
+    /// The operand stack lives in registers: r12 holds the top word, r13 the stack pointer,
+    /// r14 the stack base and r15 the stack limit. rbx points to the JitContext and rbp to
+    /// the memory slots. Any instruction whose checks fail, and the few instructions which
+    /// are not translated, exit with JitStatus::Fallback so the interpreter can run them
+    /// with exactly the same behaviour.
+    class PancakeJit final
+    {
+        public:
+            /// Translates a compiled program.
+            /// @param program The program.
+            /// @param runtime The runtime functions called by the generated code.
+            PancakeJit(CompiledProgram const& program, JitRuntime const& runtime)
+            {
+                Translate(program, runtime);
+
+                auto const size = _code.size();
+                auto* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED)
+                {
+                    throw std::runtime_error("Could not allocate memory for JIT compiled code.");
+                }
+
+                std::memcpy(memory, _code.data(), size);
+                if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+                {
+                    munmap(memory, size);
+                    throw std::runtime_error("Could not make JIT compiled code executable.");
+                }
+
+                _executable = static_cast<uint8_t*>(memory);
+                _executableSize = size;
+                _code = std::vector<uint8_t>();
+                for (InstructionPointer address = 0; address < _offsets.size(); ++address)
+                {
+                    _addresses[address] = _executable + _offsets[address];
+                }
+            }
+
+            PancakeJit(PancakeJit const&) = delete;
+            PancakeJit& operator=(PancakeJit const&) = delete;
+
+            ~PancakeJit()
+            {
+                munmap(_executable, _executableSize);
+            }
+
+            /// Runs generated code from an instruction until it exits.
+            /// @param context The context holding the virtual machine state.
+            /// @param address The address of the instruction to start at.
+            /// @returns The reason the generated code exited.
+            JitStatus Enter(JitContext& context, InstructionPointer const address) const
+            {
+                using EntryFunction = int (*)(JitContext*, void const*);
+                auto const entry = reinterpret_cast<EntryFunction>(reinterpret_cast<void*>(_executable));
+                return static_cast<JitStatus>(entry(&context, _executable + _offsets[address]));
+            }
+
+        private:
+            enum Register : int
+            {
+                Rax = 0, Rcx = 1, Rdx = 2, Rbx = 3, Rsp = 4, Rbp = 5, Rsi = 6, Rdi = 7,
+                R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+            };
+
+            enum Condition : uint8_t
+            {
+                Below = 0x2, AboveOrEqual = 0x3, Equal = 0x4, NotEqual = 0x5, BelowOrEqual = 0x6, Above = 0x7
+            };
+
+            /// A rel32 jump which must be patched to point at a target.
+            struct Patch
+            {
+                std::size_t position;
+                InstructionPointer address;
+                JitStatus status;
+            };
+
+            static constexpr Register Top = R12;
+            static constexpr Register StackPointer = R13;
+            static constexpr Register StackBase = R14;
+            static constexpr Register StackLimit = R15;
+            static constexpr Register Context = Rbx;
+            static constexpr Register MemoryBase = Rbp;
+
+            uint8_t* _executable = nullptr;
+            std::size_t _executableSize = 0;
+            std::vector<uint8_t> _code{};
+            std::vector<std::size_t> _offsets{};
+            std::vector<void const*> _addresses{};
+            std::vector<Patch> _jumps{};
+            std::vector<Patch> _exits{};
+
+            void Translate(CompiledProgram const& program, JitRuntime const& runtime)
+            {
+                EmitPrologue();
+                auto const exitOffset = _code.size();
+                EmitEpilogue();
+
+                // Returns jump through a table of the machine code address of each instruction, which is
+                // sized now so that its location can be built into the code and filled in once it is mapped.
+                auto const& instructions = program.instructions;
+                _offsets.resize(instructions.size());
+                _addresses.resize(instructions.size());
+                for (InstructionPointer address = 0; address < instructions.size(); ++address)
+                {
+                    _offsets[address] = _code.size();
+                    TranslateInstruction(program, instructions[address], address, runtime);
+                }
+
+                for (auto const& jump : _jumps)
+                {
+                    PatchRelative(jump.position, _offsets[jump.address]);
+                }
+
+                // Every exit sets the status and exit address then joins the shared epilogue.
+                for (auto const& exit : _exits)
+                {
+                    PatchRelative(exit.position, _code.size());
+                    MoveImmediate32(Rdx, static_cast<uint32_t>(exit.address));
+                    MoveImmediate32(Rax, static_cast<uint32_t>(exit.status));
+                    PatchRelative(Jump(), exitOffset);
+                }
+            }
+
+            void TranslateInstruction(CompiledProgram const& program, Instruction const& instruction, InstructionPointer const address, JitRuntime const& runtime)
+            {
+                auto const operand = instruction.operand;
+                auto const checkDepth = [&](int const depth)
+                {
+                    if (instruction.checkStack)
+                    {
+                        CheckDepth(depth, address);
+                    }
+                };
+
+                switch (instruction.opcode)
+                {
+                    case Opcode::Terminate:
+                        ExitTo(Jump(), address, JitStatus::Halted);
+                        break;
+
+                    case Opcode::Push:
+                        CheckFull(address);
+                        PushTop();
+                        MoveImmediate(Top, operand);
+                        break;
+
+                    case Opcode::Pop:
+                        checkDepth(1);
+                        PopTop();
+                        break;
+
+                    case Opcode::Duplicate:
+                        checkDepth(1);
+                        CheckFull(address);
+                        PushTop();
+                        break;
+
+                    case Opcode::Swap:
+                        checkDepth(2);
+                        LoadSecond(Rax);
+                        MemoryOperation(0x89, Top, StackPointer, -8);
+                        Move(Top, Rax);
+                        break;
+
+                    case Opcode::Over:
+                        checkDepth(2);
+                        CheckFull(address);
+                        LoadSecond(Rax);
+                        PushTop();
+                        Move(Top, Rax);
+                        break;
+
+                    case Opcode::Add:
+                        BinaryOperation(instruction, address, [&] { RegisterOperation(0x01, Rax, Top); });
+                        break;
+
+                    case Opcode::Subtract:
+                        BinaryOperation(instruction, address, [&] { RegisterOperation(0x29, Rax, Top); });
+                        break;
+
+                    case Opcode::Multiply:
+                        BinaryOperation(instruction, address, [&] { Multiply(Top, Rax); });
+                        break;
+
+                    case Opcode::Divide:
+                        DivisionOperation(instruction, address, Rax);
+                        break;
+
+                    case Opcode::Modulo:
+                        DivisionOperation(instruction, address, Rdx);
+                        break;
+
+                    case Opcode::Increment:
+                        checkDepth(1);
+                        ImmediateOperation(0, Top, 1);
+                        break;
+
+                    case Opcode::Decrement:
+                        checkDepth(1);
+                        ImmediateOperation(5, Top, 1);
+                        break;
+
+                    case Opcode::LeftShift:
+                        BinaryOperation(instruction, address, [&] { Move(Rcx, Rax); Shift(4, Top); });
+                        break;
+
+                    case Opcode::RightShift:
+                        BinaryOperation(instruction, address, [&] { Move(Rcx, Rax); Shift(5, Top); });
+                        break;
+
+                    case Opcode::BitwiseNot:
+                        checkDepth(1);
+                        UnaryGroup(2, Top);
+                        break;
+
+                    case Opcode::BitwiseAnd:
+                        BinaryOperation(instruction, address, [&] { RegisterOperation(0x21, Rax, Top); });
+                        break;
+
+                    case Opcode::BitwiseOr:
+                        BinaryOperation(instruction, address, [&] { RegisterOperation(0x09, Rax, Top); });
+                        break;
+
+                    case Opcode::BitwiseXor:
+                        BinaryOperation(instruction, address, [&] { RegisterOperation(0x31, Rax, Top); });
+                        break;
+
+                    case Opcode::Equal:
+                        BinaryOperation(instruction, address, [&] { Compare(Condition::Equal); });
+                        break;
+
+                    case Opcode::Greater:
+                        BinaryOperation(instruction, address, [&] { Compare(Condition::Above); });
+                        break;
+
+                    case Opcode::Less:
+                        BinaryOperation(instruction, address, [&] { Compare(Condition::Below); });
+                        break;
+
+                    case Opcode::GreaterOrEqual:
+                        BinaryOperation(instruction, address, [&] { Compare(Condition::AboveOrEqual); });
+                        break;
+
+                    case Opcode::LessOrEqual:
+                        BinaryOperation(instruction, address, [&] { Compare(Condition::BelowOrEqual); });
+                        break;
+
+                    case Opcode::LogicalNot:
+                        checkDepth(1);
+                        RegisterOperation(0x85, Top, Top);
+                        SetFromCondition(Condition::Equal, Rax);
+                        ZeroExtendByte(Top, Rax);
+                        break;
+
+                    case Opcode::LogicalAnd:
+                        BinaryOperation(instruction, address, [&] { LogicalOperation(0x20); });
+                        break;
+
+                    case Opcode::LogicalOr:
+                        BinaryOperation(instruction, address, [&]
+                        {
+                            RegisterOperation(0x09, Rax, Top);
+                            SetFromCondition(Condition::NotEqual, Rax);
+                            ZeroExtendByte(Top, Rax);
+                        });
+                        break;
+
+                    case Opcode::LogicalXor:
+                        BinaryOperation(instruction, address, [&] { LogicalOperation(0x30); });
+                        break;
+
+                    case Opcode::OutputCharacter:
+                        checkDepth(1);
+                        Move(Rsi, Top);
+                        PopTop();
+                        CallOutput(reinterpret_cast<void const*>(runtime.outputCharacter), address);
+                        break;
+
+                    case Opcode::OutputLiteral:
+                        checkDepth(1);
+                        Move(Rsi, Top);
+                        PopTop();
+                        CallOutput(reinterpret_cast<void const*>(runtime.outputLiteral), address);
+                        break;
+
+                    case Opcode::Panic:
+                    {
+                        auto const handlerAddress = program.panicHandlers[operand];
+                        if (handlerAddress == NoPanicHandler)
+                        {
+                            ExitTo(Jump(), address, JitStatus::Fallback);
+                        }
+                        else
+                        {
+                            _jumps.push_back({ Jump(), handlerAddress, JitStatus::Halted });
+                        }
+                        break;
+                    }
+
+                    case Opcode::Jump:
+                        _jumps.push_back({ Jump(), static_cast<InstructionPointer>(operand), JitStatus::Halted });
+                        break;
+
+                    case Opcode::JumpIfZero:
+                        checkDepth(1);
+                        RegisterOperation(0x85, Top, Top);
+                        _jumps.push_back({ JumpIf(Condition::Equal), static_cast<InstructionPointer>(operand), JitStatus::Halted });
+                        break;
+
+                    case Opcode::JumpIfEqual:
+                        checkDepth(2);
+                        MemoryOperation(0x3B, Top, StackPointer, -8);
+                        _jumps.push_back({ JumpIf(Condition::Equal), static_cast<InstructionPointer>(operand), JitStatus::Halted });
+                        break;
+
+                    case Opcode::Call:
+                        MemoryOperation(0x8B, Rax, Context, offsetof(JitContext, returnStackPointer));
+                        MemoryOperation(0x3B, Rax, Context, offsetof(JitContext, returnStackLimit));
+                        ExitTo(JumpIf(Condition::Equal), address, JitStatus::Fallback);
+                        MoveImmediate(Rcx, address + 1);
+                        MemoryOperation(0x89, Rcx, Rax, 0);
+                        ImmediateOperation(0, Rax, 8);
+                        MemoryOperation(0x89, Rax, Context, offsetof(JitContext, returnStackPointer));
+                        _jumps.push_back({ Jump(), static_cast<InstructionPointer>(operand), JitStatus::Halted });
+                        break;
+
+                    case Opcode::Return:
+                        MemoryOperation(0x8B, Rax, Context, offsetof(JitContext, returnStackPointer));
+                        MemoryOperation(0x3B, Rax, Context, offsetof(JitContext, returnStackBase));
+                        ExitTo(JumpIf(Condition::Equal), address, JitStatus::Fallback);
+                        ImmediateOperation(5, Rax, 8);
+                        MemoryOperation(0x89, Rax, Context, offsetof(JitContext, returnStackPointer));
+                        MemoryOperation(0x8B, Rax, Rax, 0);
+                        MoveImmediate(Rcx, reinterpret_cast<Word>(_addresses.data()));
+
+                        // jmp [rcx + rax * 8]
+                        Emit(0xFF);
+                        Emit(0x24);
+                        Emit(0xC1);
+                        break;
+
+                    case Opcode::Store:
+                        checkDepth(1);
+                        MemoryOperation(0x89, Top, MemoryBase, SlotDisplacement(operand));
+                        MemoryOperation(0x8B, Rax, Context, offsetof(JitContext, memoryDefined));
+                        BitTest(5, Rax, operand);
+                        PopTop();
+                        break;
+
+                    case Opcode::Load:
+                        CheckDefined(operand, address);
+                        CheckFull(address);
+                        PushTop();
+                        MemoryOperation(0x8B, Top, MemoryBase, SlotDisplacement(operand));
+                        break;
+
+                    case Opcode::HeapLoad:
+                        checkDepth(1);
+                        CheckHeapAddress(address);
+                        IndexedMemoryOperation(0x8B, Top, Rax, Top);
+                        break;
+
+                    case Opcode::HeapStore:
+                        checkDepth(2);
+                        CheckHeapAddress(address);
+                        LoadSecond(Rcx);
+                        IndexedMemoryOperation(0x89, Rcx, Rax, Top);
+
+                        // Raise the heap high-water mark past the stored word.
+                        Move(Rcx, Top);
+                        ImmediateOperation(0, Rcx, 1);
+                        MemoryOperation(0x3B, Rcx, Context, offsetof(JitContext, heapHighWaterMark));
+                        Emit(0x76);
+                        Emit(7);
+                        MemoryOperation(0x89, Rcx, Context, offsetof(JitContext, heapHighWaterMark));
+                        ImmediateOperation(5, StackPointer, 16);
+                        MemoryOperation(0x8B, Top, StackPointer, 0);
+                        break;
+
+                    case Opcode::AddImmediate:
+                    case Opcode::MultiplyImmediate:
+                    case Opcode::ModuloImmediate:
+                        // The fused push must still fail on an empty or full stack.
+                        RegisterOperation(0x39, StackBase, StackPointer);
+                        ExitTo(JumpIf(Condition::Equal), address, JitStatus::Fallback);
+                        CheckFull(address);
+                        if (instruction.opcode == Opcode::ModuloImmediate)
+                        {
+                            RegisterOperation(0x85, Top, Top);
+                            ExitTo(JumpIf(Condition::Equal), address, JitStatus::Fallback);
+                        }
+                        MoveImmediate(Rax, operand);
+                        if (instruction.opcode == Opcode::AddImmediate)
+                        {
+                            RegisterOperation(0x01, Rax, Top);
+                        }
+                        else if (instruction.opcode == Opcode::MultiplyImmediate)
+                        {
+                            Multiply(Top, Rax);
+                        }
+                        else
+                        {
+                            Divide(Rax, Top);
+                            Move(Top, Rdx);
+                        }
+                        break;
+
+                    case Opcode::IncrementBy:
+                        checkDepth(1);
+                        MoveImmediate(Rax, operand);
+                        RegisterOperation(0x01, Rax, Top);
+                        break;
+
+                    case Opcode::IncrementVariable:
+                    case Opcode::DecrementVariable:
+                        CheckDefined(operand, address);
+                        CheckFull(address);
+                        Emit(0x48);
+                        Emit(0x83);
+                        EmitMemoryOperand(instruction.opcode == Opcode::IncrementVariable ? 0 : 5, MemoryBase, SlotDisplacement(operand));
+                        Emit(1);
+                        break;
+
+                    case Opcode::DuplicateJumpIfZero:
+                        checkDepth(1);
+                        CheckFull(address);
+                        PushTop();
+                        RegisterOperation(0x85, Top, Top);
+                        _jumps.push_back({ JumpIf(Condition::Equal), static_cast<InstructionPointer>(operand), JitStatus::Halted });
+                        break;
+
+                    case Opcode::Nip:
+                        checkDepth(2);
+                        ImmediateOperation(5, StackPointer, 8);
+                        break;
+
+                    case Opcode::OutputString:
+                        CheckFull(address);
+                        MoveImmediate(Rsi, operand);
+                        CallOutput(reinterpret_cast<void const*>(runtime.outputString), address);
+                        break;
+
+                    case Opcode::Reverse:
+                    case Opcode::Input:
+                    case Opcode::HeapFill:
+                    case Opcode::HeapCopy:
+                    case Opcode::Unrecognised:
+                        ExitTo(Jump(), address, JitStatus::Fallback);
+                        break;
+                }
+            }
+
+            template <typename TOperation>
+            void BinaryOperation(Instruction const& instruction, InstructionPointer const address, TOperation const& operation)
+            {
+                // The operands are the top of the stack (r12) and the second value (rax).
+
+                if (instruction.checkStack)
+                {
+                    CheckDepth(2, address);
+                }
+                LoadSecond(Rax);
+                ImmediateOperation(5, StackPointer, 8);
+                operation();
+            }
+
+            void DivisionOperation(Instruction const& instruction, InstructionPointer const address, Register const result)
+            {
+                // A zero divisor is left to the interpreter before the stack is touched.
+
+                if (instruction.checkStack)
+                {
+                    CheckDepth(2, address);
+                }
+                LoadSecond(Rax);
+                RegisterOperation(0x85, Rax, Rax);
+                ExitTo(JumpIf(Condition::Equal), address, JitStatus::Fallback);
+                ImmediateOperation(5, StackPointer, 8);
+                Divide(Top, Rax);
+                Move(Top, result);
+            }
+
+            void LogicalOperation(uint8_t const opcode)
+            {
+                RegisterOperation(0x85, Top, Top);
+                SetFromCondition(Condition::NotEqual, Rcx);
+                RegisterOperation(0x85, Rax, Rax);
+                SetFromCondition(Condition::NotEqual, Rax);
+                Emit(opcode);
+                Emit(0xC8);
+                ZeroExtendByte(Top, Rax);
+            }
+
+            void Compare(Condition const condition)
+            {
+                RegisterOperation(0x39, Rax, Top);
+                SetFromCondition(condition, Rax);
+                ZeroExtendByte(Top, Rax);
+            }
+
+            void EmitPrologue()
+            {
+                for (auto const reg : { Rbx, Rbp, R12, R13, R14, R15 })
+                {
+                    PushRegister(reg);
+                }
+                ImmediateOperation(5, Rsp, 8);
+
+                Move(Context, Rdi);
+                MemoryOperation(0x8B, Top, Context, offsetof(JitContext, top));
+                MemoryOperation(0x8B, StackPointer, Context, offsetof(JitContext, stackPointer));
+                MemoryOperation(0x8B, StackBase, Context, offsetof(JitContext, stackBase));
+                MemoryOperation(0x8B, StackLimit, Context, offsetof(JitContext, stackLimit));
+                MemoryOperation(0x8B, MemoryBase, Context, offsetof(JitContext, memory));
+
+                // jmp rsi
+                Emit(0xFF);
+                Emit(0xE6);
+            }
+
+            void EmitEpilogue()
+            {
+                MemoryOperation(0x89, Top, Context, offsetof(JitContext, top));
+                MemoryOperation(0x89, StackPointer, Context, offsetof(JitContext, stackPointer));
+                MemoryOperation(0x89, Rdx, Context, offsetof(JitContext, exitAddress));
+
+                ImmediateOperation(0, Rsp, 8);
+                for (auto const reg : { R15, R14, R13, R12, Rbp, Rbx })
+                {
+                    PopRegister(reg);
+                }
+                Emit(0xC3);
+            }
+
+            void CheckDepth(int const depth, InstructionPointer const address)
+            {
+                Move(Rax, StackPointer);
+                RegisterOperation(0x29, StackBase, Rax);
+                ImmediateOperation(7, Rax, depth * 8);
+                ExitTo(JumpIf(Condition::Below), address, JitStatus::Fallback);
+            }
+
+            void CheckFull(InstructionPointer const address)
+            {
+                RegisterOperation(0x39, StackLimit, StackPointer);
+                ExitTo(JumpIf(Condition::Equal), address, JitStatus::Fallback);
+            }
+
+            void CheckDefined(Word const slot, InstructionPointer const address)
+            {
+                MemoryOperation(0x8B, Rax, Context, offsetof(JitContext, memoryDefined));
+                BitTest(4, Rax, slot);
+                ExitTo(JumpIf(Condition::AboveOrEqual), address, JitStatus::Fallback);
+            }
+
+            void CheckHeapAddress(InstructionPointer const address)
+            {
+                // Leaves the heap base in rax.
+                MemoryOperation(0x3B, Top, Context, offsetof(JitContext, heapSize));
+                ExitTo(JumpIf(Condition::AboveOrEqual), address, JitStatus::Fallback);
+                MemoryOperation(0x8B, Rax, Context, offsetof(JitContext, heap));
+            }
+
+            void PushTop()
+            {
+                MemoryOperation(0x89, Top, StackPointer, 0);
+                ImmediateOperation(0, StackPointer, 8);
+
+                // Raise the high-water mark if the stack pointer has passed it.
+                MemoryOperation(0x3B, StackPointer, Context, offsetof(JitContext, highWaterMark));
+                Emit(0x76);
+                Emit(7);
+                MemoryOperation(0x89, StackPointer, Context, offsetof(JitContext, highWaterMark));
+            }
+
+            void PopTop()
+            {
+                ImmediateOperation(5, StackPointer, 8);
+                MemoryOperation(0x8B, Top, StackPointer, 0);
+            }
+
+            void LoadSecond(Register const destination)
+            {
+                MemoryOperation(0x8B, destination, StackPointer, -8);
+            }
+
+            void CallRuntime(void const* function)
+            {
+                Move(Rdi, Context);
+                MoveImmediate(Rax, reinterpret_cast<Word>(function));
+                Emit(0xFF);
+                Emit(0xD0);
+            }
+
+            void CallOutput(void const* function, InstructionPointer const address)
+            {
+                // The instruction has finished when writing fails, so the virtual machine picks up after it.
+                CallRuntime(function);
+                RegisterOperation(0x85, Rax, Rax);
+                ExitTo(JumpIf(Condition::NotEqual), address + 1, JitStatus::Fallback);
+            }
+
+            void ExitTo(std::size_t const position, InstructionPointer const address, JitStatus const status)
+            {
+                _exits.push_back({ position, address, status });
+            }
+
+            static int32_t SlotDisplacement(Word const slot)
+            {
+                return static_cast<int32_t>(slot * sizeof(Word));
+            }
+
+            // Instruction encoding.
+
+            void Emit(uint8_t const byte)
+            {
+                _code.push_back(byte);
+            }
+
+            void Emit32(uint32_t const value)
+            {
+                for (auto i = 0; i < 4; ++i)
+                {
+                    Emit(static_cast<uint8_t>(value >> (i * 8)));
+                }
+            }
+
+            void EmitRex(bool const wide, int const reg, int const rm)
+            {
+                auto const rex = static_cast<uint8_t>(0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0));
+                if (rex != 0x40)
+                {
+                    Emit(rex);
+                }
+            }
+
+            void EmitMemoryOperand(int const reg, Register const base, int32_t const displacement)
+            {
+                // Always [base + disp32], which needs a SIB byte when the base is rsp or r12.
+                Emit(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+                if ((base & 7) == 4)
+                {
+                    Emit(0x24);
+                }
+                Emit32(static_cast<uint32_t>(displacement));
+            }
+
+            void RegisterOperation(uint8_t const opcode, Register const reg, Register const rm)
+            {
+                EmitRex(true, reg, rm);
+                Emit(opcode);
+                Emit(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+            }
+
+            void MemoryOperation(uint8_t const opcode, Register const reg, Register const base, std::size_t const displacement)
+            {
+                MemoryOperation(opcode, reg, base, static_cast<int32_t>(displacement));
+            }
+
+            void MemoryOperation(uint8_t const opcode, Register const reg, Register const base, int32_t const displacement)
+            {
+                EmitRex(true, reg, base);
+                Emit(opcode);
+                EmitMemoryOperand(reg, base, displacement);
+            }
+
+            void IndexedMemoryOperation(uint8_t const opcode, Register const reg, Register const base, Register const index)
+            {
+                // [base + index * 8], where the base cannot be rbp or r13.
+                Emit(static_cast<uint8_t>(0x48 | ((reg & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0)));
+                Emit(opcode);
+                Emit(static_cast<uint8_t>(0x04 | ((reg & 7) << 3)));
+                Emit(static_cast<uint8_t>(0xC0 | ((index & 7) << 3) | (base & 7)));
+            }
+
+            void Move(Register const destination, Register const source)
+            {
+                RegisterOperation(0x89, source, destination);
+            }
+
+            void MoveImmediate(Register const destination, Word const value)
+            {
+                EmitRex(true, 0, destination);
+                Emit(static_cast<uint8_t>(0xB8 + (destination & 7)));
+                for (auto i = 0; i < 8; ++i)
+                {
+                    Emit(static_cast<uint8_t>(value >> (i * 8)));
+                }
+            }
+
+            void MoveImmediate32(Register const destination, uint32_t const value)
+            {
+                EmitRex(false, 0, destination);
+                Emit(static_cast<uint8_t>(0xB8 + (destination & 7)));
+                Emit32(value);
+            }
+
+            void ImmediateOperation(int const extension, Register const destination, int32_t const value)
+            {
+                EmitRex(true, 0, destination);
+                Emit(0x81);
+                Emit(static_cast<uint8_t>(0xC0 | (extension << 3) | (destination & 7)));
+                Emit32(static_cast<uint32_t>(value));
+            }
+
+            void UnaryGroup(int const extension, Register const destination)
+            {
+                EmitRex(true, 0, destination);
+                Emit(0xF7);
+                Emit(static_cast<uint8_t>(0xC0 | (extension << 3) | (destination & 7)));
+            }
+
+            void Multiply(Register const destination, Register const source)
+            {
+                EmitRex(true, destination, source);
+                Emit(0x0F);
+                Emit(0xAF);
+                Emit(static_cast<uint8_t>(0xC0 | ((destination & 7) << 3) | (source & 7)));
+            }
+
+            void Divide(Register const dividend, Register const divisor)
+            {
+                // Leaves the quotient in rax and the remainder in rdx.
+                Move(Rcx, divisor);
+                Move(Rax, dividend);
+                Emit(0x31);
+                Emit(0xD2);
+                UnaryGroup(6, Rcx);
+            }
+
+            void Shift(int const extension, Register const destination)
+            {
+                EmitRex(true, 0, destination);
+                Emit(0xD3);
+                Emit(static_cast<uint8_t>(0xC0 | (extension << 3) | (destination & 7)));
+            }
+
+            void SetFromCondition(Condition const condition, Register const destination)
+            {
+                Emit(0x0F);
+                Emit(static_cast<uint8_t>(0x90 + condition));
+                Emit(static_cast<uint8_t>(0xC0 | (destination & 7)));
+            }
+
+            void ZeroExtendByte(Register const destination, Register const source)
+            {
+                EmitRex(false, destination, source);
+                Emit(0x0F);
+                Emit(0xB6);
+                Emit(static_cast<uint8_t>(0xC0 | ((destination & 7) << 3) | (source & 7)));
+            }
+
+            void BitTest(int const extension, Register const base, Word const bit)
+            {
+                EmitRex(true, 0, base);
+                Emit(0x0F);
+                Emit(0xBA);
+                EmitMemoryOperand(extension, base, static_cast<int32_t>((bit / 64) * sizeof(Word)));
+                Emit(static_cast<uint8_t>(bit % 64));
+            }
+
+            void PushRegister(Register const reg)
+            {
+                EmitRex(false, 0, reg);
+                Emit(static_cast<uint8_t>(0x50 + (reg & 7)));
+            }
+
+            void PopRegister(Register const reg)
+            {
+                EmitRex(false, 0, reg);
+                Emit(static_cast<uint8_t>(0x58 + (reg & 7)));
+            }
+
+            std::size_t Jump()
+            {
+                Emit(0xE9);
+                Emit32(0);
+                return _code.size() - 4;
+            }
+
+            std::size_t JumpIf(Condition const condition)
+            {
+                Emit(0x0F);
+                Emit(static_cast<uint8_t>(0x80 + condition));
+                Emit32(0);
+                return _code.size() - 4;
+            }
+
+            void PatchRelative(std::size_t const position, std::size_t const target)
+            {
+                auto const relative = static_cast<uint32_t>(static_cast<int32_t>(target - (position + 4)));
+                for (auto i = 0; i < 4; ++i)
+                {
+                    _code[position + i] = static_cast<uint8_t>(relative >> (i * 8));
+                }
+            }
+    };
+#endif
+
+    /// Counts gathered while a program runs with profiling enabled.
+    struct ExecutionProfile
+    {
+        /// The number of times each instruction was executed, indexed by address.
+        std::vector<uint64_t> executions{};
+
+        /// The number of times control moved to each address other than by falling through to it,
+        /// i.e. by a taken jump or a handled PANic, indexed by address.
+        std::vector<uint64_t> jumps{};
+
+        /// The largest number of words on the operand stack.
+        std::size_t peakDepth = 0;
+
+        /// Sizes the counts for a program, clearing them if the size changes.
+        /// @param instructionCount The number of instructions in the program.
+        void Resize(std::size_t const instructionCount)
+        {
+            if (executions.size() != instructionCount)
+            {
+                executions.assign(instructionCount, 0);
+                jumps.assign(instructionCount, 0);
+                peakDepth = 0;
+            }
+        }
+
+        /// Sets every count to zero.
+        void Clear() noexcept
+        {
+            std::fill(executions.begin(), executions.end(), 0);
+            std::fill(jumps.begin(), jumps.end(), 0);
+            peakDepth = 0;
+        }
+    };
+
+    /// Enumerates the reasons a resumed program stops running.
+    enum class ExecutionStatus
+    {
+        /// The program terminated.
+        Halted,
+
+        /// The program used all of its fuel and can be resumed.
+        OutOfFuel,
+
+        /// The program is waiting for input which is not available yet, and can be resumed once it is.
+        WaitingForInput
+    };
+
+    /// The stack policy which checks every instruction that could exhaust or overflow the stack,
+    /// apart from those the optimizer proved safe, and raises a PANic if it would.
+    struct CheckedStack
+    {
+        static constexpr bool Enabled = true;
+    };
+
+    /// The stack policy which never checks the stack.
+    /// Only for programs known not to exhaust or overflow it, which would otherwise have undefined behavior.
+    struct UncheckedStack
+    {
+        static constexpr bool Enabled = false;
+    };
+
+    /// The trace policy which traces nothing.
+    struct NoTracing
+    {
+        static constexpr bool Enabled = false;
+
+        void Trace(CompiledProgram const&, InstructionPointer, OperandStack const&) noexcept
+        {
+        }
+
+        void Clear() noexcept
+        {
+        }
+
+        void WriteRecent(CompiledProgram const&, std::ostream&) const
+        {
+        }
+    };
+
+    /// The trace policy which writes each instruction to a stream before it is executed.
+    class StreamTracer final
+    {
+        public:
+            static constexpr bool Enabled = true;
+
+            /// Sets the stream instructions are written to.
+            /// @param output The stream, or null to trace nothing.
+            void SetOutput(std::ostream* const output) noexcept
+            {
+                _output = output;
+            }
+
+            /// Writes an instruction with the depth and top of the stack it is about to execute on.
+            /// @param program The running program.
+            /// @param address The address of the instruction.
+            /// @param stack The operand stack.
+            void Trace(CompiledProgram const& program, InstructionPointer const address, OperandStack const& stack)
+            {
+                if (_output == nullptr)
+                {
+                    return;
+                }
+
+                auto const& instruction = program.instructions[address];
+                *_output << std::setw(8) << address << "  " << std::left << std::setw(20) << GetOpcodeName(instruction.opcode)
+                    << std::right << std::setw(20) << instruction.operand << "  depth " << stack.Size();
+                if (!stack.Empty())
+                {
+                    *_output << ", top " << stack.Peek(0);
+                }
+                *_output << '\n';
+            }
+
+            void Clear() noexcept
+            {
+            }
+
+            void WriteRecent(CompiledProgram const&, std::ostream&) const
+            {
+                // Every instruction has already been written.
+            }
+
+        private:
+            std::ostream* _output = &std::cerr;
+    };
+
+    /// The trace policy which records the most recent instructions in a fixed-size ring buffer,
+    /// so that the steps leading up to a PANic can be seen without running the program again.
+    /// Records are written by the thread running the program, without locks or allocation.
+    class RingTracer final
+    {
+        public:
+            static constexpr bool Enabled = true;
+
+            /// The default number of records kept.
+            static constexpr std::size_t DefaultCapacity = 4096;
+
+            /// An instruction and the stack it was about to execute on.
+            struct Record
+            {
+                Word top;
+                uint32_t address;
+                uint32_t depth;
+                Opcode opcode;
+            };
+
+            /// Initializes a new instance of the RingTracer class.
+            /// @param capacity The number of records kept, rounded up to a power of two.
+            explicit RingTracer(std::size_t const capacity = DefaultCapacity)
+            {
+                SetCapacity(capacity);
+            }
+
+            /// Sets the number of records kept, discarding any already recorded.
+            /// @param capacity The number of records, rounded up to a power of two.
+            void SetCapacity(std::size_t const capacity)
+            {
+                auto size = std::size_t(1);
+                while (size < capacity)
+                {
+                    size <<= 1;
+                }
+                _records.assign(size, Record{});
+                _mask = size - 1;
+                _count = 0;
+            }
+
+            /// Records an instruction, overwriting the oldest record once the buffer is full.
+            /// @param program The running program.
+            /// @param address The address of the instruction.
+            /// @param stack The operand stack.
+            void Trace(CompiledProgram const& program, InstructionPointer const address, OperandStack const& stack) noexcept
+            {
+                auto& record = _records[_count & _mask];
+                record.top = stack.Empty() ? 0 : stack.Peek(0);
+                record.address = static_cast<uint32_t>(address);
+                record.depth = static_cast<uint32_t>(stack.Size());
+                record.opcode = program.instructions[address].opcode;
+                ++_count;
+            }
+
+            /// Discards every record.
+            void Clear() noexcept
+            {
+                _count = 0;
+            }
+
+            /// Gets the number of instructions traced since the tracer was last cleared.
+            uint64_t Count() const noexcept
+            {
+                return _count;
+            }
+
+            /// Gets the number of records held, which is at most the capacity.
+            std::size_t Size() const noexcept
+            {
+                return static_cast<std::size_t>(std::min<uint64_t>(_count, _records.size()));
+            }
+
+            /// Gets a record, the oldest held being at index 0.
+            /// @param index The index, which must be less than Size.
+            Record const& operator[](std::size_t const index) const noexcept
+            {
+                return _records[(_count - Size() + index) & _mask];
+            }
+
+            /// Writes the records held, oldest first, e.g. once a program has PANicked.
+            /// @param program The traced program.
+            /// @param output The stream to write to.
+            void WriteRecent(CompiledProgram const& program, std::ostream& output) const
+            {
+                if (_count == 0)
+                {
+                    return;
+                }
+
+                output << "Last " << Size() << " of " << _count << " instructions executed:\n";
+                for (std::size_t index = 0; index < Size(); ++index)
+                {
+                    auto const& record = (*this)[index];
+                    output << std::setw(8) << record.address << "  " << std::left << std::setw(20) << GetOpcodeName(record.opcode)
+                        << std::right << std::setw(20) << program.instructions[record.address].operand << "  depth " << record.depth;
+                    if (record.depth != 0)
+                    {
+                        output << ", top " << record.top;
+                    }
+                    output << '\n';
+                }
+                output.flush();
+            }
+
+            /// Writes the records held as Chrome trace_event JSON, with a span for each stretch between labels.
+            /// Timestamps count instructions, so one microsecond in a trace viewer is one instruction.
+            /// @param program The traced program.
+            /// @param output The stream to write to.
+            void WriteChromeTrace(CompiledProgram const& program, std::ostream& output) const
+            {
+                // Where labels share an address, e.g. after the code of a subroutine which was inlined everywhere was removed,
+                // the instructions there follow the last of them, as in collapsed stacks.
+                std::vector<std::size_t> labels(program.instructions.size(), NoLabel);
+                for (std::size_t label = 0; label < program.labelAddresses.size(); ++label)
+                {
+                    labels[program.labelAddresses[label]] = label;
+                }
+
+                output << "{\"traceEvents\":[";
+                auto const first = _count - Size();
+                auto start = first;
+                auto name = std::string("(start)");
+                auto separator = "";
+                auto const span = [&](uint64_t const end)
+                {
+                    output << separator << "\n{\"name\":\"" << EscapeJson(name) << "\",\"cat\":\"label\",\"ph\":\"X\",\"ts\":" << start
+                        << ",\"dur\":" << end - start << ",\"pid\":1,\"tid\":1}";
+                    separator = ",";
+                };
+
+                if (Size() != 0)
+                {
+                    // The first span is named after the label its instruction follows, if any.
+                    for (auto address = static_cast<std::size_t>((*this)[0].address) + 1; address-- > 0;)
+                    {
+                        if (labels[address] != NoLabel)
+                        {
+                            name = program.labelNames[labels[address]];
+                            break;
+                        }
+                    }
+                }
+
+                for (std::size_t index = 0; index < Size(); ++index)
+                {
+                    auto const label = labels[(*this)[index].address];
+                    if (label != NoLabel && index != 0)
+                    {
+                        span(first + index);
+                        start = first + index;
+                        name = program.labelNames[label];
+                    }
+                }
+                if (Size() != 0)
+                {
+                    span(_count);
+                }
+                output << "\n]}\n";
+            }
+
+        private:
+            static constexpr std::size_t NoLabel = static_cast<std::size_t>(-1);
+
+            std::vector<Record> _records{};
+            std::size_t _mask = 0;
+            uint64_t _count = 0;
+
+            static std::string EscapeJson(std::string const& text)
+            {
+                std::string escaped{};
+                for (auto const character : text)
+                {
+                    if (character == '"' || character == '\\')
+                    {
+                        escaped += '\\';
+                        escaped += character;
+                    }
+                    else if (static_cast<unsigned char>(character) < 0x20)
+                    {
+                        char code[8];
+                        std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(character));
+                        escaped += code;
+                    }
+                    else
+                    {
+                        escaped += character;
+                    }
+                }
+                return escaped;
+            }
+    };
+
+    /// The breakpoint policy which supports no breakpoints.
+    struct NoBreakpoints
+    {
+        static constexpr bool Enabled = false;
+
+        void Attach(CompiledProgram const&)
+        {
+        }
+
+        bool IsSet(InstructionPointer) const noexcept
+        {
+            return false;
+        }
+
+        void Hit(InstructionPointer)
+        {
+        }
+    };
+
+    /// The breakpoint policy which calls a handler whenever a program reaches one of a set of labels.
+    class Breakpoints final
+    {
+        public:
+            static constexpr bool Enabled = true;
+
+            /// Called with the name of the label reached, before the instruction after it is executed.
+            using Handler = std::function<void(std::string const& label)>;
+
+            /// Adds a breakpoint, which takes effect when a program is next loaded.
+            /// @param label The name of the label to break at.
+            void Add(std::string label)
+            {
+                _labels.push_back(std::move(label));
+            }
+
+            /// Sets the handler called when a breakpoint is reached.
+            /// @param handler The handler.
+            void SetHandler(Handler handler)
+            {
+                _handler = std::move(handler);
+            }
+
+            /// Finds the address of each breakpoint in a newly loaded program.
+            /// @param program The program.
+            /// @throws std::invalid_argument if the program has no label with the name of a breakpoint.
+            void Attach(CompiledProgram const& program)
+            {
+                _addresses.assign(program.instructions.size(), NoLabel);
+                for (auto const& name : _labels)
+                {
+                    auto const label = std::find(program.labelNames.begin(), program.labelNames.end(), name);
+                    if (label == program.labelNames.end())
+                    {
+                        throw std::invalid_argument("No label named '" + name + "' to break at.");
+                    }
+
+                    auto const index = static_cast<std::size_t>(label - program.labelNames.begin());
+                    _addresses[program.labelAddresses[index]] = index;
+                }
+                _program = &program;
+            }
+
+            /// Gets a value indicating whether or not there is a breakpoint at an address.
+            /// @param address The address.
+            bool IsSet(InstructionPointer const address) const noexcept
+            {
+                return _addresses[address] != NoLabel;
+            }
+
+            /// Calls the handler for the breakpoint at an address.
+            /// @param address The address.
+            void Hit(InstructionPointer const address)
+            {
+                if (_handler)
+                {
+                    _handler(_program->labelNames[_addresses[address]]);
+                }
+            }
+
+        private:
+            static constexpr std::size_t NoLabel = static_cast<std::size_t>(-1);
+
+            std::vector<std::string> _labels{};
+            std::vector<std::size_t> _addresses{};
+            CompiledProgram const* _program = nullptr;
+            Handler _handler{};
+    };
+
+    /// The I/O policy which reads and writes numbers and characters as text, through buffers.
+    struct TextIo
+    {
+        using Output = OutputBuffer;
+        using Input = InputReader;
+
+        /// Writes a number for the `_` instruction.
+        static void WriteLiteral(Output& output, Word const value)
+        {
+            output.WriteNumber(value);
+        }
+    };
+
+    /// The I/O policy which reads and writes numbers as raw little-endian words, for bulk data.
+    /// Characters and strings are still written as text.
+    struct BinaryIo
+    {
+        using Output = OutputBuffer;
+        using Input = BinaryInputReader;
+
+        /// Writes a number for the `_` instruction.
+        static void WriteLiteral(Output& output, Word const value)
+        {
+            output.WriteWord(value);
+        }
+    };
+
+    /// The state of a virtual machine between two instructions, from which any number of virtual machines
+    /// can be restored to carry on from that point, e.g. to run a program's warm-up phase once and start
+    /// every request after it. A snapshot never changes once it is captured, so its buffers are shared by
+    /// its copies, and by snapshots captured later from virtual machines restored from it wherever nothing
+    /// has changed since. Input and output are not part of a snapshot.
+    class PancakeSnapshot final
+    {
+        public:
+            /// Gets a value indicating whether or not the snapshot holds any state.
+            bool Empty() const noexcept
+            {
+                return _program == nullptr;
+            }
+
+            /// Gets the program the virtual machine was running.
+            std::shared_ptr<CompiledProgram const> const& GetProgram() const noexcept
+            {
+                return _program;
+            }
+
+            /// Gets the index of the next instruction to be executed.
+            InstructionPointer GetInstructionPointer() const noexcept
+            {
+                return _instructionPointer;
+            }
+
+            /// Gets a value indicating whether or not the program was still running.
+            bool IsRunning() const noexcept
+            {
+                return _running;
+            }
+
+            /// Gets the words on the operand stack, from the bottom to the top. The snapshot must not be empty.
+            std::vector<Word> const& GetStack() const noexcept
+            {
+                return *_stack;
+            }
+
+            /// Gets the return addresses, from the bottom of the return stack to the top. The snapshot must not be empty.
+            std::vector<InstructionPointer> const& GetReturnStack() const noexcept
+            {
+                return *_returnStack;
+            }
+
+            /// Gets the memory. The snapshot must not be empty.
+            Memory const& GetMemory() const noexcept
+            {
+                return *_memory;
+            }
+
+            /// Gets the heap up to its last non-zero word, every word after which is zero. The snapshot must not be empty.
+            std::vector<Word> const& GetHeap() const noexcept
+            {
+                return *_heap;
+            }
+
+            /// Gets the number of words in the heap.
+            std::size_t GetHeapSize() const noexcept
+            {
+                return _heapSize;
+            }
+
+            /// Gets the capacity of the operand stack of the virtual machine. The program may have been optimized for it,
+            /// so the snapshot can only be restored into virtual machines with the same capacity.
+            std::size_t GetStackCapacity() const noexcept
+            {
+                return _stackCapacity;
+            }
+
+            /// Gets the capacity of the return stack of the virtual machine. The program may have been optimized for it,
+            /// so the snapshot can only be restored into virtual machines with the same capacity.
+            std::size_t GetReturnStackCapacity() const noexcept
+            {
+                return _returnStackCapacity;
+            }
+
+        private:
+            template <typename TStackPolicy, typename TTracePolicy, typename TBreakpointPolicy, typename TIoPolicy>
+            friend class BasicPancakeVirtualMachine;
+            friend class PancakeBytecode;
+
+            std::shared_ptr<CompiledProgram const> _program{};
+            InstructionPointer _instructionPointer = 0;
+            bool _running = false;
+            std::size_t _highWaterMark = 0;
+            std::size_t _heapSize = 0;
+            std::size_t _stackCapacity = 0;
+            std::size_t _returnStackCapacity = 0;
+            std::shared_ptr<std::vector<Word> const> _stack{};
+            std::shared_ptr<std::vector<InstructionPointer> const> _returnStack{};
+            std::shared_ptr<Memory const> _memory{};
+            std::shared_ptr<std::vector<Word> const> _heap{};
+    };
+
+    /// A stack virtual machine architecture for the Pancake programming language.
+    /// Stack checking, tracing, breakpoints and I/O are chosen at compile time by policies,
+    /// so a virtual machine pays nothing for a feature it was not instantiated with.
+    /// @tparam TStackPolicy CheckedStack or UncheckedStack.
+    /// @tparam TTracePolicy NoTracing, or a tracer called before each instruction is executed.
+    /// @tparam TBreakpointPolicy NoBreakpoints or Breakpoints.
+    /// @tparam TIoPolicy The output buffer and input reader types.
+    template <typename TStackPolicy, typename TTracePolicy, typename TBreakpointPolicy, typename TIoPolicy>
+    class BasicPancakeVirtualMachine final
+    {
+        public:
+            using StackPolicy = TStackPolicy;
+            using TracePolicy = TTracePolicy;
+            using BreakpointPolicy = TBreakpointPolicy;
+            using IoPolicy = TIoPolicy;
+
+            /// Initializes a new instance of the BasicPancakeVirtualMachine class.
+            /// @param stackCapacity The maximum number of words on the operand stack.
+            /// @param returnStackCapacity The maximum number of nested subroutine calls.
+            explicit BasicPancakeVirtualMachine(std::size_t const stackCapacity = DefaultStackCapacity,
+                std::size_t const returnStackCapacity = DefaultReturnStackCapacity)
+                : _stack(stackCapacity), _returnStack(returnStackCapacity)
+            {
+            }
+
+            /// Gets a value indicating whether or not a program is running on the virtual machine.
+            bool IsRunning() const noexcept
+            {
+                return _running;
+            }
+
+            /// Gets the index of the next instruction to be executed.
+            InstructionPointer GetInstructionPointer() const noexcept
+            {
+                return _instructionPointer;
+            }
+
+            /// Gets the operand stack.
+            OperandStack const& GetStack() const noexcept
+            {
+                return _stack;
+            }
+
+            /// Gets the return stack.
+            ReturnStack const& GetReturnStack() const noexcept
+            {
+                return _returnStack;
+            }
+
+            /// Gets the memory.
+            Memory const& GetMemory() const noexcept
+            {
+                return _memory;
+            }
+
+            /// Gets the heap. It is empty unless the loaded program accesses the heap.
+            Heap const& GetHeap() const noexcept
+            {
+                return _heap;
+            }
+
+            /// Gets the number of words in the heap of programs which access the heap.
+            std::size_t GetHeapSize() const noexcept
+            {
+                return _heapSize;
+            }
+
+            /// Sets the number of words in the heap, which takes effect when a program is next loaded.
+            /// @param size The number of words.
+            void SetHeapSize(std::size_t const size) noexcept
+            {
+                _heapSize = size;
+            }
+
+            /// Gets the tracer, e.g. to set where it writes to.
+            TTracePolicy& GetTracer() noexcept
+            {
+                return _tracer;
+            }
+
+            /// Gets the tracer, e.g. to read what it recorded.
+            TTracePolicy const& GetTracer() const noexcept
+            {
+                return _tracer;
+            }
+
+            /// Gets the breakpoints, e.g. to add to them before a program is loaded.
+            TBreakpointPolicy& GetBreakpoints() noexcept
+            {
+                return _breakpoints;
+            }
+
+            /// Initializes the virtual machine ready for instructions to be dispatched.
+            /// @param program The compiled program to run.
+            void InitializeForNewProgram(CompiledProgram program)
+            {
+                Load(std::make_shared<CompiledProgram const>(std::move(program)));
+            }
+
+            /// Loads a compiled program ready for instructions to be dispatched.
+            /// A compiled program is never modified by a virtual machine, so one can be shared
+            /// between any number of virtual machines, including ones running on other threads.
+            /// Loading the program which is already loaded only resets the virtual machine.
+            /// @param program The compiled program to run.
+            void Load(std::shared_ptr<CompiledProgram const> program)
+            {
+                Attach(std::move(program));
+                _origin = {};
+
+                // Programs which never touch the heap do not pay to allocate or clear it.
+                auto const heapSize = _usesHeap ? _heapSize : 0;
+                if (_heap.Size() != heapSize)
+                {
+                    _heap.Reset(heapSize);
+                }
+                Reset();
+            }
+
+            /// Captures the state of the virtual machine, so that it can be restored later or into other virtual machines.
+            /// Buffers which are unchanged since the virtual machine was restored from a snapshot are shared with that snapshot.
+            /// @returns The snapshot, which is empty if no program is loaded.
+            PancakeSnapshot Capture() const
+            {
+                PancakeSnapshot snapshot{};
+                if (_program == nullptr)
+                {
+                    return snapshot;
+                }
+
+                snapshot._program = _program;
+                snapshot._instructionPointer = _instructionPointer;
+                snapshot._running = _running;
+                snapshot._highWaterMark = _stack._highWaterMark;
+                snapshot._heapSize = _heap.Size();
+                snapshot._stackCapacity = _stack._capacity;
+                snapshot._returnStackCapacity = _returnStack._capacity;
+                auto const* const origin = _origin.Empty() ? nullptr : &_origin;
+
+                // The buffer holds everything below the top word from its second element.
+                auto const* const stackWords = _stack._buffer.get() + 1;
+                auto const stackSize = _stack._size;
+                if (origin != nullptr && origin->_stack->size() == stackSize
+                    && (stackSize == 0 || (std::equal(stackWords, stackWords + stackSize - 1, origin->_stack->begin()) && origin->_stack->back() == _stack._top)))
+                {
+                    snapshot._stack = origin->_stack;
+                }
+                else
+                {
+                    auto stack = std::vector<Word>(stackWords, stackWords + (stackSize != 0 ? stackSize - 1 : 0));
+                    if (stackSize != 0)
+                    {
+                        stack.push_back(_stack._top);
+                    }
+                    snapshot._stack = std::make_shared<std::vector<Word> const>(std::move(stack));
+                }
+
+                auto const* const returnAddresses = _returnStack._buffer.get();
+                if (origin != nullptr && std::equal(returnAddresses, returnAddresses + _returnStack._size, origin->_returnStack->begin(), origin->_returnStack->end()))
+                {
+                    snapshot._returnStack = origin->_returnStack;
+                }
+                else
+                {
+                    snapshot._returnStack = std::make_shared<std::vector<InstructionPointer> const>(returnAddresses, returnAddresses + _returnStack._size);
+                }
+
+                if (origin != nullptr && _memory._values == origin->_memory->_values && _memory._defined == origin->_memory->_defined)
+                {
+                    snapshot._memory = origin->_memory;
+                }
+                else
+                {
+                    snapshot._memory = std::make_shared<Memory const>(_memory);
+                }
+
+                // Only the heap up to its last non-zero word is kept, since the rest is zero when it is restored.
+                if (_heapRestored)
+                {
+                    snapshot._heap = origin->_heap;
+                }
+                else
+                {
+                    auto const& words = _heap._words;
+                    auto const written = words.begin() + static_cast<std::ptrdiff_t>(_heap._highWaterMark);
+                    auto const used = std::find_if(std::make_reverse_iterator(written), words.rend(), [](Word const word) { return word != 0; }).base();
+                    if (origin != nullptr && std::equal(words.begin(), used, origin->_heap->begin(), origin->_heap->end()))
+                    {
+                        snapshot._heap = origin->_heap;
+                    }
+                    else
+                    {
+                        snapshot._heap = std::make_shared<std::vector<Word> const>(words.begin(), used);
+                    }
+                }
+
+                return snapshot;
+            }
+
+            /// Restores the virtual machine to the state captured by a snapshot, loading its program if it is not already loaded.
+            /// Restoring a snapshot of the program which is already loaded keeps the translated code and allocates nothing
+            /// unless the heap changes size, so many executions can be forked cheaply from one snapshot.
+            /// @param snapshot The snapshot, which must not be empty.
+            /// @throws std::runtime_error if the snapshot was captured from a virtual machine whose stacks have other capacities.
+            void Restore(PancakeSnapshot const& snapshot)
+            {
+                auto const& stack = *snapshot._stack;
+                auto const& returnStack = *snapshot._returnStack;
+                if (snapshot._stackCapacity != _stack._capacity || snapshot._returnStackCapacity != _returnStack._capacity
+                    || stack.size() > _stack._capacity || returnStack.size() > _returnStack._capacity)
+                {
+                    throw std::runtime_error("The snapshot was captured from a virtual machine whose stacks have other capacities.");
+                }
+
+                Attach(snapshot._program);
+                auto const heapRestored = _heapRestored && _origin._heap == snapshot._heap && _heap.Size() == snapshot._heapSize;
+                _origin = snapshot;
+                _running = snapshot._running;
+                _waitingForInput = false;
+                _panicked = false;
+                _instructionPointer = snapshot._instructionPointer;
+                _profile.Clear();
+                _tracer.Clear();
+                if (!stack.empty())
+                {
+                    std::copy(stack.begin(), stack.end() - 1, _stack._buffer.get() + 1);
+                    _stack._top = stack.back();
+                }
+                _stack._size = stack.size();
+                _stack._highWaterMark = std::min(std::max(snapshot._highWaterMark, stack.size()), _stack._capacity);
+                std::copy(returnStack.begin(), returnStack.end(), _returnStack._buffer.get());
+                _returnStack._size = returnStack.size();
+                _memory._values = snapshot._memory->_values;
+                _memory._defined = snapshot._memory->_defined;
+
+                // The heap is copy on write: it is only copied again once the program has written to it since it was last restored.
+                if (!heapRestored)
+                {
+                    if (_heap.Size() != snapshot._heapSize)
+                    {
+                        _heap.Reset(snapshot._heapSize);
+                    }
+                    auto const& words = *snapshot._heap;
+                    std::copy(words.begin(), words.end(), _heap._words.begin());
+                    if (_heap._highWaterMark > words.size())
+                    {
+                        std::fill(_heap._words.begin() + static_cast<std::ptrdiff_t>(words.size()), _heap._words.begin() + static_cast<std::ptrdiff_t>(_heap._highWaterMark), 0);
+                    }
+                    _heap._highWaterMark = words.size();
+                    _heapRestored = true;
+                }
+            }
+
+            /// Resets the virtual machine to run the loaded program again from the start.
+            /// The stacks, memory, heap, output buffer and translated code are kept, so nothing is allocated.
+            void Reset() noexcept
+            {
+                _running = _program != nullptr;
+                _waitingForInput = false;
+                _panicked = false;
+                _instructionPointer = 0;
+                _stack.Clear();
+                _returnStack.Clear();
+                _memory.Clear();
+                _heap.Clear();
+                _heapRestored = false;
+                _profile.Clear();
+                _tracer.Clear();
+            }
+
+            /// Sets where output written by programs goes, flushing anything already written.
+            /// @param sink The sink, which must outlive the virtual machine or be replaced before it is destroyed.
+            void SetOutput(OutputSink& sink)
+            {
+                _output.SetSink(sink);
+            }
+
+            /// Sets where input read by programs comes from.
+            /// @param source The source, which must outlive any program reading from it.
+            void SetInput(InputSource& source) noexcept
+            {
+                _input.SetSource(source);
+            }
+
+            /// Sets whether or not Run compiles the program to machine code.
+            /// Has no effect where the JIT compiler is unavailable.
+            /// @param enabled Whether or not to use the JIT compiler.
+            void SetJitEnabled(bool const enabled) noexcept
+            {
+                _jitEnabled = enabled;
+            }
+
+            /// Runs the program until it terminates or PANics, or waits for input which is not available yet.
+            void Run()
+            {
+                auto const retryingInput = std::exchange(_waitingForInput, false);
+                FlushAfter([&]
+                {
+                    if (_profilingEnabled)
+                    {
+                        _profile.Resize(_program->instructions.size());
+                        Execute<ExecutionMode::Profiled>(retryingInput);
+                        _profile.peakDepth = std::max(_profile.peakDepth, _stack.HighWaterMark());
+                        return;
+                    }
+#if PANCAKE_JIT_AVAILABLE
+                    // Generated code neither traces nor stops at breakpoints.
+                    if (_jitEnabled && !TTracePolicy::Enabled && !TBreakpointPolicy::Enabled)
+                    {
+                        RunCompiled();
+                        return;
+                    }
+#endif
+                    Execute<ExecutionMode::Run>(retryingInput);
+                });
+                ThrowIfPanicked();
+            }
+
+            /// Runs the program for at most a number of instructions, so that a program which never
+            /// halts cannot hold on to the thread running it. Programs are always interpreted here.
+            /// @param fuel The largest number of instructions to execute.
+            /// @returns Why the program stopped running.
+            ExecutionStatus Resume(std::size_t const fuel)
+            {
+                auto const retryingInput = std::exchange(_waitingForInput, false);
+                if (_running && fuel != 0)
+                {
+                    _fuel = fuel;
+                    FlushAfter([&] { Execute<ExecutionMode::Budgeted>(retryingInput); });
+                    ThrowIfPanicked();
+                }
+
+                if (!_running)
+                {
+                    return ExecutionStatus::Halted;
+                }
+                return _waitingForInput ? ExecutionStatus::WaitingForInput : ExecutionStatus::OutOfFuel;
+            }
+
+            /// Sets whether or not Run counts the instructions it executes and the jumps it takes.
+            /// Profiled programs are always interpreted, by a separate instantiation of the dispatch
+            /// loop, so that programs which are not profiled pay nothing for it.
+            /// @param enabled Whether or not to profile programs.
+            void SetProfilingEnabled(bool const enabled) noexcept
+            {
+                _profilingEnabled = enabled;
+            }
+
+            /// Gets the counts gathered by profiled runs since the virtual machine was last reset.
+            ExecutionProfile const& GetProfile() const noexcept
+            {
+                return _profile;
+            }
+
+            /// Gets the loaded program.
+            std::shared_ptr<CompiledProgram const> const& GetProgram() const noexcept
+            {
+                return _program;
+            }
+
+            /// Gets a value indicating whether or not the program stopped at an input instruction
+            /// because its input is not available yet. Running again retries the instruction.
+            bool IsWaitingForInput() const noexcept
+            {
+                return _waitingForInput;
+            }
+
+            /// Executes the single instruction at the instruction pointer.
+            void Step()
+            {
+                if (_running)
+                {
+                    auto const retryingInput = std::exchange(_waitingForInput, false);
+                    FlushAfter([&] { Execute<ExecutionMode::Step>(retryingInput); });
+                    ThrowIfPanicked();
+                }
+            }
+
+            /// Sets when output written by programs is flushed.
+            /// Output is always flushed before input is read and when a program stops or PANics.
+            /// @param policy The flush policy.
+            void SetFlushPolicy(FlushPolicy const policy) noexcept
+            {
+                _output.SetFlushPolicy(policy);
+            }
+
+        private:
+            /// Enumerates the ways the dispatch loop can be entered.
+            enum class ExecutionMode
+            {
+                /// Run until the program stops.
+                Run,
+
+                /// Execute one instruction.
+                Step,
+
+                /// Run until the program stops or its fuel runs out.
+                Budgeted,
+
+                /// Run until the program stops, counting every instruction and jump.
+                Profiled
+            };
+
+            static constexpr std::size_t ExecutionModeCount = static_cast<std::size_t>(ExecutionMode::Profiled) + 1;
+
+            /// An instruction with its opcode replaced by the address of its handler.
+            struct ThreadedInstruction
+            {
+                void const* handler;
+                Word operand;
+            };
+
+            bool _running = false;
+            InstructionPointer _instructionPointer = 0;
+            std::shared_ptr<CompiledProgram const> _program{};
+            OperandStack _stack;
+            ReturnStack _returnStack;
+            Memory _memory{};
+            Heap _heap{};
+            std::size_t _heapSize = DefaultHeapSize;
+            bool _usesHeap = false;
+            bool _writesHeap = false;
+            bool _heapRestored = false;
+            typename TIoPolicy::Output _output{};
+            typename TIoPolicy::Input _input{};
+            InputStatus _inputStatus = InputStatus::Number;
+            bool _panicked = false;
+            PanicType _panic = PanicType::User;
+            bool _jitEnabled = false;
+            bool _waitingForInput = false;
+            std::size_t _fuel = 0;
+            bool _profilingEnabled = false;
+            ExecutionProfile _profile{};
+            TTracePolicy _tracer{};
+            TBreakpointPolicy _breakpoints{};
+            PancakeSnapshot _origin{};
+
+            // Each mode has its own dispatch loop, so each has its own threaded code pointing into it.
+            std::array<std::vector<ThreadedInstruction>, ExecutionModeCount> _threadedCode{};
+#if PANCAKE_JIT_AVAILABLE
+            std::unique_ptr<PancakeJit> _jit{};
+            std::exception_ptr _outputError{};
+#endif
+
+            /// Makes a program the loaded program, discarding the code translated from the last one.
+            /// Attaching the program which is already loaded does nothing.
+            void Attach(std::shared_ptr<CompiledProgram const> program)
+            {
+                if (program == _program)
+                {
+                    return;
+                }
+
+                _program = std::move(program);
+                _breakpoints.Attach(*_program);
+                _memory.Reset(_program->variables.size());
+                _usesHeap = std::any_of(_program->instructions.begin(), _program->instructions.end(),
+                    [](Instruction const& instruction) { return IsHeapAccess(instruction.opcode); });
+                _writesHeap = std::any_of(_program->instructions.begin(), _program->instructions.end(),
+                    [](Instruction const& instruction) { return IsHeapAccess(instruction.opcode) && instruction.opcode != Opcode::HeapLoad; });
+                for (auto& threadedCode : _threadedCode)
+                {
+                    threadedCode.clear();
+                }
+#if PANCAKE_JIT_AVAILABLE
+                _jit.reset();
+#endif
+            }
+
+#if PANCAKE_JIT_AVAILABLE
+            void RunCompiled()
+            {
+                if (!_jit)
+                {
+                    _jit = std::make_unique<PancakeJit>(*_program, JitRuntime{ &JitOutputCharacter, &JitOutputLiteral, &JitOutputString });
+                }
+
+                // Generated code stores to the heap without saying so.
+                _heapRestored = _heapRestored && !_writesHeap;
+
+                JitContext context{};
+                context.stackBase = _stack._buffer.get();
+                context.stackLimit = context.stackBase + _stack._capacity;
+                context.memory = _memory._values.data();
+                context.memoryDefined = _memory._defined.data();
+                context.heap = _heap._words.data();
+                context.heapSize = _heap._words.size();
+                context.returnStackBase = _returnStack._buffer.get();
+                context.returnStackLimit = context.returnStackBase + _returnStack._capacity;
+                context.machine = this;
+
+                // Generated code runs until it halts or reaches an instruction it leaves to the
+                // interpreter, which steps over that one instruction before re-entering.
+                while (_running && !_waitingForInput)
+                {
+                    context.top = _stack._top;
+                    context.stackPointer = context.stackBase + _stack._size;
+                    context.highWaterMark = context.stackBase + _stack._highWaterMark;
+                    context.returnStackPointer = context.returnStackBase + _returnStack._size;
+                    context.heapHighWaterMark = _heap._highWaterMark;
+
+                    auto const status = _jit->Enter(context, _instructionPointer);
+
+                    _stack._top = context.top;
+                    _stack._size = static_cast<std::size_t>(context.stackPointer - context.stackBase);
+                    _stack._highWaterMark = static_cast<std::size_t>(context.highWaterMark - context.stackBase);
+                    _returnStack._size = static_cast<std::size_t>(context.returnStackPointer - context.returnStackBase);
+                    _heap._highWaterMark = static_cast<std::size_t>(context.heapHighWaterMark);
+                    _instructionPointer = static_cast<InstructionPointer>(context.exitAddress);
+                    if (_outputError)
+                    {
+                        std::rethrow_exception(std::exchange(_outputError, nullptr));
+                    }
+
+                    switch (status)
+                    {
+                        case JitStatus::Halted:
+                            _running = false;
+                            break;
+
+                        case JitStatus::Fallback:
+                            Execute<ExecutionMode::Step>();
+                            break;
+                    }
+                }
+            }
+
+            // Exceptions cannot unwind through generated code, so one thrown by the output sink is kept,
+            // and rethrown once generated code has exited to the virtual machine.
+
+            static Word JitOutputCharacter(JitContext* const context, Word const value) noexcept
+            {
+                auto* const machine = static_cast<BasicPancakeVirtualMachine*>(context->machine);
+                return machine->CatchOutputError([&] { machine->_output.Put(static_cast<char>(value)); });
+            }
+
+            static Word JitOutputLiteral(JitContext* const context, Word const value) noexcept
+            {
+                auto* const machine = static_cast<BasicPancakeVirtualMachine*>(context->machine);
+                return machine->CatchOutputError([&] { TIoPolicy::WriteLiteral(machine->_output, value); });
+            }
+
+            static Word JitOutputString(JitContext* const context, Word const index) noexcept
+            {
+                auto* const machine = static_cast<BasicPancakeVirtualMachine*>(context->machine);
+                auto const& text = machine->_program->strings[index];
+                return machine->CatchOutputError([&] { machine->_output.Write(text.data(), text.size()); });
+            }
+
+            template <typename TFunction>
+            Word CatchOutputError(TFunction const& function) noexcept
+            {
+                try
+                {
+                    function();
+                    return 0;
+                }
+                catch (...)
+                {
+                    _outputError = std::current_exception();
+                    return 1;
+                }
+            }
+#endif
+
+            /// @param retryingInput Whether or not the instruction pointer is at an input instruction which
+            /// stopped to wait for input, which was already counted, traced and stopped at when it was reached.
+            template <ExecutionMode Mode>
+            void Execute(bool const retryingInput = false)
+            {
+                // Each handler ends by dispatching the next instruction itself. With threaded
+                // dispatch the compiled program is translated once into handler addresses so
+                // that dispatch is a single indirect jump, otherwise this is a switch in a loop.
+
+#if PANCAKE_THREADED_DISPATCH
+                static void const* const handlers[] =
+                {
+                    &&HandleTerminate, &&HandlePush, &&HandlePop, &&HandleDuplicate, &&HandleSwap, &&HandleReverse, &&HandleOver,
+                    &&HandleAdd, &&HandleSubtract, &&HandleMultiply, &&HandleDivide, &&HandleModulo, &&HandleIncrement, &&HandleDecrement,
+                    &&HandleLeftShift, &&HandleRightShift, &&HandleBitwiseNot, &&HandleBitwiseAnd, &&HandleBitwiseOr, &&HandleBitwiseXor,
+                    &&HandleEqual, &&HandleGreater, &&HandleLess, &&HandleGreaterOrEqual, &&HandleLessOrEqual,
+                    &&HandleLogicalNot, &&HandleLogicalAnd, &&HandleLogicalOr, &&HandleLogicalXor,
+                    &&HandleOutputCharacter, &&HandleOutputLiteral, &&HandleInput,
+                    &&HandlePanic, &&HandleJump, &&HandleJumpIfZero, &&HandleJumpIfEqual, &&HandleCall, &&HandleReturn, &&HandleStore, &&HandleLoad,
+                    &&HandleHeapLoad, &&HandleHeapStore, &&HandleHeapFill, &&HandleHeapCopy, &&HandleAddImmediate, &&HandleMultiplyImmediate, &&HandleModuloImmediate, &&HandleIncrementBy,
+                    &&HandleIncrementVariable, &&HandleDecrementVariable, &&HandleDuplicateJumpIfZero, &&HandleNip, &&HandleOutputString,
+                    &&HandleUnrecognised
+                };
+                static_assert(sizeof(handlers) / sizeof(handlers[0]) == OpcodeCount, "Every opcode must have a handler.");
+
+                auto& threadedCode = _threadedCode[static_cast<std::size_t>(Mode)];
+                if (threadedCode.empty())
+                {
+                    // Instructions which cannot exhaust the stack enter their handler after the check.
+                    #define PANCAKE_UNCHECKED(name) case Opcode::name: handler = &&Handle##name##Unchecked; break;
+
+                    threadedCode.reserve(_program->instructions.size());
+                    for (auto const& instruction : _program->instructions)
+                    {
+                        auto handler = handlers[static_cast<std::size_t>(instruction.opcode)];
+                        if (!TStackPolicy::Enabled || !instruction.checkStack)
+                        {
+                            switch (instruction.opcode)
+                            {
+                                PANCAKE_UNCHECKED(Pop) PANCAKE_UNCHECKED(Duplicate) PANCAKE_UNCHECKED(Swap) PANCAKE_UNCHECKED(Over)
+                                PANCAKE_UNCHECKED(Add) PANCAKE_UNCHECKED(Subtract) PANCAKE_UNCHECKED(Multiply) PANCAKE_UNCHECKED(Divide)
+                                PANCAKE_UNCHECKED(Modulo) PANCAKE_UNCHECKED(Increment) PANCAKE_UNCHECKED(Decrement)
+                                PANCAKE_UNCHECKED(LeftShift) PANCAKE_UNCHECKED(RightShift) PANCAKE_UNCHECKED(BitwiseNot)
+                                PANCAKE_UNCHECKED(BitwiseAnd) PANCAKE_UNCHECKED(BitwiseOr) PANCAKE_UNCHECKED(BitwiseXor)
+                                PANCAKE_UNCHECKED(Equal) PANCAKE_UNCHECKED(Greater) PANCAKE_UNCHECKED(Less)
+                                PANCAKE_UNCHECKED(GreaterOrEqual) PANCAKE_UNCHECKED(LessOrEqual) PANCAKE_UNCHECKED(LogicalNot)
+                                PANCAKE_UNCHECKED(LogicalAnd) PANCAKE_UNCHECKED(LogicalOr) PANCAKE_UNCHECKED(LogicalXor)
+                                PANCAKE_UNCHECKED(OutputCharacter) PANCAKE_UNCHECKED(OutputLiteral) PANCAKE_UNCHECKED(JumpIfZero)
+                                PANCAKE_UNCHECKED(JumpIfEqual) PANCAKE_UNCHECKED(Store) PANCAKE_UNCHECKED(IncrementBy)
+                                PANCAKE_UNCHECKED(DuplicateJumpIfZero) PANCAKE_UNCHECKED(Nip) PANCAKE_UNCHECKED(HeapLoad)
+                                PANCAKE_UNCHECKED(HeapStore) PANCAKE_UNCHECKED(HeapFill) PANCAKE_UNCHECKED(HeapCopy)
+                                default:
+                                    break;
+                            }
+                        }
+                        threadedCode.push_back({ handler, instruction.operand });
+                    }
+
+                    #undef PANCAKE_UNCHECKED
+                }
+
+                auto const* const code = threadedCode.data();
+
+                #define PANCAKE_HANDLER(name) Handle##name:
+                #define PANCAKE_CHECKED_HANDLER(name, depth) Handle##name: PANCAKE_REQUIRE(depth); Handle##name##Unchecked:
+                #define PANCAKE_DISPATCH() goto *ip->handler
+#else
+                auto const* const code = _program->instructions.data();
+
+                #define PANCAKE_HANDLER(name) case Opcode::name:
+                #define PANCAKE_CHECKED_HANDLER(name, depth) case Opcode::name: if (ip->checkStack) { PANCAKE_REQUIRE(depth); }
+                #define PANCAKE_DISPATCH() goto Dispatch
+#endif
+
+                #define PANCAKE_UNARY_HANDLER(name) PANCAKE_CHECKED_HANDLER(name, 1)
+                #define PANCAKE_BINARY_HANDLER(name) PANCAKE_CHECKED_HANDLER(name, 2)
+
+                #define PANCAKE_JUMP(address) \
+                    do \
+                    { \
+                        /* The address is evaluated once, as it may pop the return stack. */ \
+                        auto const to = static_cast<InstructionPointer>(address); \
+                        if constexpr (Mode == ExecutionMode::Profiled) \
+                        { \
+                            auto const from = static_cast<InstructionPointer>(ip - code); \
+                            _profile.jumps[to] += to != from + 1; \
+                            ++_profile.executions[to]; \
+                        } \
+                        ip = code + to; \
+                        if constexpr (Mode == ExecutionMode::Step) \
+                        { \
+                            _instructionPointer = static_cast<InstructionPointer>(ip - code); \
+                            return; \
+                        } \
+                        if constexpr (Mode == ExecutionMode::Budgeted) \
+                        { \
+                            if (--_fuel == 0) \
+                            { \
+                                _instructionPointer = static_cast<InstructionPointer>(ip - code); \
+                                return; \
+                            } \
+                        } \
+                        PANCAKE_OBSERVE(); \
+                        PANCAKE_DISPATCH(); \
+                    } while (false)
+
+                #define PANCAKE_NEXT() PANCAKE_JUMP(ip - code + 1)
+
+                // Breakpoints and tracing see each instruction just before it is executed.
+                #define PANCAKE_OBSERVE() \
+                    do \
+                    { \
+                        if constexpr (TBreakpointPolicy::Enabled) \
+                        { \
+                            if (_breakpoints.IsSet(static_cast<InstructionPointer>(ip - code))) \
+                            { \
+                                _instructionPointer = static_cast<InstructionPointer>(ip - code); \
+                                _output.Flush(); \
+                                _breakpoints.Hit(_instructionPointer); \
+                            } \
+                        } \
+                        if constexpr (TTracePolicy::Enabled) \
+                        { \
+                            _tracer.Trace(*_program, static_cast<InstructionPointer>(ip - code), _stack); \
+                        } \
+                    } while (false)
+
+                // PANics are not exceptions here. A PANic with a handler is a table lookup and a
+                // jump, and any other stops the program to be thrown from Run or Step.
+                #define PANCAKE_RAISE(type) \
+                    do \
+                    { \
+                        auto const panicHandler = _program->builtInPanicHandlers[static_cast<std::size_t>(type)]; \
+                        if (panicHandler != NoPanicHandler) \
+                        { \
+                            PANCAKE_JUMP(panicHandler); \
+                        } \
+                        _panic = (type); \
+                        goto Raised; \
+                    } while (false)
+
+                #define PANCAKE_REQUIRE(depth) \
+                    if constexpr (TStackPolicy::Enabled) \
+                    { \
+                        if (_stack.Size() < (depth)) \
+                        { \
+                            PANCAKE_RAISE(PanicType::StackExhaustion); \
+                        } \
+                    }
+
+                #define PANCAKE_REQUIRE_SPACE() \
+                    if constexpr (TStackPolicy::Enabled) \
+                    { \
+                        if (_stack.Full()) \
+                        { \
+                            PANCAKE_RAISE(PanicType::StackOverflow); \
+                        } \
+                    }
+
+                #define PANCAKE_PUSH(value) \
+                    do \
+                    { \
+                        PANCAKE_REQUIRE_SPACE(); \
+                        _stack.PushUnchecked(value); \
+                    } while (false)
+
+                // A fused push and binary operation PANics exactly as the two instructions would,
+                // so an empty stack is left holding the pushed value.
+                #define PANCAKE_REQUIRE_PUSH_THEN_BINARY() \
+                    PANCAKE_REQUIRE_SPACE(); \
+                    if constexpr (TStackPolicy::Enabled) \
+                    { \
+                        if (_stack.Empty()) \
+                        { \
+                            _stack.PushUnchecked(ip->operand); \
+                            PANCAKE_RAISE(PanicType::StackExhaustion); \
+                        } \
+                    }
+
+                auto const* ip = code + _instructionPointer;
+                if (!retryingInput)
+                {
+                    if constexpr (Mode == ExecutionMode::Profiled)
+                    {
+                        ++_profile.executions[_instructionPointer];
+                    }
+                    PANCAKE_OBSERVE();
+                }
+
+                {
+#if PANCAKE_THREADED_DISPATCH
+                    PANCAKE_DISPATCH();
+                    {
+#else
+                Dispatch:
+                    switch (ip->opcode)
+                    {
+#endif
+                        PANCAKE_HANDLER(Terminate)
+                            _running = false;
+                            _instructionPointer = static_cast<InstructionPointer>(ip - code);
+                            return;
+
+                        PANCAKE_HANDLER(Push)
+                            PANCAKE_PUSH(ip->operand);
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(Pop)
+                            _stack.Pop();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(Duplicate)
+                            PANCAKE_PUSH(_stack.Top());
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Swap)
+                        {
+                            std::swap(_stack.Top(), _stack.Second());
+                            PANCAKE_NEXT();
+                        }
+
+                        PANCAKE_HANDLER(Reverse)
+                            _stack.Reverse();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Over)
+                        {
+                            PANCAKE_PUSH(_stack.Second());
+                            PANCAKE_NEXT();
+                        }
+
+                        PANCAKE_BINARY_HANDLER(Add)
+                            PerformBinaryOperation([](Word a, Word b) { return a + b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Subtract)
+                            PerformBinaryOperation([](Word a, Word b) { return a - b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Multiply)
+                            PerformBinaryOperation([](Word a, Word b) { return a * b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Divide)
+                            if (_stack.Second() == 0)
+                            {
+                                PANCAKE_RAISE(PanicType::DivisionByZero);
+                            }
+                            PerformBinaryOperation([](Word a, Word b) { return a / b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Modulo)
+                            if (_stack.Second() == 0)
+                            {
+                                PANCAKE_RAISE(PanicType::DivisionByZero);
+                            }
+                            PerformBinaryOperation([](Word a, Word b) { return a % b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(Increment)
+                            ++_stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(Decrement)
+                            --_stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(LeftShift)
+                            PerformBinaryOperation([](Word a, Word b) { return a << b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(RightShift)
+                            PerformBinaryOperation([](Word a, Word b) { return a >> b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(BitwiseNot)
+                            _stack.Top() = ~_stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(BitwiseAnd)
+                            PerformBinaryOperation([](Word a, Word b) { return a & b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(BitwiseOr)
+                            PerformBinaryOperation([](Word a, Word b) { return a | b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(BitwiseXor)
+                            PerformBinaryOperation([](Word a, Word b) { return a ^ b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Equal)
+                            PerformBinaryOperation([](Word a, Word b) { return a == b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Greater)
+                            PerformBinaryOperation([](Word a, Word b) { return a > b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Less)
+                            PerformBinaryOperation([](Word a, Word b) { return a < b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(GreaterOrEqual)
+                            PerformBinaryOperation([](Word a, Word b) { return a >= b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(LessOrEqual)
+                            PerformBinaryOperation([](Word a, Word b) { return a <= b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(LogicalNot)
+                            _stack.Top() = !_stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(LogicalAnd)
+                            PerformBinaryOperation([](Word a, Word b) { return a && b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(LogicalOr)
+                            PerformBinaryOperation([](Word a, Word b) { return a || b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(LogicalXor)
+                            PerformBinaryOperation([](Word a, Word b) { return !a != !b; });
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(OutputCharacter)
+                            _output.Put(static_cast<char>(_stack.Pop()));
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(OutputLiteral)
+                            TIoPolicy::WriteLiteral(_output, _stack.Pop());
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(Input)
+                        {
+                            Word value = 0;
+                            auto const status = ReadInput(value);
+                            if (status == InputStatus::Pending)
+                            {
+                                // Stop without moving past the instruction, so that it is retried.
+                                _waitingForInput = true;
+                                _instructionPointer = static_cast<InstructionPointer>(ip - code);
+                                return;
+                            }
+                            if (status == InputStatus::EndOfInput)
+                            {
+                                PANCAKE_RAISE(PanicType::EndOfInput);
+                            }
+                            if (status != InputStatus::Number)
+                            {
+                                PANCAKE_RAISE(PanicType::InvalidInput);
+                            }
+                            PANCAKE_PUSH(value);
+                            PANCAKE_NEXT();
+                        }
+
+                        PANCAKE_HANDLER(Panic)
+                        {
+                            auto const handlerAddress = _program->panicHandlers[ip->operand];
+                            if (handlerAddress == NoPanicHandler)
+                            {
+                                _panic = PanicType::User;
+                                goto Raised;
+                            }
+                            PANCAKE_JUMP(handlerAddress);
+                        }
+
+                        PANCAKE_HANDLER(Jump)
+                            PANCAKE_JUMP(ip->operand);
+
+                        PANCAKE_UNARY_HANDLER(JumpIfZero)
+                            if (_stack.Top() == 0)
+                            {
+                                PANCAKE_JUMP(ip->operand);
+                            }
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(JumpIfEqual)
+                        {
+                            if (_stack.Top() == _stack.Second())
+                            {
+                                PANCAKE_JUMP(ip->operand);
+                            }
+                            PANCAKE_NEXT();
+                        }
+
+                        PANCAKE_HANDLER(Call)
+                            if (_returnStack.Full())
+                            {
+                                PANCAKE_RAISE(PanicType::ReturnStackOverflow);
+                            }
+                            _returnStack.Push(static_cast<InstructionPointer>(ip - code) + 1);
+                            PANCAKE_JUMP(ip->operand);
+
+                        PANCAKE_HANDLER(Return)
+                            if (_returnStack.Empty())
+                            {
+                                PANCAKE_RAISE(PanicType::ReturnStackExhaustion);
+                            }
+                            PANCAKE_JUMP(_returnStack.Pop());
+
+                        PANCAKE_UNARY_HANDLER(Store)
+                            _memory.Store(ip->operand, _stack.Pop());
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(Load)
+                            if (!_memory.IsDefined(ip->operand))
+                            {
+                                PANCAKE_RAISE(PanicType::UndefinedVariable);
+                            }
+                            PANCAKE_PUSH(_memory.Load(ip->operand));
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(HeapLoad)
+                            if (!_heap.Contains(_stack.Top(), 1))
+                            {
+                                PANCAKE_RAISE(PanicType::HeapOutOfBounds);
+                            }
+                            _stack.Top() = _heap.Load(_stack.Top());
+                            PANCAKE_NEXT();
+
+                        PANCAKE_CHECKED_HANDLER(HeapStore, 2)
+                            if (!_heap.Contains(_stack.Top(), 1))
+                            {
+                                PANCAKE_RAISE(PanicType::HeapOutOfBounds);
+                            }
+                            _heap.Store(_stack.Top(), _stack.Second());
+                            _heapRestored = false;
+                            _stack.Pop();
+                            _stack.Pop();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_CHECKED_HANDLER(HeapFill, 3)
+                        {
+                            auto const address = _stack.Peek(0);
+                            auto const count = _stack.Peek(1);
+                            if (!_heap.Contains(address, count))
+                            {
+                                PANCAKE_RAISE(PanicType::HeapOutOfBounds);
+                            }
+                            _heap.Fill(address, count, _stack.Peek(2));
+                            _heapRestored = false;
+                            _stack.Pop();
+                            _stack.Pop();
+                            _stack.Pop();
+                            PANCAKE_NEXT();
+                        }
+
+                        PANCAKE_CHECKED_HANDLER(HeapCopy, 3)
+                        {
+                            auto const destination = _stack.Peek(0);
+                            auto const source = _stack.Peek(1);
+                            auto const count = _stack.Peek(2);
+                            if (!_heap.Contains(destination, count) || !_heap.Contains(source, count))
+                            {
+                                PANCAKE_RAISE(PanicType::HeapOutOfBounds);
+                            }
+                            _heap.Copy(destination, source, count);
+                            _heapRestored = false;
+                            _stack.Pop();
+                            _stack.Pop();
+                            _stack.Pop();
+                            PANCAKE_NEXT();
+                        }
+
+                        PANCAKE_HANDLER(AddImmediate)
+                            PANCAKE_REQUIRE_PUSH_THEN_BINARY();
+                            _stack.Top() = ip->operand + _stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(MultiplyImmediate)
+                            PANCAKE_REQUIRE_PUSH_THEN_BINARY();
+                            _stack.Top() = ip->operand * _stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(ModuloImmediate)
+                            PANCAKE_REQUIRE_PUSH_THEN_BINARY();
+                            if (_stack.Top() == 0)
+                            {
+                                _stack.PushUnchecked(ip->operand);
+                                PANCAKE_RAISE(PanicType::DivisionByZero);
+                            }
+                            _stack.Top() = ip->operand % _stack.Top();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(IncrementBy)
+                            _stack.Top() += ip->operand;
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(IncrementVariable)
+                            if (!_memory.IsDefined(ip->operand))
+                            {
+                                PANCAKE_RAISE(PanicType::UndefinedVariable);
+                            }
+                            PANCAKE_REQUIRE_SPACE();
+                            _memory.Store(ip->operand, _memory.Load(ip->operand) + 1);
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(DecrementVariable)
+                            if (!_memory.IsDefined(ip->operand))
+                            {
+                                PANCAKE_RAISE(PanicType::UndefinedVariable);
+                            }
+                            PANCAKE_REQUIRE_SPACE();
+                            _memory.Store(ip->operand, _memory.Load(ip->operand) - 1);
+                            PANCAKE_NEXT();
+
+                        PANCAKE_UNARY_HANDLER(DuplicateJumpIfZero)
+                            PANCAKE_PUSH(_stack.Top());
+                            if (_stack.Top() == 0)
+                            {
+                                PANCAKE_JUMP(ip->operand);
+                            }
+                            PANCAKE_NEXT();
+
+                        PANCAKE_BINARY_HANDLER(Nip)
+                            _stack.Second() = _stack.Top();
+                            _stack.Pop();
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(OutputString)
+                            PANCAKE_REQUIRE_SPACE();
+                            _output.Write(_program->strings[ip->operand].data(), _program->strings[ip->operand].size());
+                            PANCAKE_NEXT();
+
+                        PANCAKE_HANDLER(Unrecognised)
+                            PANCAKE_RAISE(PanicType::UnrecognisedOpcode);
+                    }
+                }
+
+            Raised:
+                _running = false;
+                _panicked = true;
+                _instructionPointer = static_cast<InstructionPointer>(ip - code);
+                return;
+
+                #undef PANCAKE_REQUIRE_PUSH_THEN_BINARY
+                #undef PANCAKE_PUSH
+                #undef PANCAKE_REQUIRE_SPACE
+                #undef PANCAKE_REQUIRE
+                #undef PANCAKE_RAISE
+                #undef PANCAKE_OBSERVE
+                #undef PANCAKE_NEXT
+                #undef PANCAKE_JUMP
+                #undef PANCAKE_DISPATCH
+                #undef PANCAKE_BINARY_HANDLER
+                #undef PANCAKE_UNARY_HANDLER
+                #undef PANCAKE_CHECKED_HANDLER
+                #undef PANCAKE_HANDLER
+            }
+
+            template <typename TFunction>
+            void FlushAfter(TFunction const& function)
+            {
+                try
+                {
+                    function();
+                }
+                catch (...)
+                {
+                    _output.Flush();
+                    throw;
+                }
+                _output.Flush();
+            }
+
+            InputStatus ReadInput(Word& value)
+            {
+                // Anything written before the program waits for input must be visible. Binary input
+                // is read in blocks, so output is only flushed when the next block is.
+                if (!_input.HasBufferedInput())
+                {
+                    _output.Flush();
+                }
+                _inputStatus = _input.ReadNumber(value);
+                return _inputStatus;
+            }
+
+            void ThrowIfPanicked()
+            {
+                // Messages are only built here, once a PANic has escaped the program.
+
+                if (!_panicked)
+                {
+                    return;
+                }
+                _panicked = false;
+
+                auto const& instruction = _program->instructions[_instructionPointer];
+                switch (_panic)
+                {
+                    case PanicType::StackExhaustion:
+                    {
+                        auto const required = GetStackEffect(instruction.opcode).required;
+                        auto const unary = required == 1
+                            && instruction.opcode != Opcode::AddImmediate
+                            && instruction.opcode != Opcode::MultiplyImmediate
+                            && instruction.opcode != Opcode::ModuloImmediate;
+                        if (required == 3)
+                        {
+                            throw PancakePanic(_panic, "Attempted to perform ternary operation with fewer than 3 values on the stack.");
+                        }
+                        throw PancakePanic(_panic, unary
+                            ? "Attempted to perform unary operation on empty stack."
+                            : "Attempted to perform binary operation with fewer than 2 values on the stack.");
+                    }
+
+                    case PanicType::StackOverflow:
+                        throw PancakePanic(_panic, "Attempted to push to a full stack.");
+
+                    case PanicType::UndefinedVariable:
+                        throw PancakePanic(_panic, "No value stored with name '" + _program->variables[instruction.operand] + "' could be found in memory.\n");
+
+                    case PanicType::UnrecognisedOpcode:
+                        throw PancakePanic(_panic, std::string("Unrecognised opcode - '") + static_cast<char>(instruction.operand) + "'.\n");
+
+                    case PanicType::InvalidInput:
+                        throw PancakePanic(_panic, _inputStatus == InputStatus::Truncated
+                            ? "Input ended part way through a word."
+                            : "Input was not a number which fits in a word.");
+
+                    case PanicType::EndOfInput:
+                        throw PancakePanic(_panic, "Reached the end of the input.");
+
+                    case PanicType::DivisionByZero:
+                        throw PancakePanic(_panic, "Attempted to divide by zero.");
+
+                    case PanicType::HeapOutOfBounds:
+                        throw PancakePanic(_panic, "Attempted to access a word outside of the heap.");
+
+                    case PanicType::ReturnStackOverflow:
+                        throw PancakePanic(_panic, "Attempted to call a subroutine with a full return stack.");
+
+                    case PanicType::ReturnStackExhaustion:
+                        throw PancakePanic(_panic, "Attempted to return with no subroutine call to return from.");
+
+                    default:
+                        throw PancakePanic(_panic, _program->names[instruction.operand]);
+                }
+            }
+
+            template <typename TOperation>
+            void PerformBinaryOperation(TOperation const& operation)
+            {
+                // Note: the function operands are given in the order (top, second).
+
+                auto const a = _stack.Pop();
+                _stack.Top() = static_cast<Word>(operation(a, _stack.Top()));
+            }
+    };
+
+    /// The virtual machine which checks the stack and neither traces nor supports breakpoints.
+    using PancakeVirtualMachine = BasicPancakeVirtualMachine<CheckedStack, NoTracing, NoBreakpoints, TextIo>;
+
+    /// The virtual machine which never checks the stack, for programs known not to exhaust or overflow it.
+    using UncheckedPancakeVirtualMachine = BasicPancakeVirtualMachine<UncheckedStack, NoTracing, NoBreakpoints, TextIo>;
+
+    /// The virtual machine which traces every instruction it executes.
+    using TracedPancakeVirtualMachine = BasicPancakeVirtualMachine<CheckedStack, StreamTracer, NoBreakpoints, TextIo>;
+
+    /// The virtual machine which keeps the most recent instructions it executed in a ring buffer.
+    using RingTracedPancakeVirtualMachine = BasicPancakeVirtualMachine<CheckedStack, RingTracer, NoBreakpoints, TextIo>;
+
+    /// The virtual machine which supports breakpoints and, optionally, tracing.
+    using DebugPancakeVirtualMachine = BasicPancakeVirtualMachine<CheckedStack, StreamTracer, Breakpoints, TextIo>;
+
+    /// The virtual machine which checks the stack, reading and writing numbers as raw words.
+    using BinaryPancakeVirtualMachine = BasicPancakeVirtualMachine<CheckedStack, NoTracing, NoBreakpoints, BinaryIo>;
+
+    /// The virtual machine which never checks the stack, reading and writing numbers as raw words.
+    using UncheckedBinaryPancakeVirtualMachine = BasicPancakeVirtualMachine<UncheckedStack, NoTracing, NoBreakpoints, BinaryIo>;
+
+    /// The default number of instructions a scheduled program runs before the next program is given a turn.
+    constexpr std::size_t DefaultTimeSlice = 10000;
+
+    /// Multiplexes many resumable programs over a small pool of threads.
+    /// Programs take turns to run for a time slice of instructions, so no program can hold on to a thread.
+    /// A program waiting for input is set aside until it is woken.
+    class PancakeScheduler final
+    {
+        public:
+            /// Called on a worker thread once a program halts, with the PANic it raised, if any.
+            using Completion = std::function<void(PancakeVirtualMachine& machine, std::exception_ptr panic)>;
+
+            /// Initializes a new instance of the PancakeScheduler class.
+            /// @param threadCount The number of worker threads.
+            /// @param timeSlice The number of instructions a program runs for each turn.
+            explicit PancakeScheduler(std::size_t const threadCount, std::size_t const timeSlice = DefaultTimeSlice)
+                : _timeSlice(timeSlice)
+            {
+                for (std::size_t worker = 0; worker < threadCount; ++worker)
+                {
+                    _workers.emplace_back([this] { Work(); });
+                }
+            }
+
+            PancakeScheduler(PancakeScheduler const&) = delete;
+            PancakeScheduler& operator=(PancakeScheduler const&) = delete;
+
+            /// Stops the worker threads once they finish their current turns.
+            /// Programs which have not halted are abandoned.
+            ~PancakeScheduler()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _stopping = true;
+                }
+                _runnable.notify_all();
+                for (auto& worker : _workers)
+                {
+                    worker.join();
+                }
+            }
+
+            /// Schedules a program which has been loaded into a virtual machine.
+            /// The virtual machine must not be used elsewhere until its completion has been called.
+            /// @param machine The virtual machine.
+            /// @param completion Called once the program halts.
+            void Submit(PancakeVirtualMachine& machine, Completion completion)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _tasks[&machine] = { std::move(completion), TaskState::Queued, false };
+                    _queue.push_back(&machine);
+                    ++_activeCount;
+                }
+                _runnable.notify_one();
+            }
+
+            /// Makes a program waiting for input runnable again, usually after input has been added to its source.
+            /// Waking a program which is queued or has halted does nothing.
+            /// @param machine The virtual machine the program is loaded into.
+            void Wake(PancakeVirtualMachine& machine)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    auto const found = _tasks.find(&machine);
+                    if (found == _tasks.end())
+                    {
+                        return;
+                    }
+
+                    auto& task = found->second;
+                    if (task.state == TaskState::Running)
+                    {
+                        // The program may be about to wait for the input that has just arrived.
+                        task.woken = true;
+                        return;
+                    }
+                    if (task.state != TaskState::Waiting)
+                    {
+                        return;
+                    }
+
+                    task.state = TaskState::Queued;
+                    _queue.push_back(&machine);
+                }
+                _runnable.notify_one();
+            }
+
+            /// Blocks until every scheduled program has halted and its completion has returned.
+            void Wait()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _idle.wait(lock, [&] { return _activeCount == 0; });
+            }
+
+        private:
+            enum class TaskState
+            {
+                Queued,
+                Running,
+                Waiting
+            };
+
+            struct Task
+            {
+                Completion completion;
+                TaskState state;
+                bool woken;
+            };
+
+            std::size_t _timeSlice;
+            std::mutex _mutex{};
+            std::condition_variable _runnable{};
+            std::condition_variable _idle{};
+            std::deque<PancakeVirtualMachine*> _queue{};
+            std::unordered_map<PancakeVirtualMachine*, Task> _tasks{};
+            std::size_t _activeCount = 0;
+            bool _stopping = false;
+            std::vector<std::thread> _workers{};
+
+            void Work()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (;;)
+                {
+                    _runnable.wait(lock, [&] { return _stopping || !_queue.empty(); });
+                    if (_stopping)
+                    {
+                        return;
+                    }
+
+                    auto* const machine = _queue.front();
+                    _queue.pop_front();
+                    auto& task = _tasks.find(machine)->second;
+                    task.state = TaskState::Running;
+                    task.woken = false;
+                    lock.unlock();
+
+                    auto status = ExecutionStatus::Halted;
+                    std::exception_ptr panic{};
+                    try
+                    {
+                        status = machine->Resume(_timeSlice);
+                    }
+                    catch (...)
+                    {
+                        panic = std::current_exception();
+                    }
+
+                    lock.lock();
+                    if (status == ExecutionStatus::OutOfFuel || (status == ExecutionStatus::WaitingForInput && task.woken))
+                    {
+                        // Back of the queue, so that every runnable program gets a turn first.
+                        task.state = TaskState::Queued;
+                        _queue.push_back(machine);
+                        continue;
+                    }
+                    if (status == ExecutionStatus::WaitingForInput)
+                    {
+                        task.state = TaskState::Waiting;
+                        continue;
+                    }
+
+                    auto const completion = std::move(task.completion);
+                    _tasks.erase(machine);
+                    lock.unlock();
+                    if (completion)
+                    {
+                        completion(*machine, panic);
+                    }
+                    lock.lock();
+
+                    if (--_activeCount == 0)
+                    {
+                        _idle.notify_all();
+                    }
+                }
+            }
+    };
+
+    /// Lowers Pancake source into instructions for the virtual machine.
+    class PancakeCompiler final
+    {
+        public:
+            /// Compiles the given program in a single pass over its source.
+            /// Whitespace and comments are skipped as the source is read, so it is never copied.
+            /// All immediates are decoded and all jump and PANic handler addresses are resolved.
+            /// Undefined, duplicate and unreachable labels and duplicate PANic handlers are
+            /// all reported together in a single PANic.
+            /// @param source The program source.
+            /// @returns The compiled program.
+            static CompiledProgram Compile(std::string_view const source)
+            {
+                auto compiler = PancakeCompiler(source);
+                compiler.SkipInsignificant();
+                while (compiler._position < source.size())
+                {
+                    auto const sourceOffset = compiler._position;
+                    auto const opcode = compiler.Next();
+                    if (compiler._position < source.size() && source[compiler._position] == '{')
+                    {
+                        compiler.Next();
+                        compiler.ReadArgument();
+                        compiler.CompileLabelInstruction(opcode, compiler._argument, sourceOffset);
+                    }
+                    else
+                    {
+                        compiler.CompileInstruction(opcode, sourceOffset);
+                    }
+                }
+
+                compiler.Emit(Opcode::Terminate, 0, source.size());
+                compiler.ResolveAddresses();
+                compiler.FindUnreachableLabels();
+                compiler.ThrowIfInvalid();
+                return std::move(compiler._program);
+            }
+
+        private:
+            /// A problem found while compiling a program.
+            struct Diagnostic
+            {
+                PanicType type;
+                std::string message;
+            };
+
+            std::string_view _source;
+            std::size_t _position = 0;
+            std::string _argument{};
+            CompiledProgram _program{};
+            std::unordered_map<std::string, Word> _nameIndices{};
+            std::unordered_map<std::string, Word> _variableSlots{};
+            InstructionPointerMap _labels{};
+            std::vector<std::string> _labelOrder{};
+            InstructionPointerMap _panicHandlers{};
+            std::vector<Diagnostic> _diagnostics{};
+
+            explicit PancakeCompiler(std::string_view const source) noexcept
+                : _source(source)
+            {
+            }
+
+            static bool IsWhitespace(char const c) noexcept
+            {
+                return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+            }
+
+            void SkipInsignificant()
+            {
+                while (_position < _source.size())
+                {
+                    auto const c = _source[_position];
+                    if (IsWhitespace(c))
+                    {
+                        ++_position;
+                    }
+                    else if (c == '`')
+                    {
+                        auto const commentEnd = _source.find('`', _position + 1);
+                        if (commentEnd == std::string_view::npos)
+                        {
+                            throw PancakePanic(PanicType::InvalidLanguage, "Unmatched comment.");
+                        }
+                        _position = commentEnd + 1;
+                    }
+                    else
+                    {
+                        break;
+                    }
+                }
+            }
+
+            char Next()
+            {
+                auto const c = _source[_position++];
+                SkipInsignificant();
+                return c;
+            }
+
+            void ReadArgument()
+            {
+                // Whitespace and comments inside the braces are skipped like anywhere else.
+                _argument.clear();
+                while (true)
+                {
+                    if (_position == _source.size())
+                    {
+                        throw PancakePanic(PanicType::InvalidLanguage, "Unmatched braces for argument instruction.");
+                    }
+
+                    auto const c = Next();
+                    if (c == '}')
+                    {
+                        return;
+                    }
+                    _argument += c;
+                }
+            }
+
+            void Emit(Opcode const opcode, Word const operand, std::size_t const sourceOffset)
+            {
+                _program.instructions.push_back({opcode, operand});
+                _program.sourceOffsets.push_back(sourceOffset);
+            }
+
+            Word InternName(std::string const& name)
+            {
+                auto const found = _nameIndices.find(name);
+                if (found != _nameIndices.end())
+                {
+                    return found->second;
+                }
+
+                auto const index = static_cast<Word>(_program.names.size());
+                _program.names.push_back(name);
+                _nameIndices.emplace(name, index);
+                return index;
+            }
+
+            Word InternVariable(std::string const& name)
+            {
+                auto const found = _variableSlots.find(name);
+                if (found != _variableSlots.end())
+                {
+                    return found->second;
+                }
+
+                auto const slot = static_cast<Word>(_program.variables.size());
+                _program.variables.push_back(name);
+                _variableSlots.emplace(name, slot);
+                return slot;
+            }
+
+            void CompileInstruction(char const opcode, std::size_t const sourceOffset)
+            {
+                // A table indexed by character, so decoding costs one load per instruction.
+                static auto const opcodes = []
+                {
+                    std::pair<char, Opcode> const mnemonics[] =
+                    {
+                        { '|', Opcode::Terminate },
+                        { '^', Opcode::Push },
+                        { ';', Opcode::Pop },
+                        { '&', Opcode::Duplicate },
+                        { '$', Opcode::Swap },
+                        { '~', Opcode::Reverse },
+                        { '\'', Opcode::Over },
+                        { '+', Opcode::Add },
+                        { '-', Opcode::Subtract },
+                        { '*', Opcode::Multiply },
+                        { '/', Opcode::Divide },
+                        { '%', Opcode::Modulo },
+                        { '>', Opcode::Increment },
+                        { '<', Opcode::Decrement },
+                        { '[', Opcode::LeftShift },
+                        { ']', Opcode::RightShift },
+                        { 'n', Opcode::BitwiseNot },
+                        { 'a', Opcode::BitwiseAnd },
+                        { 'o', Opcode::BitwiseOr },
+                        { 'x', Opcode::BitwiseXor },
+                        { 'E', Opcode::Equal },
+                        { 'G', Opcode::Greater },
+                        { 'L', Opcode::Less },
+                        { 'g', Opcode::GreaterOrEqual },
+                        { 'l', Opcode::LessOrEqual },
+                        { 'N', Opcode::LogicalNot },
+                        { 'A', Opcode::LogicalAnd },
+                        { 'O', Opcode::LogicalOr },
+                        { 'X', Opcode::LogicalXor },
+                        { '.', Opcode::OutputCharacter },
+                        { '_', Opcode::OutputLiteral },
+                        { ',', Opcode::Input },
+                        { 'r', Opcode::Return },
+                        { '@', Opcode::HeapLoad },
+                        { '#', Opcode::HeapStore },
+                        { 'F', Opcode::HeapFill },
+                        { 'C', Opcode::HeapCopy }
+                    };
+
+                    std::array<Opcode, 256> table{};
+                    table.fill(Opcode::Unrecognised);
+                    for (auto const& mnemonic : mnemonics)
+                    {
+                        table[static_cast<unsigned char>(mnemonic.first)] = mnemonic.second;
+                    }
+                    return table;
+                }();
+
+                auto const decoded = opcodes[static_cast<unsigned char>(opcode)];
+                if (decoded == Opcode::Unrecognised)
+                {
+                    Emit(Opcode::Unrecognised, static_cast<unsigned char>(opcode), sourceOffset);
+                    return;
+                }
+
+                Emit(decoded, 0, sourceOffset);
+            }
+
+            void CompileLabelInstruction(char const opcode, std::string const& label, std::size_t const sourceOffset)
+            {
+                switch (opcode)
+                {
+                    case '^':
+                        Emit(Opcode::Push, ParseWord(label), sourceOffset);
+                        break;
+
+                    case 'p':
+                        Emit(Opcode::Panic, InternName(label), sourceOffset);
+                        break;
+
+                    case 'h':
+                        if (!_panicHandlers.emplace(label, _program.instructions.size()).second)
+                        {
+                            _diagnostics.push_back({ PanicType::MultiplePanicHandlers, std::string("Multiple PANic handlers for '") + label + "'." });
+                        }
+                        break;
+
+                    case ':':
+                        if (!_labels.emplace(label, _program.instructions.size()).second)
+                        {
+                            _diagnostics.push_back({ PanicType::InvalidLanguage, std::string("Label '") + label + "' is defined more than once." });
+                            break;
+                        }
+                        _labelOrder.push_back(label);
+                        break;
+
+                    case 'j':
+                        Emit(Opcode::Jump, InternName(label), sourceOffset);
+                        break;
+
+                    case 'z':
+                        Emit(Opcode::JumpIfZero, InternName(label), sourceOffset);
+                        break;
+
+                    case 'e':
+                        Emit(Opcode::JumpIfEqual, InternName(label), sourceOffset);
+                        break;
+
+                    case 'c':
+                        Emit(Opcode::Call, InternName(label), sourceOffset);
+                        break;
+
+                    case '!':
+                        Emit(Opcode::Store, InternVariable(label), sourceOffset);
+                        break;
+
+                    case '?':
+                        Emit(Opcode::Load, InternVariable(label), sourceOffset);
+                        break;
+
+                    default:
+                        Emit(Opcode::Unrecognised, static_cast<unsigned char>(opcode), sourceOffset);
+                        break;
+                }
+            }
+
+            void ResolveAddresses()
+            {
+                std::unordered_set<Word> undefinedLabels{};
+                for (auto& instruction : _program.instructions)
+                {
+                    if (!IsJump(instruction.opcode))
+                    {
+                        continue;
+                    }
+
+                    auto const& label = _program.names[instruction.operand];
+                    auto const found = _labels.find(label);
+                    if (found != _labels.end())
+                    {
+                        instruction.operand = found->second;
+                    }
+                    else
+                    {
+                        if (undefinedLabels.insert(instruction.operand).second)
+                        {
+                            _diagnostics.push_back({ PanicType::UndefinedLabel, std::string("Cannot jump to label '") + label + "' as it does not exist." });
+                        }
+                        instruction.operand = _program.instructions.size() - 1;
+                    }
+                }
+
+                // Only names raised by p{} are interned, so unused handlers need no slot.
+                _program.panicHandlers.assign(_program.names.size(), NoPanicHandler);
+                for (auto const& handler : _panicHandlers)
+                {
+                    auto const found = _nameIndices.find(handler.first);
+                    if (found != _nameIndices.end())
+                    {
+                        _program.panicHandlers[found->second] = handler.second;
+                    }
+                }
+
+                for (auto const& label : _labelOrder)
+                {
+                    _program.labelNames.push_back(label);
+                    _program.labelAddresses.push_back(_labels[label]);
+                }
+
+                for (std::size_t type = 0; type < PanicTypeCount; ++type)
+                {
+                    auto const* const name = GetPanicHandlerName(static_cast<PanicType>(type));
+                    auto const found = name != nullptr ? _panicHandlers.find(name) : _panicHandlers.end();
+                    if (found != _panicHandlers.end())
+                    {
+                        _program.builtInPanicHandlers[type] = found->second;
+                    }
+                }
+
+                // The end of the input used to raise InvalidInput, so its handlers still catch it.
+                auto& endOfInputHandler = _program.builtInPanicHandlers[static_cast<std::size_t>(PanicType::EndOfInput)];
+                if (endOfInputHandler == NoPanicHandler)
+                {
+                    endOfInputHandler = _program.builtInPanicHandlers[static_cast<std::size_t>(PanicType::InvalidInput)];
+                }
+            }
+
+            void FindUnreachableLabels()
+            {
+                // Walk every path from the start of the program. Jumps and handled PANics, including
+                // those raised by the virtual machine, are the only ways to reach code after a
+                // terminate or unconditional jump.
+
+                std::vector<bool> reachable(_program.instructions.size(), false);
+                std::vector<InstructionPointer> pending{ 0 };
+                reachable[0] = true;
+                while (!pending.empty())
+                {
+                    auto const address = pending.back();
+                    pending.pop_back();
+                    auto const reach = [&](InstructionPointer const successor)
+                    {
+                        if (!reachable[successor])
+                        {
+                            reachable[successor] = true;
+                            pending.push_back(successor);
+                        }
+                    };
+                    ForEachSuccessor(_program, address, reach);
+                    ForEachBuiltInPanicHandler(_program, address, reach);
+                }
+
+                for (auto const& label : _labelOrder)
+                {
+                    if (!reachable[_labels[label]])
+                    {
+                        _diagnostics.push_back({ PanicType::InvalidLanguage, std::string("Label '") + label + "' is unreachable." });
+                    }
+                }
+            }
+
+            void ThrowIfInvalid() const
+            {
+                if (_diagnostics.empty())
+                {
+                    return;
+                }
+
+                // The diagnostic keeps the PANic type of its problems when they all agree.
+                auto type = _diagnostics.front().type;
+                std::string message{};
+                for (auto const& diagnostic : _diagnostics)
+                {
+                    if (diagnostic.type != type)
+                    {
+                        type = PanicType::InvalidLanguage;
+                    }
+                    if (!message.empty())
+                    {
+                        message += '\n';
+                    }
+                    message += diagnostic.message;
+                }
+
+                throw PancakePanic(type, message);
+            }
+
+            static Word ParseWord(std::string const& text)
+            {
+                constexpr auto maximum = static_cast<Word>(-1);
+                Word value = 0;
+                for (auto const c : text)
+                {
+                    auto const digit = static_cast<Word>(c - '0');
+                    if (c < '0' || c > '9' || value > (maximum - digit) / 10)
+                    {
+                        throw PancakePanic(PanicType::InvalidLanguage, std::string("Invalid number '") + text + "'.");
+                    }
+                    value = value * 10 + digit;
+                }
+                return value;
+            }
+    };
+
+    /// Rewrites the straight-line regions of a compiled program through a static single assignment form.
+    ///
+    /// A region is a run of instructions which only move values between the stack, memory and I/O, and
+    /// which nothing jumps into. Lifting a region replaces the stack with values: constants, the words on
+    /// the stack and in memory when the region is entered, inputs and operations on other values.
+    /// Shuffles like `$`, `'` and `;` only rearrange values, so they disappear. Operations on constants
+    /// are folded, loads after stores are forwarded, and a store survives only if it is the last one to a
+    /// memory slot which the program loads somewhere. The values are then lowered back to instructions.
+    ///
+    /// A lowering replaces a region only if it is shorter and lifting it again gives exactly the same
+    /// PANic checks, output, input, results on the stack and stores, in the same order. Regions where a
+    /// PANic could reach a handler are never lifted, since the handler sees the stack between instructions,
+    /// and neither are regions which could overflow the stack, since a lowering may push fewer words.
+    /// Instructions which no path through the program reaches are removed.
+    class SsaRewriter final
+    {
+        public:
+            /// Rewrites a compiled program in place.
+            /// @param program The program to rewrite.
+            /// @param stackCapacity The maximum number of words on the operand stack the program will run with.
+            static void Rewrite(CompiledProgram& program, std::size_t const stackCapacity)
+            {
+                auto const& instructions = program.instructions;
+                auto const count = instructions.size();
+                auto const analysis = StackDepthAnalysis(program);
+
+                std::vector<bool> isBoundary(count, false);
+                isBoundary[0] = true;
+                for (auto const& instruction : instructions)
+                {
+                    if (IsJump(instruction.opcode))
+                    {
+                        isBoundary[instruction.operand] = true;
+                    }
+                }
+                for (auto const* addresses : { &program.panicHandlers, &program.builtInPanicHandlers, &program.labelAddresses })
+                {
+                    for (auto const address : *addresses)
+                    {
+                        if (address != NoPanicHandler)
+                        {
+                            isBoundary[address] = true;
+                        }
+                    }
+                }
+
+                std::vector<bool> isLoaded(program.variables.size(), false);
+                for (auto const& instruction : instructions)
+                {
+                    if (instruction.opcode == Opcode::Load
+                        || instruction.opcode == Opcode::IncrementVariable
+                        || instruction.opcode == Opcode::DecrementVariable)
+                    {
+                        isLoaded[instruction.operand] = true;
+                    }
+                }
+
+                auto const variableCount = program.variables.size();
+                Rewriter rewriter(program, isLoaded);
+                std::vector<Instruction> rewritten{};
+                std::vector<std::size_t> rewrittenSourceOffsets{};
+                std::vector<InstructionPointer> newAddresses(count);
+                std::size_t index = 0;
+                while (index < count)
+                {
+                    auto const start = rewritten.size();
+                    auto end = index + 1;
+                    if (IsLiftable(program, index))
+                    {
+                        while (end < count && !isBoundary[end] && IsLiftable(program, end))
+                        {
+                            ++end;
+                        }
+                    }
+
+                    // The last instruction is kept even if it is unreachable, so the program still ends with Terminate.
+                    if (analysis.IsReachable(index) || end == count)
+                    {
+                        auto const maximum = analysis.GetMaximumDepth(index);
+                        auto const room = maximum == StackDepthAnalysis::Unbounded || maximum > stackCapacity ? 0 : stackCapacity - maximum;
+                        Region region{};
+                        if (end - index > 1 && rewriter.Lower(index, end, analysis.GetMinimumDepth(index), room, region))
+                        {
+                            rewritten.insert(rewritten.end(), region.instructions.begin(), region.instructions.end());
+                            rewrittenSourceOffsets.insert(rewrittenSourceOffsets.end(), region.sourceOffsets.begin(), region.sourceOffsets.end());
+                        }
+                        else
+                        {
+                            rewritten.insert(rewritten.end(), instructions.begin() + index, instructions.begin() + end);
+                            rewrittenSourceOffsets.insert(rewrittenSourceOffsets.end(), program.sourceOffsets.begin() + index, program.sourceOffsets.begin() + end);
+                        }
+                    }
+
+                    for (auto address = index; address < end; ++address)
+                    {
+                        newAddresses[address] = start;
+                    }
+                    index = end;
+                }
+
+                for (auto& instruction : rewritten)
+                {
+                    if (IsJump(instruction.opcode))
+                    {
+                        instruction.operand = newAddresses[instruction.operand];
+                    }
+                }
+                for (auto* handlers : { &program.panicHandlers, &program.builtInPanicHandlers })
+                {
+                    for (auto& handlerAddress : *handlers)
+                    {
+                        if (handlerAddress != NoPanicHandler)
+                        {
+                            handlerAddress = analysis.IsReachable(handlerAddress) ? newAddresses[handlerAddress] : NoPanicHandler;
+                        }
+                    }
+                }
+                for (auto& labelAddress : program.labelAddresses)
+                {
+                    labelAddress = newAddresses[labelAddress];
+                }
+
+                // Lowerings which were tried but not kept may have added temporaries nothing uses.
+                auto const usesSlot = [](Opcode const opcode)
+                {
+                    return opcode == Opcode::Store || opcode == Opcode::Load
+                        || opcode == Opcode::IncrementVariable || opcode == Opcode::DecrementVariable;
+                };
+                std::vector<Word> newSlots(program.variables.size(), NoSlot);
+                for (auto const& instruction : rewritten)
+                {
+                    if (usesSlot(instruction.opcode))
+                    {
+                        newSlots[instruction.operand] = 0;
+                    }
+                }
+                auto slotCount = variableCount;
+                for (auto slot = variableCount; slot < program.variables.size(); ++slot)
+                {
+                    if (newSlots[slot] != NoSlot)
+                    {
+                        newSlots[slot] = slotCount;
+                        program.variables[slotCount] = "{temporary " + std::to_string(slotCount - variableCount) + "}";
+                        ++slotCount;
+                    }
+                }
+                program.variables.resize(slotCount);
+                for (auto& instruction : rewritten)
+                {
+                    if (usesSlot(instruction.opcode) && instruction.operand >= variableCount)
+                    {
+                        instruction.operand = newSlots[instruction.operand];
+                    }
+                }
+
+                program.instructions = std::move(rewritten);
+                program.sourceOffsets = std::move(rewrittenSourceOffsets);
+            }
+
+        private:
+            using ValueId = std::size_t;
+            static constexpr ValueId NoValue = static_cast<ValueId>(-1);
+            static constexpr Word NoSlot = static_cast<Word>(-1);
+
+            /// What a value is, and so how it can be produced again.
+            enum class ValueKind
+            {
+                /// A constant word.
+                Constant,
+
+                /// A word on the stack when the region is entered. The operand is its depth from the top.
+                Entry,
+
+                /// A memory slot when the region is entered. The operand is the slot.
+                Memory,
+
+                /// A word read by the input event whose ordinal is the operand.
+                Input,
+
+                /// The result of a division which is checked for a zero divisor. The operand is its event ordinal.
+                Checked,
+
+                /// An operation on other values which cannot fail.
+                Operation
+            };
+
+            struct Value
+            {
+                ValueKind kind;
+                Opcode opcode;
+                Word operand;
+                ValueId top;
+                ValueId second;
+                std::size_t sourceOffset;
+            };
+
+            /// An effect which must happen in order: a PANic check, output or input.
+            struct Event
+            {
+                Opcode opcode;
+                Word operand;
+                ValueId top;
+                ValueId second;
+                std::size_t sourceOffset;
+
+                bool operator==(Event const& other) const noexcept
+                {
+                    return opcode == other.opcode && operand == other.operand && top == other.top && second == other.second;
+                }
+            };
+
+            /// A region lifted into values.
+            struct Summary
+            {
+                /// The events, in order.
+                std::vector<Event> events{};
+
+                /// The values left on the stack above the entry words which remain, from the bottom.
+                std::vector<ValueId> exit{};
+
+                /// The value last stored to each memory slot, in the order the slots are first stored.
+                std::vector<std::pair<Word, ValueId>> stores{};
+
+                /// The number of entry words the region removes from the stack.
+                std::size_t consumed = 0;
+
+                /// The largest depth of the stack relative to its depth when the region is entered.
+                long peak = 0;
+            };
+
+            /// A region lowered back into instructions.
+            struct Region
+            {
+                std::vector<Instruction> instructions{};
+                std::vector<std::size_t> sourceOffsets{};
+            };
+
+            static bool IsLiftable(CompiledProgram const& program, InstructionPointer const address)
+            {
+                auto const opcode = program.instructions[address].opcode;
+                switch (opcode)
+                {
+                    case Opcode::Push:
+                    case Opcode::Pop:
+                    case Opcode::Duplicate:
+                    case Opcode::Swap:
+                    case Opcode::Over:
+                    case Opcode::Add:
+                    case Opcode::Subtract:
+                    case Opcode::Multiply:
+                    case Opcode::Divide:
+                    case Opcode::Modulo:
+                    case Opcode::Increment:
+                    case Opcode::Decrement:
+                    case Opcode::LeftShift:
+                    case Opcode::RightShift:
+                    case Opcode::BitwiseNot:
+                    case Opcode::BitwiseAnd:
+                    case Opcode::BitwiseOr:
+                    case Opcode::BitwiseXor:
+                    case Opcode::Equal:
+                    case Opcode::Greater:
+                    case Opcode::Less:
+                    case Opcode::GreaterOrEqual:
+                    case Opcode::LessOrEqual:
+                    case Opcode::LogicalNot:
+                    case Opcode::LogicalAnd:
+                    case Opcode::LogicalOr:
+                    case Opcode::LogicalXor:
+                    case Opcode::OutputCharacter:
+                    case Opcode::OutputLiteral:
+                    case Opcode::Input:
+                    case Opcode::Store:
+                    case Opcode::Load:
+                    {
+                        auto handled = false;
+                        ForEachBuiltInPanicHandler(program, address, [&](InstructionPointer) { handled = true; });
+                        return !handled;
+                    }
+
+                    default:
+                        return false;
+                }
+            }
+
+            static bool IsUnary(Opcode const opcode) noexcept
+            {
+                return opcode == Opcode::Increment || opcode == Opcode::Decrement
+                    || opcode == Opcode::BitwiseNot || opcode == Opcode::LogicalNot;
+            }
+
+            static bool IsCommutative(Opcode const opcode) noexcept
+            {
+                switch (opcode)
+                {
+                    case Opcode::Add:
+                    case Opcode::Multiply:
+                    case Opcode::BitwiseAnd:
+                    case Opcode::BitwiseOr:
+                    case Opcode::BitwiseXor:
+                    case Opcode::Equal:
+                    case Opcode::LogicalAnd:
+                    case Opcode::LogicalOr:
+                    case Opcode::LogicalXor:
+                        return true;
+
+                    default:
+                        return false;
+                }
+            }
+
+            /// Lifts and lowers the regions of one program, numbering values so equal values get the same identifier.
+            class Rewriter final
+            {
+                public:
+                    Rewriter(CompiledProgram& program, std::vector<bool> const& isLoaded)
+                        : _program(program), _isLoaded(isLoaded)
+                    {
+                    }
+
+                    /// Lowers a region, if that makes it shorter.
+                    /// @param begin The address of the first instruction.
+                    /// @param end The address after the last instruction.
+                    /// @param depth The smallest depth the stack can have when the region is entered.
+                    /// @param room The number of words which can always be pushed when the region is entered.
+                    /// @param region Receives the lowered region.
+                    /// @returns Whether or not the region was lowered.
+                    bool Lower(InstructionPointer const begin, InstructionPointer const end, std::size_t const depth, std::size_t const room, Region& region)
+                    {
+                        _values.clear();
+                        _ids.clear();
+
+                        Region original{};
+                        original.instructions.assign(_program.instructions.begin() + begin, _program.instructions.begin() + end);
+                        original.sourceOffsets.assign(_program.sourceOffsets.begin() + begin, _program.sourceOffsets.begin() + end);
+
+                        Summary summary{};
+                        if (!Lift(original, summary) || summary.consumed > depth || static_cast<std::size_t>(summary.peak) > room)
+                        {
+                            return false;
+                        }
+
+                        // Stores to slots which are never loaded are dead.
+                        summary.stores.erase(std::remove_if(summary.stores.begin(), summary.stores.end(), [&](auto const& store)
+                        {
+                            return !_isLoaded[store.first];
+                        }), summary.stores.end());
+
+                        auto found = false;
+                        for (auto const spill : { false, true })
+                        {
+                            for (auto const storesFirst : { false, true })
+                            {
+                                Region candidate{};
+                                Summary lowered{};
+                                if (Emit(summary, spill, storesFirst, original.sourceOffsets.front(), candidate)
+                                    && candidate.instructions.size() < (found ? region.instructions.size() : original.instructions.size())
+                                    && Lift(candidate, lowered)
+                                    && static_cast<std::size_t>(lowered.peak) <= room
+                                    && IsEquivalent(summary, lowered))
+                                {
+                                    region = std::move(candidate);
+                                    found = true;
+                                }
+                            }
+                        }
+                        return found;
+                    }
+
+                private:
+                    /// A word on the stack while a region is lowered.
+                    struct Slot
+                    {
+                        ValueId value;
+
+                        /// Whether the word was left by an earlier event, rather than being an operand being built.
+                        bool settled;
+                    };
+
+                    ValueId Intern(ValueKind const kind, Opcode const opcode, Word const operand, ValueId const top, ValueId const second, std::size_t const sourceOffset)
+                    {
+                        auto const key = std::make_tuple(kind, opcode, operand, top, second);
+                        auto const found = _ids.find(key);
+                        if (found != _ids.end())
+                        {
+                            return found->second;
+                        }
+                        _values.push_back({ kind, opcode, operand, top, second, sourceOffset });
+                        _ids.emplace(key, _values.size() - 1);
+                        return _values.size() - 1;
+                    }
+
+                    ValueId Constant(Word const word, std::size_t const sourceOffset)
+                    {
+                        return Intern(ValueKind::Constant, Opcode::Push, word, NoValue, NoValue, sourceOffset);
+                    }
+
+                    bool IsConstant(ValueId const value, Word const word) const noexcept
+                    {
+                        return _values[value].kind == ValueKind::Constant && _values[value].operand == word;
+                    }
+
+                    /// Gets the value of an operation which cannot fail, folding constants and identities.
+                    ValueId Operation(Opcode const opcode, ValueId const top, ValueId const second, std::size_t const sourceOffset)
+                    {
+                        auto const& a = _values[top];
+                        if (second == NoValue)
+                        {
+                            if (a.kind == ValueKind::Constant)
+                            {
+                                auto const word = a.operand;
+                                switch (opcode)
+                                {
+                                    case Opcode::Increment: return Constant(word + 1, sourceOffset);
+                                    case Opcode::Decrement: return Constant(word - 1, sourceOffset);
+                                    case Opcode::BitwiseNot: return Constant(~word, sourceOffset);
+                                    default: return Constant(!word, sourceOffset);
+                                }
+                            }
+                            return Intern(ValueKind::Operation, opcode, 0, top, NoValue, sourceOffset);
+                        }
+
+                        auto const& b = _values[second];
+                        if (a.kind == ValueKind::Constant && b.kind == ValueKind::Constant)
+                        {
+                            // Shifting by the word size or more has no defined result, so it is left to the virtual machine.
+                            auto const x = a.operand;
+                            auto const y = b.operand;
+                            switch (opcode)
+                            {
+                                case Opcode::Add: return Constant(x + y, sourceOffset);
+                                case Opcode::Subtract: return Constant(x - y, sourceOffset);
+                                case Opcode::Multiply: return Constant(x * y, sourceOffset);
+                                case Opcode::Divide: return Constant(x / y, sourceOffset);
+                                case Opcode::Modulo: return Constant(x % y, sourceOffset);
+                                case Opcode::LeftShift: if (y < 64) { return Constant(x << y, sourceOffset); } break;
+                                case Opcode::RightShift: if (y < 64) { return Constant(x >> y, sourceOffset); } break;
+                                case Opcode::BitwiseAnd: return Constant(x & y, sourceOffset);
+                                case Opcode::BitwiseOr: return Constant(x | y, sourceOffset);
+                                case Opcode::BitwiseXor: return Constant(x ^ y, sourceOffset);
+                                case Opcode::Equal: return Constant(x == y, sourceOffset);
+                                case Opcode::Greater: return Constant(x > y, sourceOffset);
+                                case Opcode::Less: return Constant(x < y, sourceOffset);
+                                case Opcode::GreaterOrEqual: return Constant(x >= y, sourceOffset);
+                                case Opcode::LessOrEqual: return Constant(x <= y, sourceOffset);
+                                case Opcode::LogicalAnd: return Constant(x && y, sourceOffset);
+                                case Opcode::LogicalOr: return Constant(x || y, sourceOffset);
+                                default: return Constant(!x != !y, sourceOffset);
+                            }
+                        }
+
+                        switch (opcode)
+                        {
+                            case Opcode::Add:
+                                if (IsConstant(second, 1)) { return Operation(Opcode::Increment, top, NoValue, sourceOffset); }
+                                if (IsConstant(top, 1)) { return Operation(Opcode::Increment, second, NoValue, sourceOffset); }
+                                [[fallthrough]];
+
+                            case Opcode::BitwiseOr:
+                            case Opcode::BitwiseXor:
+                                if (IsConstant(second, 0)) { return top; }
+                                if (IsConstant(top, 0)) { return second; }
+                                break;
+
+                            case Opcode::Multiply:
+                                if (IsConstant(second, 1)) { return top; }
+                                if (IsConstant(top, 1)) { return second; }
+                                break;
+
+                            case Opcode::Subtract:
+                                if (IsConstant(second, 1)) { return Operation(Opcode::Decrement, top, NoValue, sourceOffset); }
+                                [[fallthrough]];
+
+                            case Opcode::LeftShift:
+                            case Opcode::RightShift:
+                                if (IsConstant(second, 0)) { return top; }
+                                break;
+
+                            case Opcode::Divide:
+                                if (IsConstant(second, 1)) { return top; }
+                                break;
+
+                            default:
+                                break;
+                        }
+
+                        if (IsCommutative(opcode) && second < top)
+                        {
+                            return Intern(ValueKind::Operation, opcode, 0, second, top, sourceOffset);
+                        }
+                        return Intern(ValueKind::Operation, opcode, 0, top, second, sourceOffset);
+                    }
+
+                    /// Lifts instructions into values.
+                    /// @param region The instructions.
+                    /// @param summary Receives the values.
+                    /// @returns Whether or not every instruction could be lifted.
+                    bool Lift(Region const& region, Summary& summary)
+                    {
+                        std::vector<ValueId> stack{};
+                        std::unordered_map<Word, ValueId> memory{};
+                        std::unordered_set<Word> checked{};
+                        std::size_t consumed = 0;
+
+                        auto const require = [&](std::size_t const depth)
+                        {
+                            while (stack.size() < depth)
+                            {
+                                stack.insert(stack.begin(), Intern(ValueKind::Entry, Opcode::Push, consumed, NoValue, NoValue, region.sourceOffsets.front()));
+                                ++consumed;
+                            }
+                        };
+                        auto const pop = [&]()
+                        {
+                            auto const value = stack.back();
+                            stack.pop_back();
+                            return value;
+                        };
+
+                        for (std::size_t index = 0; index < region.instructions.size(); ++index)
+                        {
+                            auto const& instruction = region.instructions[index];
+                            auto const sourceOffset = region.sourceOffsets[index];
+                            auto const opcode = instruction.opcode;
+                            require(GetStackEffect(opcode).required);
+                            switch (opcode)
+                            {
+                                case Opcode::Push:
+                                    stack.push_back(Constant(instruction.operand, sourceOffset));
+                                    break;
+
+                                case Opcode::Pop:
+                                    pop();
+                                    break;
+
+                                case Opcode::Duplicate:
+                                    stack.push_back(stack.back());
+                                    break;
+
+                                case Opcode::Swap:
+                                    std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+                                    break;
+
+                                case Opcode::Over:
+                                    stack.push_back(stack[stack.size() - 2]);
+                                    break;
+
+                                case Opcode::OutputCharacter:
+                                case Opcode::OutputLiteral:
+                                    summary.events.push_back({ opcode, 0, pop(), NoValue, sourceOffset });
+                                    break;
+
+                                case Opcode::Input:
+                                    summary.events.push_back({ opcode, 0, NoValue, NoValue, sourceOffset });
+                                    stack.push_back(Intern(ValueKind::Input, opcode, summary.events.size(), NoValue, NoValue, sourceOffset));
+                                    break;
+
+                                case Opcode::Store:
+                                {
+                                    auto const value = pop();
+                                    if (memory.find(instruction.operand) == memory.end())
+                                    {
+                                        summary.stores.emplace_back(instruction.operand, value);
+                                    }
+                                    memory[instruction.operand] = value;
+                                    break;
+                                }
+
+                                case Opcode::Load:
+                                {
+                                    auto const found = memory.find(instruction.operand);
+                                    if (found != memory.end())
+                                    {
+                                        stack.push_back(found->second);
+                                        break;
+                                    }
+                                    if (checked.insert(instruction.operand).second)
+                                    {
+                                        summary.events.push_back({ opcode, instruction.operand, NoValue, NoValue, sourceOffset });
+                                    }
+                                    stack.push_back(Intern(ValueKind::Memory, opcode, instruction.operand, NoValue, NoValue, sourceOffset));
+                                    break;
+                                }
+
+                                case Opcode::Divide:
+                                case Opcode::Modulo:
+                                {
+                                    auto const top = pop();
+                                    auto const second = pop();
+                                    if (_values[second].kind == ValueKind::Constant && _values[second].operand != 0)
+                                    {
+                                        stack.push_back(Operation(opcode, top, second, sourceOffset));
+                                    }
+                                    else
+                                    {
+                                        summary.events.push_back({ opcode, 0, top, second, sourceOffset });
+                                        stack.push_back(Intern(ValueKind::Checked, opcode, summary.events.size(), top, second, sourceOffset));
+                                    }
+                                    break;
+                                }
+
+                                default:
+                                    if (IsUnary(opcode))
+                                    {
+                                        stack.push_back(Operation(opcode, pop(), NoValue, sourceOffset));
+                                    }
+                                    else if (GetStackEffect(opcode).required == 2 && GetStackEffect(opcode).change == -1)
+                                    {
+                                        auto const top = pop();
+                                        auto const second = pop();
+                                        stack.push_back(Operation(opcode, top, second, sourceOffset));
+                                    }
+                                    else
+                                    {
+                                        return false;
+                                    }
+                                    break;
+                            }
+
+                            summary.peak = std::max(summary.peak, static_cast<long>(stack.size()) - static_cast<long>(consumed));
+                        }
+
+                        for (auto& store : summary.stores)
+                        {
+                            store.second = memory[store.first];
+                        }
+                        summary.exit = std::move(stack);
+                        summary.consumed = consumed;
+                        return true;
+                    }
+
+                    /// Gets a value indicating whether or not a lowered region behaves exactly like the original.
+                    bool IsEquivalent(Summary const& original, Summary const& lowered)
+                    {
+                        if (lowered.consumed != original.consumed
+                            || lowered.events != original.events
+                            || lowered.exit != original.exit)
+                        {
+                            return false;
+                        }
+
+                        // Only slots which are loaded somewhere matter. Storing a value a slot already has changes nothing.
+                        auto const finalValues = [&](Summary const& summary)
+                        {
+                            std::vector<std::pair<Word, ValueId>> values{};
+                            for (auto const& store : summary.stores)
+                            {
+                                if (store.first < _isLoaded.size() && _isLoaded[store.first]
+                                    && store.second != Intern(ValueKind::Memory, Opcode::Load, store.first, NoValue, NoValue, 0))
+                                {
+                                    values.push_back(store);
+                                }
+                            }
+                            std::sort(values.begin(), values.end());
+                            return values;
+                        };
+                        return finalValues(original) == finalValues(lowered);
+                    }
+
+                    /// Emits instructions which produce the values of a summary.
+                    /// @param summary The summary.
+                    /// @param spill Whether to keep entry words, inputs and checked results in temporary memory slots,
+                    /// rather than using them where they are on the stack.
+                    /// @param storesFirst Whether to store to memory before leaving the results on the stack, rather than after.
+                    /// @param defaultOffset The source offset of instructions which only move words.
+                    /// @param region Receives the instructions.
+                    /// @returns Whether or not the instructions could be emitted.
+                    bool Emit(Summary const& summary, bool const spill, bool const storesFirst, std::size_t const defaultOffset, Region& region)
+                    {
+                        std::vector<Slot> stack{};
+                        std::unordered_map<ValueId, std::size_t> uses{};
+                        std::unordered_map<ValueId, Word> temporaries{};
+
+                        auto const emit = [&](Opcode const opcode, Word const operand, std::size_t const sourceOffset)
+                        {
+                            region.instructions.push_back({ opcode, operand });
+                            region.sourceOffsets.push_back(sourceOffset);
+                        };
+
+                        // Each use of a value which is not an operation consumes one copy of it from the stack.
+                        std::function<void(ValueId)> count = [&](ValueId const value)
+                        {
+                            auto const& v = _values[value];
+                            if (v.kind == ValueKind::Operation)
+                            {
+                                count(v.top);
+                                if (v.second != NoValue)
+                                {
+                                    count(v.second);
+                                }
+                                return;
+                            }
+                            ++uses[value];
+                        };
+                        for (auto const& event : summary.events)
+                        {
+                            for (auto const operand : { event.top, event.second })
+                            {
+                                if (operand != NoValue)
+                                {
+                                    count(operand);
+                                }
+                            }
+                        }
+                        for (auto const value : summary.exit)
+                        {
+                            count(value);
+                        }
+                        for (auto const& store : summary.stores)
+                        {
+                            count(store.second);
+                        }
+
+                        // Words left by events are either kept on the stack, or moved to a temporary slot when spilling.
+                        auto const settle = [&](ValueId const value, std::size_t const sourceOffset)
+                        {
+                            if (!spill)
+                            {
+                                stack.push_back({ value, true });
+                            }
+                            else if (uses[value] == 0 || _values[value].kind == ValueKind::Memory)
+                            {
+                                emit(Opcode::Pop, 0, sourceOffset);
+                            }
+                            else
+                            {
+                                auto const slot = Temporary(temporaries.size());
+                                temporaries.emplace(value, slot);
+                                emit(Opcode::Store, slot, sourceOffset);
+                            }
+                        };
+                        auto const cleanUp = [&]()
+                        {
+                            while (!stack.empty() && stack.back().settled && uses[stack.back().value] == 0)
+                            {
+                                emit(Opcode::Pop, 0, defaultOffset);
+                                stack.pop_back();
+                            }
+                        };
+
+                        std::function<bool(ValueId)> take = [&](ValueId const value) -> bool
+                        {
+                            auto const& v = _values[value];
+                            if (v.kind == ValueKind::Operation)
+                            {
+                                auto const settledAt = [&](std::size_t const depth, ValueId const expected)
+                                {
+                                    return stack.size() >= depth
+                                        && stack[stack.size() - depth].settled
+                                        && stack[stack.size() - depth].value == expected
+                                        && uses[expected] == 1;
+                                };
+
+                                if (v.second == NoValue)
+                                {
+                                    if (!take(v.top))
+                                    {
+                                        return false;
+                                    }
+                                    stack.pop_back();
+                                }
+                                else if (v.top != v.second && settledAt(1, v.top) && settledAt(2, v.second))
+                                {
+                                    uses[v.top] = uses[v.second] = 0;
+                                    stack.resize(stack.size() - 2);
+                                }
+                                else if (v.top != v.second && settledAt(1, v.second) && settledAt(2, v.top))
+                                {
+                                    uses[v.top] = uses[v.second] = 0;
+                                    stack.resize(stack.size() - 2);
+                                    if (!IsCommutative(v.opcode))
+                                    {
+                                        emit(Opcode::Swap, 0, v.sourceOffset);
+                                    }
+                                }
+                                else if (settledAt(1, v.top))
+                                {
+                                    // Use the top where it is, and swap the second above it unless the order does not matter.
+                                    uses[v.top] = 0;
+                                    stack.back().settled = false;
+                                    if (!take(v.second))
+                                    {
+                                        return false;
+                                    }
+                                    if (!IsCommutative(v.opcode))
+                                    {
+                                        emit(Opcode::Swap, 0, v.sourceOffset);
+                                    }
+                                    stack.resize(stack.size() - 2);
+                                }
+                                else
+                                {
+                                    if (!take(v.second) || !take(v.top))
+                                    {
+                                        return false;
+                                    }
+                                    stack.resize(stack.size() - 2);
+                                }
+                                emit(v.opcode, 0, v.sourceOffset);
+                                stack.push_back({ value, false });
+                                return true;
+                            }
+
+                            cleanUp();
+                            if (!stack.empty() && stack.back().settled && stack.back().value == value)
+                            {
+                                if (--uses[value] == 0)
+                                {
+                                    stack.back().settled = false;
+                                }
+                                else
+                                {
+                                    emit(Opcode::Duplicate, 0, v.sourceOffset);
+                                    stack.push_back({ value, false });
+                                }
+                                return true;
+                            }
+
+                            --uses[value];
+                            if (stack.size() >= 2 && stack[stack.size() - 2].settled && stack[stack.size() - 2].value == value)
+                            {
+                                emit(Opcode::Over, 0, v.sourceOffset);
+                            }
+                            else if (v.kind == ValueKind::Constant)
+                            {
+                                emit(Opcode::Push, v.operand, v.sourceOffset);
+                            }
+                            else if (v.kind == ValueKind::Memory)
+                            {
+                                emit(Opcode::Load, v.operand, v.sourceOffset);
+                            }
+                            else if (temporaries.find(value) != temporaries.end())
+                            {
+                                emit(Opcode::Load, temporaries[value], v.sourceOffset);
+                            }
+                            else
+                            {
+                                return false;
+                            }
+                            stack.push_back({ value, false });
+                            return true;
+                        };
+
+                        for (std::size_t depth = summary.consumed; depth > 0; --depth)
+                        {
+                            stack.insert(stack.begin(), { Intern(ValueKind::Entry, Opcode::Push, summary.consumed - depth, NoValue, NoValue, defaultOffset), true });
+                        }
+                        if (spill)
+                        {
+                            auto entries = std::move(stack);
+                            stack.clear();
+                            while (!entries.empty())
+                            {
+                                settle(entries.back().value, defaultOffset);
+                                entries.pop_back();
+                            }
+                        }
+
+                        for (auto const& event : summary.events)
+                        {
+                            switch (event.opcode)
+                            {
+                                case Opcode::Load:
+                                    cleanUp();
+                                    emit(Opcode::Load, event.operand, event.sourceOffset);
+                                    settle(Intern(ValueKind::Memory, Opcode::Load, event.operand, NoValue, NoValue, 0), event.sourceOffset);
+                                    break;
+
+                                case Opcode::Input:
+                                    cleanUp();
+                                    emit(Opcode::Input, 0, event.sourceOffset);
+                                    settle(Intern(ValueKind::Input, Opcode::Input, &event - summary.events.data() + 1, NoValue, NoValue, 0), event.sourceOffset);
+                                    break;
+
+                                case Opcode::OutputCharacter:
+                                case Opcode::OutputLiteral:
+                                    if (!take(event.top))
+                                    {
+                                        return false;
+                                    }
+                                    emit(event.opcode, 0, event.sourceOffset);
+                                    stack.pop_back();
+                                    break;
+
+                                default:
+                                {
+                                    // A checked division is lowered like an operation, but its result is settled.
+                                    auto const value = Intern(ValueKind::Checked, event.opcode, &event - summary.events.data() + 1, event.top, event.second, 0);
+                                    if (!take(event.second) || !take(event.top))
+                                    {
+                                        return false;
+                                    }
+                                    stack.resize(stack.size() - 2);
+                                    emit(event.opcode, 0, event.sourceOffset);
+                                    settle(value, event.sourceOffset);
+                                    break;
+                                }
+                            }
+                        }
+
+                        // Stores come after every event, so a memory slot holds its entry value until then.
+                        // If one is loaded to compute another store or a result, every value is pushed before any store.
+                        auto sequential = true;
+                        std::function<bool(ValueId, Word)> reads = [&](ValueId const value, Word const slot) -> bool
+                        {
+                            auto const& v = _values[value];
+                            return (v.kind == ValueKind::Memory && v.operand == slot)
+                                || (v.kind == ValueKind::Operation && (reads(v.top, slot) || (v.second != NoValue && reads(v.second, slot))));
+                        };
+                        for (std::size_t first = 0; first < summary.stores.size(); ++first)
+                        {
+                            for (auto later = first + 1; later < summary.stores.size(); ++later)
+                            {
+                                sequential = sequential && !reads(summary.stores[later].second, summary.stores[first].first);
+                            }
+                            for (auto const value : summary.exit)
+                            {
+                                sequential = sequential && !(storesFirst && reads(value, summary.stores[first].first));
+                            }
+                        }
+                        auto const leaveResults = [&]()
+                        {
+                            return std::all_of(summary.exit.begin(), summary.exit.end(), take);
+                        };
+                        auto const storeAll = [&]()
+                        {
+                            for (auto const& store : summary.stores)
+                            {
+                                if (!take(store.second))
+                                {
+                                    return false;
+                                }
+                                if (sequential)
+                                {
+                                    emit(Opcode::Store, store.first, _values[store.second].sourceOffset);
+                                    stack.pop_back();
+                                }
+                            }
+                            for (auto store = summary.stores.rbegin(); !sequential && store != summary.stores.rend(); ++store)
+                            {
+                                emit(Opcode::Store, store->first, _values[store->second].sourceOffset);
+                                stack.pop_back();
+                            }
+                            return true;
+                        };
+
+                        cleanUp();
+                        if (storesFirst ? !storeAll() || !leaveResults() : !leaveResults() || !storeAll())
+                        {
+                            return false;
+                        }
+                        return std::none_of(stack.begin(), stack.end(), [](Slot const& slot) { return slot.settled; });
+                    }
+
+                    /// Gets the memory slot of a temporary, adding it to the program if it is new.
+                    /// Names cannot contain `}`, so these never clash with the program's own slots.
+                    Word Temporary(std::size_t const index)
+                    {
+                        while (_temporaries.size() <= index)
+                        {
+                            _temporaries.push_back(_program.variables.size());
+                            _program.variables.push_back("{temporary " + std::to_string(_temporaries.size() - 1) + "}");
+                        }
+                        return _temporaries[index];
+                    }
+
+                    CompiledProgram& _program;
+                    std::vector<bool> const& _isLoaded;
+                    std::vector<Value> _values{};
+                    std::map<std::tuple<ValueKind, Opcode, Word, ValueId, ValueId>, ValueId> _ids{};
+                    std::vector<Word> _temporaries{};
+            };
+    };
+
+    /// The optimization level used when none is given.
+    constexpr int DefaultOptimizationLevel = 3;
+
+    /// The highest optimization level. Each level adds passes to the one below it.
+    constexpr int MaxOptimizationLevel = 3;
+
+    /// Rewrites compiled programs into equivalent programs which execute fewer instructions.
+    class PancakeOptimizer final
+    {
+        public:
+            /// The most instructions a subroutine can have, not counting its return, to be inlined at its call sites.
+            static constexpr std::size_t InlineLimit = 16;
+
+            /// Optimizes a compiled program in place.
+            /// Level 0 leaves the program unchanged. Level 1 inlines small subroutines and fuses common instruction
+            /// sequences into superinstructions. Level 2 also removes stack depth checks which can never fail.
+            /// Level 3 also rewrites straight-line regions through SSA form and removes unreachable instructions.
+            /// @param program The program to optimize.
+            /// @param level The optimization level.
+            /// @param stackCapacity The maximum number of words on the operand stack the program will run with.
+            /// Level 3 relies on it to keep PANics from a full stack where they were.
+            /// @param returnStackCapacity The maximum number of nested subroutine calls the program will run with.
+            /// Inlining relies on it to keep PANics from a full return stack where they were.
+            static void Optimize(CompiledProgram& program, int const level, std::size_t const stackCapacity = DefaultStackCapacity,
+                std::size_t const returnStackCapacity = DefaultReturnStackCapacity)
+            {
+                if (level >= 1)
+                {
+                    InlineSubroutines(program, returnStackCapacity);
+                }
+
+                if (level >= 3)
+                {
+                    SsaRewriter::Rewrite(program, stackCapacity);
+                }
+
+                if (level >= 1)
+                {
+                    FuseSuperinstructions(program);
+                }
+
+                if (level >= 2)
+                {
+                    RemoveStackChecks(program);
+                }
+            }
+
+        private:
+            static void InlineSubroutines(CompiledProgram& program, std::size_t const returnStackCapacity)
+            {
+                // A subroutine is inlined if it is a short run of instructions ending in a return which nothing
+                // jumps into the middle of, and which cannot call, jump, terminate or reach a PANic handler.
+                // An inlined call pushes no return address, so it cannot raise a ReturnStackOverflow PANic.
+                // Only calls which are known never to find the return stack full are inlined, as the difference could be seen.
+
+                auto const& instructions = program.instructions;
+                auto const count = instructions.size();
+                auto const callDepths = FindCallDepths(program, returnStackCapacity);
+
+                std::vector<bool> isTarget(count, false);
+                for (auto const& instruction : instructions)
+                {
+                    if (IsJump(instruction.opcode))
+                    {
+                        isTarget[instruction.operand] = true;
+                    }
+                }
+                for (auto const* addresses : { &program.panicHandlers, &program.builtInPanicHandlers, &program.labelAddresses })
+                {
+                    for (auto const address : *addresses)
+                    {
+                        if (address != NoPanicHandler)
+                        {
+                            isTarget[address] = true;
+                        }
+                    }
+                }
+
+                // The return ending each inlinable subroutine, by the address of its first instruction.
+                std::unordered_map<InstructionPointer, InstructionPointer> returns{};
+                for (auto const& instruction : instructions)
+                {
+                    if (instruction.opcode != Opcode::Call || returns.count(instruction.operand) != 0)
+                    {
+                        continue;
+                    }
+
+                    auto const entry = static_cast<InstructionPointer>(instruction.operand);
+                    for (auto address = entry; address < count && address - entry <= InlineLimit; ++address)
+                    {
+                        auto const opcode = instructions[address].opcode;
+                        if (opcode == Opcode::Return)
+                        {
+                            returns[entry] = address;
+                            break;
+                        }
+
+                        auto handled = false;
+                        ForEachBuiltInPanicHandler(program, address, [&](InstructionPointer) { handled = true; });
+                        if ((address != entry && isTarget[address]) || handled || IsJump(opcode)
+                            || opcode == Opcode::Terminate || opcode == Opcode::Panic || opcode == Opcode::Unrecognised)
+                        {
+                            break;
+                        }
+                    }
+                }
+                if (returns.empty())
+                {
+                    return;
+                }
+
+                std::vector<Instruction> inlined{};
+                std::vector<std::size_t> inlinedSourceOffsets{};
+                std::vector<InstructionPointer> newAddresses(count);
+                for (InstructionPointer address = 0; address < count; ++address)
+                {
+                    newAddresses[address] = inlined.size();
+                    auto const& instruction = instructions[address];
+                    auto const found = instruction.opcode == Opcode::Call && callDepths[address] < returnStackCapacity
+                        ? returns.find(instruction.operand) : returns.end();
+                    if (found != returns.end())
+                    {
+                        inlined.insert(inlined.end(), instructions.begin() + found->first, instructions.begin() + found->second);
+                        inlinedSourceOffsets.insert(inlinedSourceOffsets.end(),
+                            program.sourceOffsets.begin() + found->first, program.sourceOffsets.begin() + found->second);
+                    }
+                    else
+                    {
+                        inlined.push_back(instruction);
+                        inlinedSourceOffsets.push_back(program.sourceOffsets[address]);
+                    }
+                }
+
+                // Inlined bodies hold no jumps, so only the original jumps need their targets moved.
+                for (auto& instruction : inlined)
+                {
+                    if (IsJump(instruction.opcode))
+                    {
+                        instruction.operand = newAddresses[instruction.operand];
+                    }
+                }
+                for (auto* handlers : { &program.panicHandlers, &program.builtInPanicHandlers })
+                {
+                    for (auto& handlerAddress : *handlers)
+                    {
+                        if (handlerAddress != NoPanicHandler)
+                        {
+                            handlerAddress = newAddresses[handlerAddress];
+                        }
+                    }
+                }
+                for (auto& labelAddress : program.labelAddresses)
+                {
+                    labelAddress = newAddresses[labelAddress];
+                }
+
+                program.instructions = std::move(inlined);
+                program.sourceOffsets = std::move(inlinedSourceOffsets);
+            }
+
+            static std::vector<std::size_t> FindCallDepths(CompiledProgram const& program, std::size_t const limit)
+            {
+                // The most return addresses there can be on the return stack before each instruction, up to the limit.
+                // The program and each subroutine are walked on their own, stepping over calls and stopping at returns,
+                // and each subroutine is as deep as the deepest code which calls it, plus one. A recursive subroutine
+                // therefore reaches the limit. Code no walk reaches is never run, and is left at zero.
+
+                auto const& instructions = program.instructions;
+                std::vector<InstructionPointer> entries{ 0 };
+                std::unordered_map<InstructionPointer, std::size_t> entryIndices{ { 0, 0 } };
+                for (auto const& instruction : instructions)
+                {
+                    if (instruction.opcode == Opcode::Call && entryIndices.emplace(instruction.operand, entries.size()).second)
+                    {
+                        entries.push_back(static_cast<InstructionPointer>(instruction.operand));
+                    }
+                }
+
+                std::vector<std::vector<InstructionPointer>> bodies(entries.size());
+                for (std::size_t index = 0; index < entries.size(); ++index)
+                {
+                    std::vector<bool> visited(instructions.size(), false);
+                    std::vector<InstructionPointer> pending{ entries[index] };
+                    visited[entries[index]] = true;
+                    auto const visit = [&](InstructionPointer const address)
+                    {
+                        if (!visited[address])
+                        {
+                            visited[address] = true;
+                            pending.push_back(address);
+                        }
+                    };
+                    while (!pending.empty())
+                    {
+                        auto const address = pending.back();
+                        pending.pop_back();
+                        bodies[index].push_back(address);
+
+                        auto const opcode = instructions[address].opcode;
+                        if (opcode == Opcode::Call)
+                        {
+                            visit(address + 1);
+                        }
+                        else if (opcode != Opcode::Return)
+                        {
+                            ForEachSuccessor(program, address, visit);
+                        }
+                        ForEachBuiltInPanicHandler(program, address, visit);
+                    }
+                }
+
+                // Depths only rise, and a subroutine deeper than there are subroutines is reached through a cycle of
+                // calls, so capping them there reaches a fixed point without walking every level of the recursion.
+                auto const cap = std::min(limit, entries.size());
+                std::vector<std::size_t> entryDepths(entries.size(), 0);
+                std::vector<bool> called(entries.size(), false);
+                called[0] = true;
+                for (auto changed = true; changed;)
+                {
+                    changed = false;
+                    for (std::size_t index = 0; index < entries.size(); ++index)
+                    {
+                        if (!called[index])
+                        {
+                            continue;
+                        }
+
+                        auto const depth = std::min(entryDepths[index] + 1, cap);
+                        for (auto const address : bodies[index])
+                        {
+                            if (instructions[address].opcode != Opcode::Call)
+                            {
+                                continue;
+                            }
+
+                            auto const callee = entryIndices[static_cast<InstructionPointer>(instructions[address].operand)];
+                            if (!called[callee] || entryDepths[callee] < depth)
+                            {
+                                called[callee] = true;
+                                entryDepths[callee] = std::max(entryDepths[callee], depth);
+                                changed = true;
+                            }
+                        }
+                    }
+                }
+
+                std::vector<std::size_t> depths(instructions.size(), 0);
+                for (std::size_t index = 0; index < entries.size(); ++index)
+                {
+                    if (called[index])
+                    {
+                        auto const depth = entryDepths[index] == cap ? limit : entryDepths[index];
+                        for (auto const address : bodies[index])
+                        {
+                            depths[address] = std::max(depths[address], depth);
+                        }
+                    }
+                }
+                return depths;
+            }
+
+            static void RemoveStackChecks(CompiledProgram& program)
+            {
+                auto const analysis = StackDepthAnalysis(program);
+                for (InstructionPointer address = 0; address < program.instructions.size(); ++address)
+                {
+                    auto& instruction = program.instructions[address];
+                    auto const required = GetStackEffect(instruction.opcode).required;
+                    if (analysis.IsReachable(address) && analysis.GetMinimumDepth(address) >= required)
+                    {
+                        instruction.checkStack = false;
+                    }
+                }
+            }
+
+            static void FuseSuperinstructions(CompiledProgram& program)
+            {
+                // A sequence can only be fused if nothing jumps into the middle of it, and no label is in the
+                // middle of it, so that breakpoints and traced spans still start exactly where their label is.
+
+                auto const& instructions = program.instructions;
+                auto const count = instructions.size();
+                std::vector<bool> isJumpTarget(count, false);
+                for (auto const& instruction : instructions)
+                {
+                    if (IsJump(instruction.opcode))
+                    {
+                        isJumpTarget[instruction.operand] = true;
+                    }
+                }
+                for (auto const* addresses : { &program.panicHandlers, &program.builtInPanicHandlers, &program.labelAddresses })
+                {
+                    for (auto const address : *addresses)
+                    {
+                        if (address != NoPanicHandler)
+                        {
+                            isJumpTarget[address] = true;
+                        }
+                    }
+                }
+
+                std::vector<Instruction> fused{};
+                std::vector<std::size_t> fusedSourceOffsets{};
+                std::vector<InstructionPointer> newAddresses(count);
+                std::size_t index = 0;
+                while (index < count)
+                {
+                    auto const matches = [&](std::size_t const offset, Opcode const opcode)
+                    {
+                        return index + offset < count
+                            && !isJumpTarget[index + offset]
+                            && instructions[index + offset].opcode == opcode;
+                    };
+
+                    auto const& first = instructions[index];
+                    auto replacement = first;
+                    std::size_t length = 1;
+
+                    if (matches(0, Opcode::Push) && matches(1, Opcode::OutputCharacter))
+                    {
+                        std::string text{};
+                        while (matches(length - 1, Opcode::Push) && matches(length, Opcode::OutputCharacter))
+                        {
+                            text += static_cast<char>(instructions[index + length - 1].operand);
+                            length += 2;
+                        }
+                        --length;
+                        replacement = { Opcode::OutputString, program.strings.size() };
+                        program.strings.push_back(std::move(text));
+                    }
+                    else if (matches(0, Opcode::Push) && matches(1, Opcode::Add))
+                    {
+                        replacement = { Opcode::AddImmediate, first.operand };
+                        length = 2;
+                    }
+                    else if (matches(0, Opcode::Push) && matches(1, Opcode::Multiply))
+                    {
+                        replacement = { Opcode::MultiplyImmediate, first.operand };
+                        length = 2;
+                    }
+                    else if (matches(0, Opcode::Push) && matches(1, Opcode::Modulo))
+                    {
+                        replacement = { Opcode::ModuloImmediate, first.operand };
+                        length = 2;
+                    }
+                    else if (matches(0, Opcode::Load)
+                        && (matches(1, Opcode::Increment) || matches(1, Opcode::Decrement))
+                        && matches(2, Opcode::Store)
+                        && instructions[index + 2].operand == first.operand)
+                    {
+                        auto const increment = instructions[index + 1].opcode == Opcode::Increment;
+                        replacement = { increment ? Opcode::IncrementVariable : Opcode::DecrementVariable, first.operand };
+                        length = 3;
+                    }
+                    else if ((matches(0, Opcode::Increment) || matches(0, Opcode::Decrement))
+                        && (matches(1, Opcode::Increment) || matches(1, Opcode::Decrement)))
+                    {
+                        Word delta = 0;
+                        length = 0;
+                        while (matches(length, Opcode::Increment) || matches(length, Opcode::Decrement))
+                        {
+                            delta += instructions[index + length].opcode == Opcode::Increment ? 1 : -1;
+                            ++length;
+                        }
+                        replacement = { Opcode::IncrementBy, delta };
+                    }
+                    else if (matches(0, Opcode::Duplicate) && matches(1, Opcode::JumpIfZero))
+                    {
+                        replacement = { Opcode::DuplicateJumpIfZero, instructions[index + 1].operand };
+                        length = 2;
+                    }
+                    else if (matches(0, Opcode::Swap) && matches(1, Opcode::Pop))
+                    {
+                        replacement = { Opcode::Nip, 0 };
+                        length = 2;
+                    }
+
+                    for (std::size_t offset = 0; offset < length; ++offset)
+                    {
+                        newAddresses[index + offset] = fused.size();
+                    }
+                    fused.push_back(replacement);
+                    fusedSourceOffsets.push_back(program.sourceOffsets[index]);
+                    index += length;
+                }
+
+                for (auto& instruction : fused)
+                {
+                    if (IsJump(instruction.opcode))
+                    {
+                        instruction.operand = newAddresses[instruction.operand];
+                    }
+                }
+                for (auto* handlers : { &program.panicHandlers, &program.builtInPanicHandlers })
+                {
+                    for (auto& handlerAddress : *handlers)
+                    {
+                        if (handlerAddress != NoPanicHandler)
+                        {
+                            handlerAddress = newAddresses[handlerAddress];
+                        }
+                    }
+                }
+
+                // Labels are never fused into the instruction before them, so they only move as earlier instructions are fused.
+                for (auto& labelAddress : program.labelAddresses)
+                {
+                    labelAddress = newAddresses[labelAddress];
+                }
+
+                program.instructions = std::move(fused);
+                program.sourceOffsets = std::move(fusedSourceOffsets);
+            }
+    };
+
+    /// Translates compiled programs into standalone C translation units.
+    /// Building the output with a C99 compiler gives a native program which behaves like the interpreter.
+    class PancakeCEmitter final
+    {
+        public:
+            /// Writes a C translation unit which runs a program.
+            /// @param program The program.
+            /// @param stackCapacity The maximum number of words on the operand stack.
+            /// @param returnStackCapacity The maximum number of nested subroutine calls.
+            /// @param heapSize The number of words in the heap.
+            /// @param output The stream to write the translation unit to.
+            static void Emit(CompiledProgram const& program, std::size_t const stackCapacity, std::size_t const returnStackCapacity,
+                std::size_t const heapSize, std::ostream& output)
+            {
+                auto const& instructions = program.instructions;
+
+                // Only jump and handler targets need labels, so that C compilers do not warn about the rest.
+                std::vector<bool> targets(instructions.size(), false);
+                std::vector<bool> raised(program.names.size(), false);
+                auto usesInput = false;
+                auto usesReverse = false;
+                auto usesHeap = false;
+                auto usesCalls = false;
+                auto returns = false;
+                for (auto const& instruction : instructions)
+                {
+                    usesInput = usesInput || instruction.opcode == Opcode::Input;
+                    usesReverse = usesReverse || instruction.opcode == Opcode::Reverse;
+                    usesHeap = usesHeap || IsHeapAccess(instruction.opcode);
+                    usesCalls = usesCalls || instruction.opcode == Opcode::Call || instruction.opcode == Opcode::Return;
+                    returns = returns || instruction.opcode == Opcode::Return;
+                    for (std::size_t type = 0; type < PanicTypeCount; ++type)
+                    {
+                        auto const handlerAddress = program.builtInPanicHandlers[type];
+                        if (handlerAddress != NoPanicHandler && CanRaise(instruction, static_cast<PanicType>(type)))
+                        {
+                            targets[handlerAddress] = true;
+                        }
+                    }
+
+                    if (IsJump(instruction.opcode))
+                    {
+                        targets[instruction.operand] = true;
+                    }
+                    else if (instruction.opcode == Opcode::Panic)
+                    {
+                        raised[instruction.operand] = true;
+                        auto const handlerAddress = program.panicHandlers[instruction.operand];
+                        if (handlerAddress != NoPanicHandler)
+                        {
+                            targets[handlerAddress] = true;
+                        }
+                    }
+                }
+
+                // Returns are dispatched through one switch to the instruction after each call.
+                std::vector<InstructionPointer> returnSites{};
+                if (returns)
+                {
+                    for (InstructionPointer address = 0; address + 1 < instructions.size(); ++address)
+                    {
+                        if (instructions[address].opcode == Opcode::Call)
+                        {
+                            returnSites.push_back(address + 1);
+                            targets[address + 1] = true;
+                        }
+                    }
+                }
+
+                std::ostringstream body;
+                for (InstructionPointer address = 0; address < instructions.size(); ++address)
+                {
+                    if (targets[address])
+                    {
+                        body << "L" << address << ":\n";
+                    }
+                    EmitInstruction(program, instructions[address], address, body);
+                }
+
+                if (returns)
+                {
+                    body << "pancake_return:\n"
+                         << "    switch (returns[--calls])\n"
+                         << "    {\n";
+                    for (auto const site : returnSites)
+                    {
+                        body << "        case " << site << ": goto L" << site << ";\n";
+                    }
+                    body << "    }\n"
+                         << "    return 0;\n";
+                }
+
+                auto const raisesPanics = std::find(raised.begin(), raised.end(), true) != raised.end();
+                if (raisesPanics)
+                {
+                    // Every PANic is dispatched through one switch to its handler, or reported.
+                    body << "pancake_dispatch_panic:\n"
+                         << "    switch (panic)\n"
+                         << "    {\n";
+                    for (std::size_t name = 0; name < raised.size(); ++name)
+                    {
+                        if (!raised[name])
+                        {
+                            continue;
+                        }
+
+                        body << "        case " << name << ": ";
+                        auto const handlerAddress = program.panicHandlers[name];
+                        if (handlerAddress == NoPanicHandler)
+                        {
+                            body << "pancake_panic(" << Quote(program.names[name]) << ");\n";
+                        }
+                        else
+                        {
+                            body << "goto L" << handlerAddress << ";\n";
+                        }
+                    }
+                    body << "    }\n"
+                         << "    return 0;\n";
+                }
+
+                output << "/* Generated by Pancake " << PANCAKE_VERSION << ". */\n"
+                       << Prelude
+                       << "\n"
+                       << "#define PANCAKE_STACK_CAPACITY " << stackCapacity << "u\n"
+                       << "\n"
+                       << "static uint64_t stack[PANCAKE_STACK_CAPACITY + 1];\n";
+                if (usesHeap)
+                {
+                    // Zero sized arrays are not C, so an empty heap still has one word which is never accessed.
+                    output << "\n"
+                           << "#define PANCAKE_HEAP_SIZE " << heapSize << "u\n"
+                           << "\n"
+                           << "static uint64_t heap[PANCAKE_HEAP_SIZE + 1];\n";
+                }
+                if (usesCalls)
+                {
+                    output << "\n"
+                           << "#define PANCAKE_RETURN_STACK_CAPACITY " << returnStackCapacity << "u\n"
+                           << "\n"
+                           << "static size_t returns[PANCAKE_RETURN_STACK_CAPACITY];\n";
+                }
+                output << Runtime
+                       << "\n";
+                for (auto const& raise : RaiseMacros)
+                {
+                    // A built-in PANic with a handler is a jump to it, and any other is reported.
+                    auto const handlerAddress = program.builtInPanicHandlers[static_cast<std::size_t>(raise.type)];
+                    output << "#define " << raise.name << "(message) ";
+                    if (handlerAddress == NoPanicHandler)
+                    {
+                        output << "pancake_panic(message)\n";
+                    }
+                    else
+                    {
+                        output << "goto L" << handlerAddress << "\n";
+                    }
+                }
+                if (usesInput)
+                {
+                    output << InputFunction;
+                }
+                if (usesReverse)
+                {
+                    output << ReverseFunction;
+                }
+                output << "\n"
+                       << "int main(void)\n"
+                       << "{\n"
+                       << "    uint64_t top = 0;\n"
+                       << "    size_t size = 0;\n"
+                       << "    uint64_t value = 0;\n";
+                if (raisesPanics)
+                {
+                    output << "    size_t panic = 0;\n";
+                }
+                if (usesCalls)
+                {
+                    output << "    size_t calls = 0;\n";
+                }
+                for (std::size_t slot = 0; slot < program.variables.size(); ++slot)
+                {
+                    output << "    uint64_t m" << slot << " = 0;\n"
+                           << "    int d" << slot << " = 0;\n";
+                }
+                output << "\n"
+                       << "    (void)stack;\n"
+                       << "    (void)top;\n"
+                       << "    (void)value;\n"
+                       << "\n"
+                       << body.str()
+                       << "}\n";
+            }
+
+        private:
+            struct RaiseMacro
+            {
+                PanicType type;
+                char const* name;
+            };
+
+            static constexpr RaiseMacro RaiseMacros[] =
+            {
+                { PanicType::StackExhaustion, "PANCAKE_EXHAUSTED" },
+                { PanicType::StackOverflow, "PANCAKE_OVERFLOWED" },
+                { PanicType::UndefinedVariable, "PANCAKE_UNDEFINED" },
+                { PanicType::UnrecognisedOpcode, "PANCAKE_UNRECOGNISED" },
+                { PanicType::InvalidInput, "PANCAKE_INVALID_INPUT" },
+                { PanicType::EndOfInput, "PANCAKE_END_OF_INPUT" },
+                { PanicType::DivisionByZero, "PANCAKE_DIVIDED_BY_ZERO" },
+                { PanicType::HeapOutOfBounds, "PANCAKE_OUT_OF_BOUNDS" },
+                { PanicType::ReturnStackOverflow, "PANCAKE_CALLS_OVERFLOWED" },
+                { PanicType::ReturnStackExhaustion, "PANCAKE_CALLS_EXHAUSTED" }
+            };
+
+            static bool CanRaise(Instruction const& instruction, PanicType const type) noexcept
+            {
+                // Checks removed by the optimizer are not emitted, except for the fused pushes.
+                if (type == PanicType::StackExhaustion && !instruction.checkStack
+                    && instruction.opcode != Opcode::AddImmediate
+                    && instruction.opcode != Opcode::MultiplyImmediate
+                    && instruction.opcode != Opcode::ModuloImmediate)
+                {
+                    return false;
+                }
+                return Pancake::CanRaise(instruction.opcode, type);
+            }
+
+            static constexpr char const* Prelude =
+                "#include <ctype.h>\n"
+                "#include <inttypes.h>\n"
+                "#include <stdint.h>\n"
+                "#include <stdio.h>\n"
+                "#include <stdlib.h>\n"
+                "#include <string.h>\n";
+
+            static constexpr char const* Runtime =
+                "\n"
+                "static void pancake_panic(char const* message)\n"
+                "{\n"
+                "    fflush(stdout);\n"
+                "    fprintf(stderr, \"Pancake runtime error: %s\\n\", message);\n"
+                "    exit(0);\n"
+                "}\n"
+                "\n"
+                "#define PANCAKE_UNARY() if (size == 0) PANCAKE_EXHAUSTED(\"Attempted to perform unary operation on empty stack.\")\n"
+                "#define PANCAKE_BINARY() if (size < 2) PANCAKE_EXHAUSTED(\"Attempted to perform binary operation with fewer than 2 values on the stack.\")\n"
+                "#define PANCAKE_FULL() if (size == PANCAKE_STACK_CAPACITY) PANCAKE_OVERFLOWED(\"Attempted to push to a full stack.\")\n"
+                "#define PANCAKE_PUSH(word) do { value = (word); PANCAKE_FULL(); stack[size++] = top; top = value; } while (0)\n"
+                "#define PANCAKE_POP() do { value = top; top = stack[--size]; } while (0)\n"
+                "#define PANCAKE_SECOND stack[size - 1]\n"
+                "#define PANCAKE_THIRD stack[size - 2]\n"
+                "#define PANCAKE_TERNARY() if (size < 3) PANCAKE_EXHAUSTED(\"Attempted to perform ternary operation with fewer than 3 values on the stack.\")\n";
+
+            static constexpr char const* InputFunction =
+                "\n"
+                "static char const pancake_end_of_input[] = \"Reached the end of the input.\";\n"
+                "\n"
+                "static char const* pancake_input(uint64_t* result)\n"
+                "{\n"
+                "    uint64_t value = 0;\n"
+                "    int valid = 1;\n"
+                "    int c;\n"
+                "\n"
+                "    fflush(stdout);\n"
+                "    do\n"
+                "    {\n"
+                "        c = getchar();\n"
+                "    } while (c != EOF && isspace(c));\n"
+                "    if (c == EOF)\n"
+                "    {\n"
+                "        return pancake_end_of_input;\n"
+                "    }\n"
+                "\n"
+                "    for (; c != EOF && !isspace(c); c = getchar())\n"
+                "    {\n"
+                "        uint64_t const digit = (uint64_t)(c - '0');\n"
+                "        if (c < '0' || c > '9' || value > (UINT64_MAX - digit) / 10)\n"
+                "        {\n"
+                "            valid = 0;\n"
+                "            continue;\n"
+                "        }\n"
+                "        value = value * 10 + digit;\n"
+                "    }\n"
+                "\n"
+                "    if (!valid)\n"
+                "    {\n"
+                "        return \"Input was not a number which fits in a word.\";\n"
+                "    }\n"
+                "    *result = value;\n"
+                "    return NULL;\n"
+                "}\n";
+
+            static constexpr char const* ReverseFunction =
+                "\n"
+                "static uint64_t pancake_reverse(size_t size, uint64_t top)\n"
+                "{\n"
+                "    size_t front = 1;\n"
+                "    size_t back = size;\n"
+                "\n"
+                "    if (size < 2)\n"
+                "    {\n"
+                "        return top;\n"
+                "    }\n"
+                "\n"
+                "    stack[size] = top;\n"
+                "    for (; front < back; ++front, --back)\n"
+                "    {\n"
+                "        uint64_t const swapped = stack[front];\n"
+                "        stack[front] = stack[back];\n"
+                "        stack[back] = swapped;\n"
+                "    }\n"
+                "    return stack[size];\n"
+                "}\n";
+
+            static void EmitInstruction(CompiledProgram const& program, Instruction const& instruction, InstructionPointer const address, std::ostream& body)
+            {
+                auto const operand = instruction.operand;
+                auto const unary = instruction.checkStack ? "    PANCAKE_UNARY();\n" : "";
+                auto const binary = instruction.checkStack ? "    PANCAKE_BINARY();\n" : "";
+                auto const ternary = instruction.checkStack ? "    PANCAKE_TERNARY();\n" : "";
+                auto const outOfBounds = "PANCAKE_OUT_OF_BOUNDS(\"Attempted to access a word outside of the heap.\");";
+                auto const operation = [&](char const* expression)
+                {
+                    body << binary << "    PANCAKE_POP();\n    top = " << expression << ";\n";
+                };
+                auto const division = [&](char const* expression)
+                {
+                    body << binary << "    if (PANCAKE_SECOND == 0) PANCAKE_DIVIDED_BY_ZERO(\"Attempted to divide by zero.\");\n";
+                    operation(expression);
+                };
+                auto const verifyRead = [&]
+                {
+                    body << "    if (!d" << operand << ") PANCAKE_UNDEFINED("
+                         << Quote("No value stored with name '" + program.variables[operand] + "' could be found in memory.\n") << ");\n";
+                };
+                auto const verifyPushThenBinaryOperation = [&]
+                {
+                    // An empty stack is left holding the pushed value, as the two instructions would leave it.
+                    body << "    PANCAKE_FULL();\n"
+                         << "    if (size == 0)\n"
+                         << "    {\n"
+                         << "        stack[size++] = top;\n"
+                         << "        top = UINT64_C(" << operand << ");\n"
+                         << "        PANCAKE_EXHAUSTED(\"Attempted to perform binary operation with fewer than 2 values on the stack.\");\n"
+                         << "    }\n";
+                };
+
+                switch (instruction.opcode)
+                {
+                    case Opcode::Terminate: body << "    return 0;\n"; break;
+                    case Opcode::Push: body << "    PANCAKE_PUSH(UINT64_C(" << operand << "));\n"; break;
+                    case Opcode::Pop: body << unary << "    top = stack[--size];\n"; break;
+                    case Opcode::Duplicate: body << unary << "    PANCAKE_PUSH(top);\n"; break;
+                    case Opcode::Swap: body << binary << "    value = top;\n    top = PANCAKE_SECOND;\n    PANCAKE_SECOND = value;\n"; break;
+                    case Opcode::Reverse: body << "    top = pancake_reverse(size, top);\n"; break;
+                    case Opcode::Over: body << binary << "    PANCAKE_PUSH(PANCAKE_SECOND);\n"; break;
+                    case Opcode::Add: operation("value + top"); break;
+                    case Opcode::Subtract: operation("value - top"); break;
+                    case Opcode::Multiply: operation("value * top"); break;
+                    case Opcode::Divide: division("value / top"); break;
+                    case Opcode::Modulo: division("value % top"); break;
+                    case Opcode::Increment: body << unary << "    ++top;\n"; break;
+                    case Opcode::Decrement: body << unary << "    --top;\n"; break;
+                    case Opcode::LeftShift: operation("value << top"); break;
+                    case Opcode::RightShift: operation("value >> top"); break;
+                    case Opcode::BitwiseNot: body << unary << "    top = ~top;\n"; break;
+                    case Opcode::BitwiseAnd: operation("value & top"); break;
+                    case Opcode::BitwiseOr: operation("value | top"); break;
+                    case Opcode::BitwiseXor: operation("value ^ top"); break;
+                    case Opcode::Equal: operation("value == top"); break;
+                    case Opcode::Greater: operation("value > top"); break;
+                    case Opcode::Less: operation("value < top"); break;
+                    case Opcode::GreaterOrEqual: operation("value >= top"); break;
+                    case Opcode::LessOrEqual: operation("value <= top"); break;
+                    case Opcode::LogicalNot: body << unary << "    top = !top;\n"; break;
+                    case Opcode::LogicalAnd: operation("value && top"); break;
+                    case Opcode::LogicalOr: operation("value || top"); break;
+                    case Opcode::LogicalXor: operation("!value != !top"); break;
+                    case Opcode::OutputCharacter: body << unary << "    PANCAKE_POP();\n    putchar((unsigned char)value);\n"; break;
+                    case Opcode::OutputLiteral: body << unary << "    PANCAKE_POP();\n    printf(\"%\" PRIu64, value);\n"; break;
+                    case Opcode::Input:
+                        body << "    {\n"
+                             << "        char const* const message = pancake_input(&value);\n"
+                             << "        if (message == pancake_end_of_input) PANCAKE_END_OF_INPUT(message);\n"
+                             << "        if (message) PANCAKE_INVALID_INPUT(message);\n"
+                             << "    }\n"
+                             << "    PANCAKE_PUSH(value);\n";
+                        break;
+
+                    case Opcode::Panic: body << "    panic = " << operand << ";\n    goto pancake_dispatch_panic;\n"; break;
+                    case Opcode::Jump: body << "    goto L" << operand << ";\n"; break;
+                    case Opcode::JumpIfZero: body << unary << "    if (top == 0) goto L" << operand << ";\n"; break;
+                    case Opcode::JumpIfEqual: body << binary << "    if (top == PANCAKE_SECOND) goto L" << operand << ";\n"; break;
+                    case Opcode::Call:
+                        body << "    if (calls == PANCAKE_RETURN_STACK_CAPACITY) PANCAKE_CALLS_OVERFLOWED(\"Attempted to call a subroutine with a full return stack.\");\n"
+                             << "    returns[calls++] = " << address + 1 << ";\n"
+                             << "    goto L" << operand << ";\n";
+                        break;
+
+                    case Opcode::Return:
+                        body << "    if (calls == 0) PANCAKE_CALLS_EXHAUSTED(\"Attempted to return with no subroutine call to return from.\");\n"
+                             << "    goto pancake_return;\n";
+                        break;
+
+                    case Opcode::Store: body << unary << "    PANCAKE_POP();\n    m" << operand << " = value;\n    d" << operand << " = 1;\n"; break;
+
+                    case Opcode::Load:
+                        verifyRead();
+                        body << "    PANCAKE_PUSH(m" << operand << ");\n";
+                        break;
+
+                    case Opcode::AddImmediate:
+                        verifyPushThenBinaryOperation();
+                        body << "    top = UINT64_C(" << operand << ") + top;\n";
+                        break;
+
+                    case Opcode::MultiplyImmediate:
+                        verifyPushThenBinaryOperation();
+                        body << "    top = UINT64_C(" << operand << ") * top;\n";
+                        break;
+
+                    case Opcode::ModuloImmediate:
+                        verifyPushThenBinaryOperation();
+                        body << "    if (top == 0)\n"
+                             << "    {\n"
+                             << "        stack[size++] = top;\n"
+                             << "        top = UINT64_C(" << operand << ");\n"
+                             << "        PANCAKE_DIVIDED_BY_ZERO(\"Attempted to divide by zero.\");\n"
+                             << "    }\n"
+                             << "    top = UINT64_C(" << operand << ") % top;\n";
+                        break;
+
+                    case Opcode::IncrementBy: body << unary << "    top += UINT64_C(" << operand << ");\n"; break;
+
+                    case Opcode::HeapLoad:
+                        body << unary << "    if (top >= PANCAKE_HEAP_SIZE) " << outOfBounds << "\n"
+                             << "    top = heap[top];\n";
+                        break;
+
+                    case Opcode::HeapStore:
+                        body << binary << "    if (top >= PANCAKE_HEAP_SIZE) " << outOfBounds << "\n"
+                             << "    heap[top] = PANCAKE_SECOND;\n"
+                             << "    size -= 2;\n"
+                             << "    top = stack[size];\n";
+                        break;
+
+                    case Opcode::HeapFill:
+                        body << ternary
+                             << "    if (PANCAKE_SECOND > PANCAKE_HEAP_SIZE || top > PANCAKE_HEAP_SIZE - PANCAKE_SECOND) " << outOfBounds << "\n"
+                             << "    for (value = 0; value < PANCAKE_SECOND; ++value) heap[top + value] = PANCAKE_THIRD;\n"
+                             << "    size -= 3;\n"
+                             << "    top = stack[size];\n";
+                        break;
+
+                    case Opcode::HeapCopy:
+                        body << ternary
+                             << "    if (PANCAKE_THIRD > PANCAKE_HEAP_SIZE || top > PANCAKE_HEAP_SIZE - PANCAKE_THIRD\n"
+                             << "        || PANCAKE_SECOND > PANCAKE_HEAP_SIZE - PANCAKE_THIRD) " << outOfBounds << "\n"
+                             << "    memmove(heap + top, heap + PANCAKE_SECOND, (size_t)PANCAKE_THIRD * sizeof(uint64_t));\n"
+                             << "    size -= 3;\n"
+                             << "    top = stack[size];\n";
+                        break;
+
+                    case Opcode::IncrementVariable:
+                    case Opcode::DecrementVariable:
+                        verifyRead();
+                        body << "    PANCAKE_FULL();\n"
+                             << "    " << (instruction.opcode == Opcode::IncrementVariable ? "++" : "--") << "m" << operand << ";\n";
+                        break;
+
+                    case Opcode::DuplicateJumpIfZero:
+                        body << unary << "    PANCAKE_PUSH(top);\n    if (top == 0) goto L" << operand << ";\n";
+                        break;
+
+                    case Opcode::Nip: body << binary << "    --size;\n"; break;
+
+                    case Opcode::OutputString:
+                    {
+                        auto const& text = program.strings[operand];
+                        body << "    PANCAKE_FULL();\n"
+                             << "    fwrite(" << Quote(text) << ", 1, " << text.size() << ", stdout);\n";
+                        break;
+                    }
+
+                    case Opcode::Unrecognised:
+                        body << "    PANCAKE_UNRECOGNISED(" << Quote(std::string("Unrecognised opcode - '") + static_cast<char>(operand) + "'.\n") << ");\n";
+                        break;
+                }
+            }
+
+            static std::string Quote(std::string const& text)
+            {
+                // Octal escapes are always three digits, so they cannot run into the next character.
+                std::string quoted = "\"";
+                for (auto const c : text)
+                {
+                    auto const byte = static_cast<unsigned char>(c);
+                    if (c == '"' || c == '\\' || c == '?')
+                    {
+                        quoted += '\\';
+                        quoted += c;
+                    }
+                    else if (byte < 0x20 || byte >= 0x7F)
+                    {
+                        char escape[5];
+                        std::snprintf(escape, sizeof(escape), "\\%03o", byte);
+                        quoted += escape;
+                    }
+                    else
+                    {
+                        quoted += c;
+                    }
+                }
+                return quoted + "\"";
+            }
+    };
+
+    /// Reads and writes compiled programs in the `.pnckc` format, and snapshots of virtual machines in the `.pncks` format.
+    /// A file is a fixed header followed by sections of 64-bit words, located by offsets from the start
+    /// of the file, so it can be mapped anywhere in memory and read without parsing any source.
+    class PancakeBytecode final
+    {
+        public:
+            /// The version of the format. Files of any other version are rejected.
+            static constexpr uint32_t Version = 4;
+
+            /// Describes the source and options a compiled program came from.
+            struct Origin
+            {
+                /// The hash of the source, from HashSource.
+                uint64_t sourceHash;
+
+                /// The length of the source in bytes.
+                uint64_t sourceLength;
+
+                /// The optimization level the program was compiled with.
+                int optimizationLevel;
+
+                /// The capacity of the operand stack the program was compiled for.
+                std::size_t stackCapacity;
+
+                /// The capacity of the return stack the program was compiled for.
+                std::size_t returnStackCapacity;
+
+                /// Gets a value indicating whether or not the program was compiled for stacks of the given capacities.
+                /// Optimized programs rely on the capacities they were compiled for to PANic where they would have,
+                /// so a program is only run on a virtual machine with the same capacities.
+                /// @param stackCapacity The capacity of the operand stack.
+                /// @param returnStackCapacity The capacity of the return stack.
+                bool IsCompiledFor(std::size_t const stackCapacity, std::size_t const returnStackCapacity) const noexcept
+                {
+                    return this->stackCapacity == stackCapacity && this->returnStackCapacity == returnStackCapacity;
+                }
+            };
+
+            /// Hashes program source, to key compiled programs by the source they came from.
+            /// @param source The program source.
+            /// @returns The 64-bit FNV-1a hash of the source.
+            static uint64_t HashSource(std::string_view const source) noexcept
+            {
+                uint64_t hash = 0xCBF29CE484222325;
+                for (auto const character : source)
+                {
+                    hash = (hash ^ static_cast<unsigned char>(character)) * 0x100000001B3;
+                }
+                return hash;
+            }
+
+            /// Gets a value indicating whether or not data starts like a compiled program.
+            /// @param data The data.
+            static bool IsBytecode(std::string_view const data) noexcept
+            {
+                return data.size() >= sizeof(Magic) && std::memcmp(data.data(), Magic, sizeof(Magic)) == 0;
+            }
+
+            /// Writes a compiled program.
+            /// @param program The compiled program.
+            /// @param source The source the program was compiled from, which is hashed into the header.
+            /// @param optimizationLevel The optimization level the program was compiled with.
+            /// @param stackCapacity The capacity of the operand stack the program was compiled for.
+            /// @param returnStackCapacity The capacity of the return stack the program was compiled for.
+            /// @param output The stream to write to, which must be opened in binary mode.
+            static void Write(CompiledProgram const& program, std::string_view const source, int const optimizationLevel,
+                std::size_t const stackCapacity, std::size_t const returnStackCapacity, std::ostream& output)
+            {
+                std::vector<Word> words{};
+                std::string stringData{};
+                auto const append = [&](Word const word) { words.push_back(word); };
+
+                Header header{};
+                std::memcpy(header.magic, Magic, sizeof(Magic));
+                header.version = Version;
+                header.byteOrder = ByteOrder;
+                header.opcodeCount = static_cast<uint32_t>(OpcodeCount);
+                header.panicTypeCount = static_cast<uint32_t>(PanicTypeCount);
+                header.sourceHash = HashSource(source);
+                header.sourceLength = source.size();
+                header.optimizationLevel = static_cast<uint64_t>(optimizationLevel);
+                header.stackCapacity = stackCapacity;
+                header.returnStackCapacity = returnStackCapacity;
+
+                // Section offsets are in bytes from the start of the file.
+                auto const begin = [&](Section& section, std::size_t const count)
+                {
+                    section.offset = sizeof(Header) + words.size() * sizeof(Word);
+                    section.count = count;
+                };
+
+                begin(header.instructions, program.instructions.size());
+                for (auto const& instruction : program.instructions)
+                {
+                    append(static_cast<Word>(instruction.opcode) | (static_cast<Word>(instruction.checkStack) << 8));
+                    append(instruction.operand);
+                }
+
+                begin(header.sourceOffsets, program.sourceOffsets.size());
+                for (auto const offset : program.sourceOffsets)
+                {
+                    append(offset);
+                }
+
+                begin(header.panicHandlers, program.panicHandlers.size());
+                for (auto const handler : program.panicHandlers)
+                {
+                    append(handler);
+                }
+
+                begin(header.builtInPanicHandlers, program.builtInPanicHandlers.size());
+                for (auto const handler : program.builtInPanicHandlers)
+                {
+                    append(handler);
+                }
+
+                // String tables hold an offset into the string data and a length for each string.
+                auto const strings = [&](Section& section, std::vector<std::string> const& table)
+                {
+                    begin(section, table.size());
+                    for (auto const& text : table)
+                    {
+                        append(stringData.size());
+                        append(text.size());
+                        stringData += text;
+                    }
+                };
+                begin(header.labelAddresses, program.labelAddresses.size());
+                for (auto const address : program.labelAddresses)
+                {
+                    append(address);
+                }
+
+                strings(header.names, program.names);
+                strings(header.variables, program.variables);
+                strings(header.strings, program.strings);
+                strings(header.labelNames, program.labelNames);
+                begin(header.stringData, stringData.size());
+
+                output.write(reinterpret_cast<char const*>(&header), sizeof(header));
+                output.write(reinterpret_cast<char const*>(words.data()), static_cast<std::streamsize>(words.size() * sizeof(Word)));
+                output.write(stringData.data(), static_cast<std::streamsize>(stringData.size()));
+            }
+
+            /// Reads a compiled program, checking that it is well formed.
+            /// @param data The contents of a `.pnckc` file.
+            /// @param program Set to the compiled program.
+            /// @param origin If not null, set to where the program came from.
+            /// @returns False if the data is not a compiled program for this version of Pancake.
+            static bool Read(std::string_view const data, CompiledProgram& program, Origin* const origin = nullptr)
+            {
+                if (data.size() < sizeof(Header) || !IsBytecode(data))
+                {
+                    return false;
+                }
+
+                Header header{};
+                std::memcpy(&header, data.data(), sizeof(header));
+                if (header.version != Version || header.byteOrder != ByteOrder
+                    || header.opcodeCount != OpcodeCount || header.panicTypeCount != PanicTypeCount
+                    || header.builtInPanicHandlers.count != PanicTypeCount
+                    || header.stackCapacity == 0 || header.returnStackCapacity == 0)
+                {
+                    return false;
+                }
+
+                auto const fits = [&](Section const& section, std::size_t const wordsPerEntry)
+                {
+                    auto const entries = (data.size() - std::min<std::size_t>(section.offset, data.size())) / sizeof(Word) / wordsPerEntry;
+                    return section.offset >= sizeof(Header) && section.offset % sizeof(Word) == 0 && section.count <= entries;
+                };
+                if (!fits(header.instructions, 2) || !fits(header.sourceOffsets, 1) || !fits(header.panicHandlers, 1)
+                    || !fits(header.builtInPanicHandlers, 1) || !fits(header.names, 2) || !fits(header.variables, 2)
+                    || !fits(header.strings, 2) || !fits(header.labelNames, 2) || !fits(header.labelAddresses, 1)
+                    || header.stringData.offset > data.size()
+                    || header.stringData.count > data.size() - header.stringData.offset)
+                {
+                    return false;
+                }
+
+                auto const word = [&](Section const& section, std::size_t const index)
+                {
+                    Word value;
+                    std::memcpy(&value, data.data() + section.offset + index * sizeof(Word), sizeof(value));
+                    return value;
+                };
+                auto const words = [&](Section const& section, std::vector<std::size_t>& table)
+                {
+                    table.resize(section.count);
+                    for (std::size_t index = 0; index < section.count; ++index)
+                    {
+                        table[index] = static_cast<std::size_t>(word(section, index));
+                    }
+                };
+                auto const strings = [&](Section const& section, std::vector<std::string>& table)
+                {
+                    table.resize(section.count);
+                    for (std::size_t index = 0; index < section.count; ++index)
+                    {
+                        auto const offset = word(section, index * 2);
+                        auto const length = word(section, index * 2 + 1);
+                        if (offset > header.stringData.count || length > header.stringData.count - offset)
+                        {
+                            return false;
+                        }
+                        table[index].assign(data.data() + header.stringData.offset + offset, length);
+                    }
+                    return true;
+                };
+
+                CompiledProgram result{};
+                result.instructions.resize(header.instructions.count);
+                for (std::size_t index = 0; index < header.instructions.count; ++index)
+                {
+                    auto const encoded = word(header.instructions, index * 2);
+                    result.instructions[index].opcode = static_cast<Opcode>(encoded & 0xFF);
+                    result.instructions[index].checkStack = ((encoded >> 8) & 1) != 0;
+                    result.instructions[index].operand = word(header.instructions, index * 2 + 1);
+                }
+                words(header.sourceOffsets, result.sourceOffsets);
+                words(header.panicHandlers, result.panicHandlers);
+                words(header.builtInPanicHandlers, result.builtInPanicHandlers);
+                words(header.labelAddresses, result.labelAddresses);
+                if (!strings(header.names, result.names) || !strings(header.variables, result.variables) || !strings(header.strings, result.strings)
+                    || !strings(header.labelNames, result.labelNames) || !IsWellFormed(result))
+                {
+                    return false;
+                }
+
+                program = std::move(result);
+                if (origin != nullptr)
+                {
+                    *origin = { header.sourceHash, header.sourceLength, static_cast<int>(header.optimizationLevel),
+                        static_cast<std::size_t>(header.stackCapacity), static_cast<std::size_t>(header.returnStackCapacity) };
+                }
+                return true;
+            }
+
+            /// Gets a value indicating whether or not data starts like a snapshot.
+            /// @param data The data.
+            static bool IsSnapshot(std::string_view const data) noexcept
+            {
+                return data.size() >= sizeof(SnapshotMagic) && std::memcmp(data.data(), SnapshotMagic, sizeof(SnapshotMagic)) == 0;
+            }
+
+            /// Writes a snapshot in the `.pncks` format, which holds the state of the virtual machine
+            /// followed by the program it was running in the `.pnckc` format.
+            /// @param snapshot The snapshot, which must not be empty.
+            /// @param source The source the program was compiled from, which is hashed into the program's header.
+            /// @param optimizationLevel The optimization level the program was compiled with.
+            /// @param output The stream to write to, which must be opened in binary mode.
+            static void WriteSnapshot(PancakeSnapshot const& snapshot, std::string_view const source, int const optimizationLevel, std::ostream& output)
+            {
+                std::ostringstream program{};
+                Write(*snapshot._program, source, optimizationLevel, snapshot._stackCapacity, snapshot._returnStackCapacity, program);
+                auto const programData = program.str();
+
+                std::vector<Word> words{};
+                SnapshotHeader header{};
+                std::memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+                header.version = Version;
+                header.byteOrder = ByteOrder;
+                header.instructionPointer = snapshot._instructionPointer;
+                header.running = snapshot._running;
+                header.highWaterMark = snapshot._highWaterMark;
+                header.heapSize = snapshot._heapSize;
+                header.stackCapacity = snapshot._stackCapacity;
+                header.returnStackCapacity = snapshot._returnStackCapacity;
+
+                auto const section = [&](Section& section, auto const& values)
+                {
+                    section.offset = sizeof(SnapshotHeader) + words.size() * sizeof(Word);
+                    section.count = values.size();
+                    words.insert(words.end(), values.begin(), values.end());
+                };
+                section(header.stack, *snapshot._stack);
+                section(header.returnStack, *snapshot._returnStack);
+                section(header.memoryValues, snapshot._memory->_values);
+                section(header.memoryDefined, snapshot._memory->_defined);
+                section(header.heap, *snapshot._heap);
+                header.program = { sizeof(SnapshotHeader) + words.size() * sizeof(Word), programData.size() };
+
+                output.write(reinterpret_cast<char const*>(&header), sizeof(header));
+                output.write(reinterpret_cast<char const*>(words.data()), static_cast<std::streamsize>(words.size() * sizeof(Word)));
+                output.write(programData.data(), static_cast<std::streamsize>(programData.size()));
+            }
+
+            /// Reads a snapshot, checking that it is well formed and that its state fits its program.
+            /// @param data The contents of a `.pncks` file.
+            /// @param snapshot Set to the snapshot.
+            /// @param origin If not null, set to where the snapshot's program came from.
+            /// @returns False if the data is not a snapshot for this version of Pancake.
+            static bool ReadSnapshot(std::string_view const data, PancakeSnapshot& snapshot, Origin* const origin = nullptr)
+            {
+                if (data.size() < sizeof(SnapshotHeader) || !IsSnapshot(data))
+                {
+                    return false;
+                }
+
+                SnapshotHeader header{};
+                std::memcpy(&header, data.data(), sizeof(header));
+                auto const fits = [&](Section const& section, std::size_t const size)
+                {
+                    return section.offset >= sizeof(SnapshotHeader) && section.offset <= data.size() && section.count <= (data.size() - section.offset) / size;
+                };
+                if (header.version != Version || header.byteOrder != ByteOrder || !fits(header.stack, sizeof(Word))
+                    || !fits(header.returnStack, sizeof(Word)) || !fits(header.memoryValues, sizeof(Word))
+                    || !fits(header.memoryDefined, sizeof(Word)) || !fits(header.heap, sizeof(Word)) || !fits(header.program, 1))
+                {
+                    return false;
+                }
+
+                // The program must have been compiled for the stacks the state was captured from.
+                CompiledProgram program{};
+                Origin programOrigin{};
+                if (!Read(data.substr(header.program.offset, header.program.count), program, &programOrigin)
+                    || !programOrigin.IsCompiledFor(header.stackCapacity, header.returnStackCapacity))
+                {
+                    return false;
+                }
+
+                auto const words = [&](Section const& section)
+                {
+                    std::vector<Word> values(section.count);
+                    if (!values.empty())
+                    {
+                        std::memcpy(values.data(), data.data() + section.offset, values.size() * sizeof(Word));
+                    }
+                    return values;
+                };
+                auto const isAddress = [&](Word const address) { return address < program.instructions.size(); };
+                auto const slotCount = program.variables.size();
+                auto returnStack = words(header.returnStack);
+                if (!isAddress(header.instructionPointer) || !std::all_of(returnStack.begin(), returnStack.end(), isAddress)
+                    || header.memoryValues.count != slotCount || header.memoryDefined.count != (slotCount + 63) / 64
+                    || header.heap.count > header.heapSize || header.stack.count > header.stackCapacity
+                    || returnStack.size() > header.returnStackCapacity)
+                {
+                    return false;
+                }
+
+                // The program may have had stack checks removed, which is only safe from a state the analysis allows for:
+                // a stack as deep as any path leaves it at the instruction pointer, and returns only to the instructions
+                // after calls, which the analysis takes to follow every return.
+                auto const analysis = StackDepthAnalysis(program);
+                auto const isResumePoint = [&](Word const address)
+                {
+                    return address != 0 && program.instructions[address - 1].opcode == Opcode::Call;
+                };
+                if (!analysis.IsReachable(header.instructionPointer)
+                    || header.stack.count < analysis.GetMinimumDepth(header.instructionPointer)
+                    || !std::all_of(returnStack.begin(), returnStack.end(), isResumePoint))
+                {
+                    return false;
+                }
+
+                // Only the values of defined slots are kept, exactly as a virtual machine would have stored them.
+                auto const values = words(header.memoryValues);
+                auto const defined = words(header.memoryDefined);
+                Memory memory{};
+                memory.Reset(slotCount);
+                for (std::size_t slot = 0; slot < slotCount; ++slot)
+                {
+                    if ((defined[slot / 64] >> (slot % 64)) & 1)
+                    {
+                        memory.Store(slot, values[slot]);
+                    }
+                }
+
+                PancakeSnapshot result{};
+                result._program = std::make_shared<CompiledProgram const>(std::move(program));
+                result._instructionPointer = static_cast<InstructionPointer>(header.instructionPointer);
+                result._running = header.running != 0;
+                result._highWaterMark = static_cast<std::size_t>(header.highWaterMark);
+                result._heapSize = static_cast<std::size_t>(header.heapSize);
+                result._stackCapacity = static_cast<std::size_t>(header.stackCapacity);
+                result._returnStackCapacity = static_cast<std::size_t>(header.returnStackCapacity);
+                result._stack = std::make_shared<std::vector<Word> const>(words(header.stack));
+                result._returnStack = std::make_shared<std::vector<InstructionPointer> const>(returnStack.begin(), returnStack.end());
+                result._memory = std::make_shared<Memory const>(std::move(memory));
+                result._heap = std::make_shared<std::vector<Word> const>(words(header.heap));
+                snapshot = std::move(result);
+                if (origin != nullptr)
+                {
+                    *origin = programOrigin;
+                }
+                return true;
+            }
+
+        private:
+            static constexpr char Magic[8] = { 'P', 'N', 'C', 'K', 'C', '\0', '\r', '\n' };
+            static constexpr char SnapshotMagic[8] = { 'P', 'N', 'C', 'K', 'S', '\0', '\r', '\n' };
+            static constexpr uint32_t ByteOrder = 0x01020304;
+
+            struct Section
+            {
+                uint64_t offset;
+                uint64_t count;
+            };
+
+            struct Header
+            {
+                char magic[8];
+                uint32_t version;
+                uint32_t byteOrder;
+                uint32_t opcodeCount;
+                uint32_t panicTypeCount;
+                uint64_t sourceHash;
+                uint64_t sourceLength;
+                uint64_t optimizationLevel;
+                uint64_t stackCapacity;
+                uint64_t returnStackCapacity;
+                Section instructions;
+                Section sourceOffsets;
+                Section panicHandlers;
+                Section builtInPanicHandlers;
+                Section names;
+                Section variables;
+                Section strings;
+                Section labelNames;
+                Section labelAddresses;
+                Section stringData;
+            };
+
+            struct SnapshotHeader
+            {
+                char magic[8];
+                uint32_t version;
+                uint32_t byteOrder;
+                uint64_t instructionPointer;
+                uint64_t running;
+                uint64_t highWaterMark;
+                uint64_t heapSize;
+                uint64_t stackCapacity;
+                uint64_t returnStackCapacity;
+                Section stack;
+                Section returnStack;
+                Section memoryValues;
+                Section memoryDefined;
+                Section heap;
+                Section program;
+            };
+
+            static bool IsWellFormed(CompiledProgram const& program)
+            {
+                // The virtual machine trusts compiled programs, so every operand it indexes with is checked here.
+                auto const& instructions = program.instructions;
+                if (instructions.empty() || instructions.back().opcode != Opcode::Terminate
+                    || program.sourceOffsets.size() != instructions.size() || program.panicHandlers.size() != program.names.size())
+                {
+                    return false;
+                }
+
+                auto const isAddress = [&](Word const address) { return address < instructions.size(); };
+                auto const isHandler = [&](InstructionPointer const address) { return address == NoPanicHandler || isAddress(address); };
+                if (!std::all_of(program.panicHandlers.begin(), program.panicHandlers.end(), isHandler)
+                    || !std::all_of(program.builtInPanicHandlers.begin(), program.builtInPanicHandlers.end(), isHandler)
+                    || !std::all_of(program.labelAddresses.begin(), program.labelAddresses.end(), isAddress)
+                    || program.labelNames.size() != program.labelAddresses.size())
+                {
+                    return false;
+                }
+
+                for (auto const& instruction : instructions)
+                {
+                    auto const operand = instruction.operand;
+                    if (IsJump(instruction.opcode) && !isAddress(operand))
+                    {
+                        return false;
+                    }
+
+                    switch (instruction.opcode)
+                    {
+                        case Opcode::Panic:
+                            if (operand >= program.names.size())
                             {
-                                throw PancakePanic(PanicType::InvalidLanguage, "Unmatched braces for argument instruction.");
+                                return false;
                             }
-                            auto argumentStartIndex = instructionPointer + 2;
-                            auto argument = program.substr(argumentStartIndex, nextClosingBraceIndex - argumentStartIndex);
+                            break;
 
-                            if (instruction == '^')
+                        case Opcode::Store:
+                        case Opcode::Load:
+                        case Opcode::IncrementVariable:
+                        case Opcode::DecrementVariable:
+                            if (operand >= program.variables.size())
                             {
-                                auto value = static_cast<Pancake::Word>(std::stoull(argument));
-                                _virtualMachine.DispatchWordInstruction(instruction, value);
+                                return false;
                             }
-                            else
+                            break;
+
+                        case Opcode::OutputString:
+                            if (operand >= program.strings.size())
                             {
-                                _virtualMachine.DispatchLabelInstruction(instruction, argument);
+                                return false;
                             }
-                        }
-                        else
-                        {
-                            _virtualMachine.DispatchInstruction(instruction);
-                        }
+                            break;
+
+                        default:
+                            if (static_cast<std::size_t>(instruction.opcode) >= OpcodeCount)
+                            {
+                                return false;
+                            }
+                            break;
+                    }
+                }
+
+                // A stack check is only left out where the analysis the optimizer used proves it can never fail.
+                auto const analysis = StackDepthAnalysis(program);
+                for (InstructionPointer address = 0; address < instructions.size(); ++address)
+                {
+                    auto const& instruction = instructions[address];
+                    if (!instruction.checkStack && (!analysis.IsReachable(address)
+                        || analysis.GetMinimumDepth(address) < GetStackEffect(instruction.opcode).required))
+                    {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+    };
+
+    /// Writes the counts gathered by profiled runs as reports.
+    class PancakeProfiler final
+    {
+        public:
+            /// The number of source offsets listed as hot spots.
+            static constexpr std::size_t HotSpotCount = 20;
+
+            /// Writes a report of the opcodes, source offsets, labels and memory slots a program used most.
+            /// @param program The profiled program.
+            /// @param profile The counts.
+            /// @param source The program source, used to show each hot spot, or empty if it is not available.
+            /// @param output The stream to write the report to.
+            static void WriteReport(CompiledProgram const& program, ExecutionProfile const& profile, std::string_view const source, std::ostream& output)
+            {
+                auto const& instructions = program.instructions;
+                uint64_t total = 0;
+                std::vector<uint64_t> opcodeCounts(OpcodeCount, 0);
+                std::vector<uint64_t> loads(program.variables.size(), 0);
+                std::vector<uint64_t> stores(program.variables.size(), 0);
+                for (InstructionPointer address = 0; address < instructions.size(); ++address)
+                {
+                    auto const count = profile.executions[address];
+                    auto const& instruction = instructions[address];
+                    total += count;
+                    opcodeCounts[static_cast<std::size_t>(instruction.opcode)] += count;
+
+                    switch (instruction.opcode)
+                    {
+                        case Opcode::Load:
+                            loads[instruction.operand] += count;
+                            break;
+
+                        case Opcode::Store:
+                            stores[instruction.operand] += count;
+                            break;
+
+                        case Opcode::IncrementVariable:
+                        case Opcode::DecrementVariable:
+                            loads[instruction.operand] += count;
+                            stores[instruction.operand] += count;
+                            break;
+
+                        default:
+                            break;
+                    }
+                }
+
+                auto const percentage = [&](uint64_t const count)
+                {
+                    return total == 0 ? 0.0 : 100.0 * static_cast<double>(count) / static_cast<double>(total);
+                };
+                auto const row = [&](std::string const& name, uint64_t const first, std::string const& second)
+                {
+                    output << "  " << std::left << std::setw(36) << name << std::right << std::setw(14) << first << std::setw(14) << second << '\n';
+                };
+                auto const header = [&](char const* name, char const* first, char const* second)
+                {
+                    output << '\n' << name << "\n  " << std::left << std::setw(36) << "" << std::right << std::setw(14) << first << std::setw(14) << second << '\n';
+                };
+                auto const share = [&](uint64_t const count)
+                {
+                    std::ostringstream text{};
+                    text << std::fixed << std::setprecision(2) << percentage(count) << '%';
+                    return text.str();
+                };
+
+                output << "Profile: " << total << " instructions executed, peak stack depth " << profile.peakDepth << ".\n";
+
+                header("Opcodes", "Executed", "Share");
+                for (auto const opcode : SortedByCount(opcodeCounts))
+                {
+                    row(GetOpcodeName(static_cast<Opcode>(opcode)), opcodeCounts[opcode], share(opcodeCounts[opcode]));
+                }
+
+                header("Hot spots", "Executed", "Share");
+                auto const addresses = SortedByCount(profile.executions);
+                for (std::size_t rank = 0; rank < addresses.size() && rank < HotSpotCount; ++rank)
+                {
+                    auto const address = addresses[rank];
+                    auto const offset = program.sourceOffsets[address];
+                    auto name = "Offset " + std::to_string(offset) + " " + GetOpcodeName(instructions[address].opcode);
+                    if (offset < source.size())
+                    {
+                        name += " " + SourceText(source, offset);
+                    }
+                    row(name, profile.executions[address], share(profile.executions[address]));
+                }
+
+                header("Labels", "Taken", "Reached");
+                for (auto const label : SortedLabels(program, profile))
+                {
+                    auto const address = program.labelAddresses[label];
+                    row(program.labelNames[label], profile.jumps[address], std::to_string(profile.executions[address]));
+                }
+
+                header("Memory slots", "Loads", "Stores");
+                for (std::size_t slot = 0; slot < program.variables.size(); ++slot)
+                {
+                    row(program.variables[slot], loads[slot], std::to_string(stores[slot]));
+                }
+            }
+
+            /// Writes the counts in the collapsed stack format read by flame graph tools.
+            /// Each line is the label an instruction follows, the instruction and its source offset, and a count.
+            /// @param program The profiled program.
+            /// @param profile The counts.
+            /// @param output The stream to write to.
+            static void WriteCollapsedStacks(CompiledProgram const& program, ExecutionProfile const& profile, std::ostream& output)
+            {
+                std::vector<std::size_t> labels(program.labelAddresses.size());
+                for (std::size_t label = 0; label < labels.size(); ++label)
+                {
+                    labels[label] = label;
+                }
+                std::stable_sort(labels.begin(), labels.end(), [&](std::size_t const left, std::size_t const right)
+                {
+                    return program.labelAddresses[left] < program.labelAddresses[right];
+                });
+
+                std::size_t next = 0;
+                std::string frame = "(start)";
+                for (InstructionPointer address = 0; address < program.instructions.size(); ++address)
+                {
+                    while (next < labels.size() && program.labelAddresses[labels[next]] <= address)
+                    {
+                        frame = FrameName(program.labelNames[labels[next]]);
+                        ++next;
+                    }
+
+                    if (profile.executions[address] != 0)
+                    {
+                        output << frame << ';' << GetOpcodeName(program.instructions[address].opcode)
+                            << '@' << program.sourceOffsets[address] << ' ' << profile.executions[address] << '\n';
+                    }
+                }
+            }
+
+        private:
+            static std::vector<std::size_t> SortedByCount(std::vector<uint64_t> const& counts)
+            {
+                // Zero counts are left out, and ties keep their original order.
+                std::vector<std::size_t> indices{};
+                for (std::size_t index = 0; index < counts.size(); ++index)
+                {
+                    if (counts[index] != 0)
+                    {
+                        indices.push_back(index);
                     }
                 }
+                std::stable_sort(indices.begin(), indices.end(), [&](std::size_t const left, std::size_t const right)
+                {
+                    return counts[left] > counts[right];
+                });
+                return indices;
+            }
+
+            static std::vector<std::size_t> SortedLabels(CompiledProgram const& program, ExecutionProfile const& profile)
+            {
+                std::vector<uint64_t> counts(program.labelAddresses.size());
+                for (std::size_t label = 0; label < counts.size(); ++label)
+                {
+                    // Labels which were never jumped to are still listed if they were reached.
+                    auto const address = program.labelAddresses[label];
+                    counts[label] = profile.jumps[address] * 2 + (profile.executions[address] != 0);
+                }
+                return SortedByCount(counts);
+            }
+
+            static std::string SourceText(std::string_view const source, std::size_t const offset)
+            {
+                // An instruction with an argument is shown up to its closing brace.
+                auto length = std::size_t(1);
+                if (offset + 1 < source.size() && source[offset + 1] == '{')
+                {
+                    auto const close = source.find('}', offset);
+                    length = close == std::string_view::npos ? source.size() - offset : close - offset + 1;
+                }
+                return std::string(source.substr(offset, std::min<std::size_t>(length, 24)));
+            }
+
+            static std::string FrameName(std::string name)
+            {
+                // Semicolons separate frames and spaces separate the count, so neither can appear in a name.
+                std::replace(name.begin(), name.end(), ';', '_');
+                std::replace(name.begin(), name.end(), ' ', '_');
+                return name;
+            }
+    };
+
+    /// Interprets Pancake programs.
+    /// @tparam TVirtualMachine The virtual machine programs run on.
+    template <typename TVirtualMachine>
+    class BasicPancakeInterpreter final
+    {
+        public:
+            using VirtualMachine = TVirtualMachine;
+
+            /// Initializes a new instance of the BasicPancakeInterpreter class.
+            /// @param stackCapacity The maximum number of words on the operand stack.
+            /// @param optimizationLevel The optimization level programs are compiled with.
+            /// @param returnStackCapacity The maximum number of nested subroutine calls.
+            explicit BasicPancakeInterpreter(std::size_t const stackCapacity = DefaultStackCapacity, int const optimizationLevel = DefaultOptimizationLevel,
+                std::size_t const returnStackCapacity = DefaultReturnStackCapacity)
+                : _virtualMachine(stackCapacity, returnStackCapacity), _optimizationLevel(optimizationLevel)
+            {
+            }
+
+            /// Sets whether or not programs are compiled to machine code before they run.
+            /// Programs are interpreted where the JIT compiler is unavailable.
+            /// @param enabled Whether or not to use the JIT compiler.
+            void SetJitEnabled(bool const enabled) noexcept
+            {
+                _virtualMachine.SetJitEnabled(enabled);
+            }
+
+            /// Sets when output written by programs is flushed.
+            /// @param policy The flush policy.
+            void SetFlushPolicy(FlushPolicy const policy) noexcept
+            {
+                _virtualMachine.SetFlushPolicy(policy);
+            }
+
+            /// Sets whether or not programs are profiled while they run.
+            /// @param enabled Whether or not to profile programs.
+            void SetProfilingEnabled(bool const enabled) noexcept
+            {
+                _virtualMachine.SetProfilingEnabled(enabled);
+            }
+
+            /// Sets the number of words in the heap of programs which access the heap.
+            /// @param size The number of words.
+            void SetHeapSize(std::size_t const size) noexcept
+            {
+                _virtualMachine.SetHeapSize(size);
+            }
+
+            /// Gets the virtual machine programs run on, e.g. to read the program and profile of the last run.
+            TVirtualMachine const& GetVirtualMachine() const noexcept
+            {
+                return _virtualMachine;
+            }
+
+            /// Gets the virtual machine programs run on, e.g. to set its tracer or breakpoints.
+            TVirtualMachine& GetVirtualMachine() noexcept
+            {
+                return _virtualMachine;
+            }
+
+            /// Compiles and optimizes a program once, so that it can be loaded into any number of virtual machines.
+            /// @param program The program source.
+            /// @returns The compiled program.
+            /// @throws PancakePanic if the program does not compile.
+            std::shared_ptr<CompiledProgram const> Compile(std::string_view const program) const
+            {
+                auto compiledProgram = PancakeCompiler::Compile(program);
+                PancakeOptimizer::Optimize(compiledProgram, _optimizationLevel, _virtualMachine.GetStack().Capacity(),
+                    _virtualMachine.GetReturnStack().Capacity());
+                return std::make_shared<CompiledProgram const>(std::move(compiledProgram));
+            }
+
+            /// Runs the instructions in the given program until they
+            /// are exhausted or an error is encountered.
+            /// @param program The program source.
+            void Interpret(std::string_view const program)
+            {
+                std::shared_ptr<CompiledProgram const> compiledProgram{};
+                try
+                {
+                    compiledProgram = Compile(program);
+                }
                 catch (PancakePanic const& pancakeException)
                 {
                     std::cerr << "Pancake runtime error: " << pancakeException.what() << std::endl;
+                    return;
                 }
                 catch (...)
                 {
                     std::cerr << "Unspecified error." << std::endl;
+                    return;
                 }
+
+                Interpret(std::move(compiledProgram));
             }
 
-        private:
-            PancakeVirtualMachine _virtualMachine{};
+            /// Runs a compiled program until it halts or an error is encountered.
+            /// @param program The compiled program.
+            void Interpret(std::shared_ptr<CompiledProgram const> program)
+            {
+                RunReportingErrors([&]
+                {
+                    _virtualMachine.Load(std::move(program));
+                    _virtualMachine.Run();
+                });
+            }
+
+            /// Restores the virtual machine from a snapshot and runs the program from there until it halts or an error is encountered.
+            /// @param snapshot The snapshot.
+            void Interpret(PancakeSnapshot const& snapshot)
+            {
+                RunReportingErrors([&]
+                {
+                    _virtualMachine.Restore(snapshot);
+                    _virtualMachine.Run();
+                });
+            }
 
-            static void PreProcessProgram(std::string& program)
+            /// Runs the given program until it first waits for input, and writes the state of the virtual machine at that
+            /// point as a snapshot. Anything the program writes before then is written as usual, and not again when the
+            /// snapshot is run. A program which halts without reading input is captured after it halts.
+            /// @param program The program source.
+            /// @param output The stream to write the snapshot to, which must be opened in binary mode.
+            /// @returns True if the program compiled and did not PANic before it read input.
+            bool EmitSnapshot(std::string_view const program, std::ostream& output)
             {
-                /// Remove standard whitespace characters.
-                std::unordered_set<char> charactersToRemove = { '\n', '\r', ' ', '\t' };
-                auto removeWhitespaceFunction = [&](char const c) { return charactersToRemove.find(c) != charactersToRemove.end(); };
-                auto endPosition = std::remove_if(program.begin(), program. end(), removeWhitespaceFunction);
-                program.erase(endPosition, program.end());
+                std::shared_ptr<CompiledProgram const> compiledProgram{};
+                try
+                {
+                    compiledProgram = Compile(program);
+                }
+                catch (PancakePanic const& pancakeException)
+                {
+                    std::cerr << "Pancake runtime error: " << pancakeException.what() << std::endl;
+                    return false;
+                }
+                catch (...)
+                {
+                    std::cerr << "Unspecified error." << std::endl;
+                    return false;
+                }
 
-                // Remove comments.
-                while (true)
+                // Input which never arrives stops the program at its first input instruction.
+                QueueInputSource pending{};
+                _virtualMachine.SetInput(pending);
+                auto const ran = RunReportingErrors([&]
+                {
+                    _virtualMachine.Load(std::move(compiledProgram));
+                    _virtualMachine.Run();
+                });
+                _virtualMachine.SetInput(StandardInputSource());
+                if (!ran)
+                {
+                    return false;
+                }
+
+                PancakeBytecode::WriteSnapshot(_virtualMachine.Capture(), program, _optimizationLevel, output);
+                return true;
+            }
+
+            /// Compiles the given program to the `.pnckc` format instead of running it.
+            /// @param program The program source.
+            /// @param output The stream to write the compiled program to.
+            /// @returns True if the program compiled.
+            bool EmitBytecode(std::string_view const program, std::ostream& output)
+            {
+                try
+                {
+                    PancakeBytecode::Write(*Compile(program), program, _optimizationLevel, _virtualMachine.GetStack().Capacity(),
+                        _virtualMachine.GetReturnStack().Capacity(), output);
+                    return true;
+                }
+                catch (PancakePanic const& pancakeException)
+                {
+                    std::cerr << "Pancake error: " << pancakeException.what() << std::endl;
+                }
+                catch (...)
+                {
+                    std::cerr << "Unspecified error." << std::endl;
+                }
+
+                return false;
+            }
+
+            /// Compiles the given program to a standalone C translation unit instead of running it.
+            /// @param program The program source.
+            /// @param output The stream to write the translation unit to.
+            /// @returns True if the program compiled.
+            bool EmitC(std::string_view const program, std::ostream& output)
+            {
+                try
+                {
+                    EmitC(*Compile(program), output);
+                    return true;
+                }
+                catch (PancakePanic const& pancakeException)
+                {
+                    std::cerr << "Pancake error: " << pancakeException.what() << std::endl;
+                }
+                catch (...)
+                {
+                    std::cerr << "Unspecified error." << std::endl;
+                }
+
+                return false;
+            }
+
+            /// Writes a compiled program as a standalone C translation unit.
+            /// @param program The compiled program.
+            /// @param output The stream to write the translation unit to.
+            void EmitC(CompiledProgram const& program, std::ostream& output) const
+            {
+                PancakeCEmitter::Emit(program, _virtualMachine.GetStack().Capacity(), _virtualMachine.GetReturnStack().Capacity(),
+                    _virtualMachine.GetHeapSize(), output);
+            }
+
+            /// Checks the given program without running it, reporting every
+            /// instruction which always exhausts the stack when it is reached.
+            /// @param program The program source.
+            /// @returns True if no problems were found.
+            bool Check(std::string_view const program)
+            {
+                try
                 {
-                    auto const commentStart = program.find('`');
-                    if (commentStart == std::string::npos)
+                    auto const compiledProgram = PancakeCompiler::Compile(program);
+                    auto const analysis = StackDepthAnalysis(compiledProgram);
+
+                    auto problemCount = 0;
+                    for (InstructionPointer address = 0; address < compiledProgram.instructions.size(); ++address)
                     {
-                        break;
+                        auto const required = GetStackEffect(compiledProgram.instructions[address].opcode).required;
+                        if (!analysis.IsReachable(address) || analysis.GetMaximumDepth(address) >= required)
+                        {
+                            continue;
+                        }
+
+                        auto const offset = compiledProgram.sourceOffsets[address];
+                        std::cout << "Offset " << offset << ": '" << program[offset] << "' always exhausts the stack (needs "
+                            << required << ", has at most " << analysis.GetMaximumDepth(address) << ")." << std::endl;
+                        ++problemCount;
                     }
 
-                    auto const commentEnd = program.find('`', commentStart + 1);
-                    if (commentEnd == std::string::npos)
+                    return problemCount == 0;
+                }
+                catch (PancakePanic const& pancakeException)
+                {
+                    std::cerr << "Pancake error: " << pancakeException.what() << std::endl;
+                }
+                catch (...)
+                {
+                    std::cerr << "Unspecified error." << std::endl;
+                }
+
+                return false;
+            }
+
+        private:
+            TVirtualMachine _virtualMachine;
+            int _optimizationLevel;
+
+            template <typename TFunction>
+            bool RunReportingErrors(TFunction&& run)
+            {
+                try
+                {
+                    run();
+                    return true;
+                }
+                catch (PancakePanic const& pancakeException)
+                {
+                    std::cerr << "Pancake runtime error: " << pancakeException.what() << std::endl;
+
+                    // A tracer which keeps recent instructions shows how the program got here.
+                    if (_virtualMachine.GetProgram() != nullptr)
                     {
-                        throw PancakePanic(PanicType::InvalidLanguage, "Unmatched comment.");
+                        _virtualMachine.GetTracer().WriteRecent(*_virtualMachine.GetProgram(), std::cerr);
                     }
-
-                    program.erase(commentStart, commentEnd - commentStart + 1);
                 }
+                catch (std::exception const& exception)
+                {
+                    std::cerr << "Pancake error: " << exception.what() << std::endl;
+                }
+                catch (...)
+                {
+                    std::cerr << "Unspecified error." << std::endl;
+                }
+
+                return false;
             }
     };
+
+    /// Interprets Pancake programs on the default virtual machine.
+    using PancakeInterpreter = BasicPancakeInterpreter<PancakeVirtualMachine>;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+# Runs pancake --batch and compares what it writes to the golden files of a case.
+# The timing report is left out of standard error, and the exit code is 1 if the case has a .err file, or 0 otherwise.
+#
+# PANCAKE - The interpreter.
+# CASE    - The case, without an extension: .args holds the command line arguments, with paths relative to the
+#           tests directory, .out is the expected standard output and .err (the expected standard error) is optional.
+
+get_filename_component(tests "${CMAKE_CURRENT_LIST_DIR}" ABSOLUTE)
+file(READ "${CASE}.args" arguments)
+string(STRIP "${arguments}" arguments)
+separate_arguments(arguments UNIX_COMMAND "${arguments}")
+
+execute_process(
+    COMMAND "${PANCAKE}" ${arguments}
+    WORKING_DIRECTORY "${tests}"
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+    RESULT_VARIABLE result)
+string(REGEX REPLACE "Ran [0-9]+ jobs? on [0-9]+ threads? in [^\n]*\n" "" error "${error}")
+string(REGEX REPLACE "Job latency: [^\n]*\n" "" error "${error}")
+
+file(READ "${CASE}.out" expectedOutput)
+if(NOT output STREQUAL expectedOutput)
+    message(FATAL_ERROR "Standard output does not match ${CASE}.out.\nExpected:\n${expectedOutput}\nActual:\n${output}")
+endif()
+
+set(expectedError "")
+set(expectedResult 0)
+if(EXISTS "${CASE}.err")
+    file(READ "${CASE}.err" expectedError)
+    set(expectedResult 1)
+endif()
+if(NOT error STREQUAL expectedError)
+    message(FATAL_ERROR "Standard error does not match ${CASE}.err.\nExpected:\n${expectedError}\nActual:\n${error}")
+endif()
+if(NOT result STREQUAL expectedResult)
+    message(FATAL_ERROR "pancake exited with ${result} rather than ${expectedResult}.")
+endif()
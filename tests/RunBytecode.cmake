@@ -0,0 +1,111 @@
+# Checks how the interpreter runs compiled program (.pnckc) and snapshot (.pncks) files.
+#
+# PANCAKE   - The interpreter.
+# PROGRAM   - A program which reads no input.
+# DIRECTORY - A directory the test can write to, which is emptied first.
+# CASE      - The check to run:
+#             capacities          - A compiled program is refused with stacks of other capacities.
+#             snapshot_capacities - A snapshot is refused with stacks of other capacities.
+#             cache               - The compile cache is filled, used, keyed on the options and repaired.
+
+file(REMOVE_RECURSE "${DIRECTORY}")
+file(MAKE_DIRECTORY "${DIRECTORY}")
+set(bytecode "${DIRECTORY}/program.pnckc")
+set(snapshot "${DIRECTORY}/program.pncks")
+
+# Runs the interpreter, failing the test unless it exits with the expected result.
+function(run_pancake expectedResult outputVariable errorVariable)
+    execute_process(
+        COMMAND "${PANCAKE}" ${ARGN}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+        RESULT_VARIABLE result)
+    if(NOT result STREQUAL expectedResult)
+        message(FATAL_ERROR "pancake ${ARGN} exited with ${result} rather than ${expectedResult}.\nStandard error:\n${error}")
+    endif()
+    set(${outputVariable} "${output}" PARENT_SCOPE)
+    set(${errorVariable} "${error}" PARENT_SCOPE)
+endfunction()
+
+# Compiles the program to the compiled program file, with extra command line arguments.
+function(emit_bytecode)
+    execute_process(
+        COMMAND "${PANCAKE}" ${ARGN} --emit-bytecode "${PROGRAM}"
+        OUTPUT_FILE "${bytecode}"
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Could not compile ${PROGRAM}.")
+    endif()
+endfunction()
+
+if(CASE STREQUAL "capacities")
+    emit_bytecode()
+    run_pancake(0 expectedOutput error "${PROGRAM}")
+    run_pancake(0 output error "${bytecode}")
+    if(NOT output STREQUAL expectedOutput)
+        message(FATAL_ERROR "The compiled program wrote:\n${output}\nrather than:\n${expectedOutput}")
+    endif()
+
+    foreach(arguments "--stack-size;2" "--call-depth;8")
+        run_pancake(255 output error ${arguments} "${bytecode}")
+        if(NOT error MATCHES "^The program was compiled for --stack-size [0-9]+ --call-depth [0-9]+")
+            message(FATAL_ERROR "A compiled program was not refused with ${arguments}:\n${output}${error}")
+        endif()
+    endforeach()
+elseif(CASE STREQUAL "snapshot_capacities")
+    run_pancake(0 expectedOutput error --snapshot "${snapshot}" "${PROGRAM}")
+    run_pancake(0 output error "${snapshot}")
+    foreach(arguments "--stack-size;2" "--call-depth;8")
+        run_pancake(255 output error ${arguments} "${snapshot}")
+        if(NOT error MATCHES "^The snapshot was taken with --stack-size [0-9]+ --call-depth [0-9]+")
+            message(FATAL_ERROR "A snapshot was not refused with ${arguments}:\n${output}${error}")
+        endif()
+    endforeach()
+elseif(CASE STREQUAL "cache")
+    set(cache "${DIRECTORY}/cache")
+    run_pancake(0 expectedOutput error "${PROGRAM}")
+
+    # A miss compiles the program and saves it.
+    run_pancake(0 output error --cache "${cache}" "${PROGRAM}")
+    file(GLOB cached "${cache}/*.pnckc")
+    list(LENGTH cached count)
+    if(NOT output STREQUAL expectedOutput OR NOT count EQUAL 1)
+        message(FATAL_ERROR "A cache miss wrote:\n${output}\nand saved ${count} programs.")
+    endif()
+    file(SHA256 "${cached}" savedHash)
+    file(TIMESTAMP "${cached}" savedTime "%Y-%m-%dT%H:%M:%S")
+
+    # A hit leaves the saved program as it was, which a miss would have replaced.
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E sleep 1.1)
+    run_pancake(0 output error --cache "${cache}" "${PROGRAM}")
+    file(TIMESTAMP "${cached}" time "%Y-%m-%dT%H:%M:%S")
+    if(NOT output STREQUAL expectedOutput OR NOT time STREQUAL savedTime)
+        message(FATAL_ERROR "A cache hit wrote:\n${output}\nor replaced the saved program.")
+    endif()
+
+    # Other options are a miss, saved separately.
+    run_pancake(0 output error --cache "${cache}" -O0 "${PROGRAM}")
+    run_pancake(0 output error --cache "${cache}" --stack-size 2 "${PROGRAM}")
+    file(GLOB cached "${cache}/*.pnckc")
+    list(LENGTH cached count)
+    if(NOT count EQUAL 3)
+        message(FATAL_ERROR "Programs compiled with other options were not saved separately.")
+    endif()
+    if(NOT error MATCHES "full stack")
+        message(FATAL_ERROR "A program compiled with --stack-size 2 did not fill the stack:\n${output}${error}")
+    endif()
+
+    # A damaged program is compiled again and replaced.
+    list(GET cached 0 damaged)
+    file(SHA256 "${damaged}" damagedHash)
+    file(WRITE "${damaged}" "Not a compiled program.")
+    run_pancake(0 output error --cache "${cache}" "${PROGRAM}")
+    run_pancake(0 output error --cache "${cache}" -O0 "${PROGRAM}")
+    run_pancake(0 output error --cache "${cache}" --stack-size 2 "${PROGRAM}")
+    file(SHA256 "${damaged}" hash)
+    if(NOT hash STREQUAL damagedHash)
+        message(FATAL_ERROR "A damaged program in the cache was not replaced.")
+    endif()
+else()
+    message(FATAL_ERROR "Unknown case ${CASE}.")
+endif()
@@ -0,0 +1,141 @@
+# Checks the reports and files the interpreter writes about a program, which vary too much to keep as golden files.
+#
+# PANCAKE   - The interpreter.
+# PROGRAM   - A program which reads no input, calls a subroutine at a label and never exhausts the stack.
+# GOLDEN    - The golden files of the program, without an extension: .out is what the program writes.
+# DIRECTORY - A directory the test can write to, which is emptied first.
+# CASE      - The check to run:
+#             trace_json - --trace-json writes Chrome trace JSON which parses, with spans named after labels.
+#             profile    - --profile reports on standard error, and writes collapsed stacks which count every instruction.
+#             check      - --check reports instructions which always exhaust the stack, without running the program.
+
+file(REMOVE_RECURSE "${DIRECTORY}")
+file(MAKE_DIRECTORY "${DIRECTORY}")
+file(READ "${GOLDEN}.out" expectedOutput)
+
+# Runs the interpreter, failing the test unless it exits with the expected result.
+function(run_pancake expectedResult outputVariable errorVariable)
+    execute_process(
+        COMMAND "${PANCAKE}" ${ARGN}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+        RESULT_VARIABLE result)
+    if(NOT result STREQUAL expectedResult)
+        message(FATAL_ERROR "pancake ${ARGN} exited with ${result} rather than ${expectedResult}.\nStandard error:\n${error}")
+    endif()
+    set(${outputVariable} "${output}" PARENT_SCOPE)
+    set(${errorVariable} "${error}" PARENT_SCOPE)
+endfunction()
+
+# The labels of the program and (start), which are the only names a span or frame can have.
+file(READ "${PROGRAM}" source)
+string(REGEX MATCHALL ":{[A-Za-z0-9_]+}" labels "${source}")
+string(REGEX REPLACE ":{([A-Za-z0-9_]+)}" "\\1" labels "${labels}")
+list(APPEND labels "(start)")
+
+if(CASE STREQUAL "trace_json")
+    set(trace "${DIRECTORY}/trace.json")
+    run_pancake(0 output error --trace-buffer 64 --trace-json "${trace}" "${PROGRAM}")
+    if(NOT output STREQUAL expectedOutput)
+        message(FATAL_ERROR "The traced program wrote:\n${output}\nrather than:\n${expectedOutput}")
+    endif()
+
+    file(READ "${trace}" json)
+    string(JSON count ERROR_VARIABLE parseError LENGTH "${json}" traceEvents)
+    if(parseError)
+        message(FATAL_ERROR "${trace} is not Chrome trace JSON: ${parseError}")
+    endif()
+    if(count EQUAL 0)
+        message(FATAL_ERROR "${trace} has no trace events.")
+    endif()
+
+    # Spans follow each other without gaps, and together cover the last 64 instructions.
+    string(JSON first GET "${json}" traceEvents 0 ts)
+    set(end ${first})
+    math(EXPR last "${count} - 1")
+    foreach(index RANGE ${last})
+        string(JSON name GET "${json}" traceEvents ${index} name)
+        string(JSON phase GET "${json}" traceEvents ${index} ph)
+        string(JSON start GET "${json}" traceEvents ${index} ts)
+        string(JSON duration GET "${json}" traceEvents ${index} dur)
+        list(FIND labels "${name}" label)
+        if(NOT phase STREQUAL "X" OR label EQUAL -1)
+            message(FATAL_ERROR "Trace event ${index} is not a span of a label: ${name} ${phase}")
+        endif()
+        if(NOT start EQUAL end OR duration LESS_EQUAL 0)
+            message(FATAL_ERROR "Trace event ${index} at ${start} for ${duration} does not follow the span before it, which ends at ${end}.")
+        endif()
+        math(EXPR end "${start} + ${duration}")
+    endforeach()
+    math(EXPR traced "${end} - ${first}")
+    if(NOT traced EQUAL 64)
+        message(FATAL_ERROR "The spans cover ${traced} instructions rather than the 64 in the trace buffer.")
+    endif()
+elseif(CASE STREQUAL "profile")
+    set(stacks "${DIRECTORY}/stacks.folded")
+    foreach(level -O0 -O3)
+        file(REMOVE "${stacks}")
+        run_pancake(0 output error ${level} --profile "${stacks}" "${PROGRAM}")
+        if(NOT output STREQUAL expectedOutput)
+            message(FATAL_ERROR "The program profiled with ${level} wrote:\n${output}\nrather than:\n${expectedOutput}")
+        endif()
+        if(NOT error MATCHES "\nLabels\n" OR NOT error MATCHES "^Profile: ([0-9]+) instructions executed")
+            message(FATAL_ERROR "The program profiled with ${level} did not report its profile:\n${error}")
+        endif()
+        set(executed ${CMAKE_MATCH_1})
+
+        # Each line is a stack of labels, then an instruction and the number of times it was executed.
+        # Frames are separated by semicolons, which CMake lists use too, so they are read as bars.
+        file(READ "${stacks}" lines)
+        string(REPLACE ";" "|" lines "${lines}")
+        string(STRIP "${lines}" lines)
+        string(REPLACE "\n" ";" lines "${lines}")
+        set(total 0)
+        foreach(line ${lines})
+            if(NOT line MATCHES "^(.+)\\|[A-Za-z]+@[0-9]+ ([0-9]+)$")
+                message(FATAL_ERROR "Collapsed stacks written with ${level} have a malformed line: ${line}")
+            endif()
+            math(EXPR total "${total} + ${CMAKE_MATCH_2}")
+            string(REPLACE "|" ";" frames "${CMAKE_MATCH_1}")
+            foreach(frame ${frames})
+                list(FIND labels "${frame}" label)
+                if(label EQUAL -1)
+                    message(FATAL_ERROR "Collapsed stacks written with ${level} have a frame which is not a label: ${line}")
+                endif()
+            endforeach()
+        endforeach()
+        if(NOT total EQUAL executed)
+            message(FATAL_ERROR "Collapsed stacks written with ${level} count ${total} instructions rather than ${executed}.")
+        endif()
+    endforeach()
+elseif(CASE STREQUAL "check")
+    run_pancake(0 output error --check "${PROGRAM}")
+    if(NOT output STREQUAL "" OR NOT error STREQUAL "")
+        message(FATAL_ERROR "Checking ${PROGRAM} reported problems or ran it:\n${output}${error}")
+    endif()
+
+    # The addition only has the one number to add when the input is zero, which cannot be known without running it.
+    set(sometimes "${DIRECTORY}/sometimes.pnck")
+    file(WRITE "${sometimes}" "^{72}.,z{a}^{1}:{a}+\n")
+    run_pancake(0 output error --check "${sometimes}")
+    if(NOT output STREQUAL "" OR NOT error STREQUAL "")
+        message(FATAL_ERROR "Checking a program which only exhausts the stack for some inputs reported:\n${output}${error}")
+    endif()
+
+    set(always "${DIRECTORY}/always.pnck")
+    file(WRITE "${always}" "^{72}.^{1}+\n")
+    run_pancake(1 output error --check "${always}")
+    set(expectedOutput "Offset 10: '+' always exhausts the stack (needs 2, has at most 1).\n")
+    if(NOT output STREQUAL expectedOutput OR NOT error STREQUAL "")
+        message(FATAL_ERROR "Checking a program which always exhausts the stack reported:\n${output}${error}\nrather than:\n${expectedOutput}")
+    endif()
+
+    set(unknown "${DIRECTORY}/unknown.pnck")
+    file(WRITE "${unknown}" "j{nowhere}\n")
+    run_pancake(1 output error --check "${unknown}")
+    if(NOT error MATCHES "^Pancake error: ")
+        message(FATAL_ERROR "Checking a program which does not compile reported:\n${output}${error}")
+    endif()
+else()
+    message(FATAL_ERROR "Unknown case ${CASE}.")
+endif()
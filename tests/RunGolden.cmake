@@ -0,0 +1,106 @@
+# Runs a Pancake program and compares what it writes to the golden files next to it.
+#
+# PANCAKE   - The interpreter.
+# PROGRAM   - The program.
+# GOLDEN    - The golden files, without an extension: .out is the expected standard output,
+#             and .in (the input), .err (the expected standard error) and .args (extra command
+#             line arguments the program always needs, e.g. --binary) are optional.
+# ARGUMENTS - Extra command line arguments, separated by spaces.
+# SNAPSHOT  - Optional. If given, the program is first run up to its first input and snapshotted
+#             to this path, and then the snapshot is run. Their output together is compared.
+# BYTECODE  - Optional. If given, the program is first compiled to this path with --emit-bytecode,
+#             and then the compiled program is run in its place. A program which does not compile is run
+#             as it is, to report its error in the usual way.
+# EMIT_C    - Optional. If given, the program is first written as C with --emit-c, and compiled to
+#             an executable at this path by C_COMPILER, which is run in place of the interpreter.
+#             A program which does not compile is run by the interpreter, as above.
+
+if(EXISTS "${GOLDEN}.args")
+    file(READ "${GOLDEN}.args" goldenArguments)
+    string(STRIP "${goldenArguments}" goldenArguments)
+    string(PREPEND ARGUMENTS "${goldenArguments} ")
+endif()
+separate_arguments(arguments UNIX_COMMAND "${ARGUMENTS}")
+
+set(input "")
+if(EXISTS "${GOLDEN}.in")
+    set(input INPUT_FILE "${GOLDEN}.in")
+endif()
+
+if(BYTECODE)
+    get_filename_component(directory "${BYTECODE}" DIRECTORY)
+    file(MAKE_DIRECTORY "${directory}")
+    execute_process(
+        COMMAND "${PANCAKE}" ${arguments} --emit-bytecode "${PROGRAM}"
+        OUTPUT_FILE "${BYTECODE}"
+        ERROR_QUIET
+        RESULT_VARIABLE result)
+    if(result EQUAL 0)
+        set(PROGRAM "${BYTECODE}")
+    endif()
+endif()
+
+set(command "${PANCAKE}" ${arguments} "${PROGRAM}")
+if(EMIT_C)
+    get_filename_component(directory "${EMIT_C}" DIRECTORY)
+    file(MAKE_DIRECTORY "${directory}")
+    execute_process(
+        COMMAND "${PANCAKE}" ${arguments} --emit-c "${PROGRAM}"
+        OUTPUT_FILE "${EMIT_C}.c"
+        ERROR_QUIET
+        RESULT_VARIABLE result)
+    if(result EQUAL 0)
+        execute_process(
+            COMMAND "${C_COMPILER}" -O1 -o "${EMIT_C}" "${EMIT_C}.c"
+            OUTPUT_VARIABLE compilerOutput
+            ERROR_VARIABLE compilerOutput
+            RESULT_VARIABLE result)
+        if(NOT result EQUAL 0)
+            message(FATAL_ERROR "Could not compile the C written for ${PROGRAM}:\n${compilerOutput}")
+        endif()
+        set(command "${EMIT_C}")
+    endif()
+endif()
+
+if(SNAPSHOT)
+    get_filename_component(directory "${SNAPSHOT}" DIRECTORY)
+    file(MAKE_DIRECTORY "${directory}")
+    file(REMOVE "${SNAPSHOT}")
+    execute_process(
+        COMMAND "${PANCAKE}" ${arguments} --snapshot "${SNAPSHOT}" "${PROGRAM}"
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+        RESULT_VARIABLE result)
+
+    # A program which PANics before it reads input leaves no snapshot, as its error is the expected one.
+    if(EXISTS "${SNAPSHOT}")
+        execute_process(
+            COMMAND "${PANCAKE}" ${arguments} "${SNAPSHOT}"
+            ${input}
+            OUTPUT_VARIABLE snapshotOutput
+            ERROR_VARIABLE snapshotError
+            RESULT_VARIABLE result)
+        string(APPEND output "${snapshotOutput}")
+        string(APPEND error "${snapshotError}")
+    endif()
+else()
+    execute_process(
+        COMMAND ${command}
+        ${input}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+        RESULT_VARIABLE result)
+endif()
+
+file(READ "${GOLDEN}.out" expectedOutput)
+if(NOT output STREQUAL expectedOutput)
+    message(FATAL_ERROR "Standard output does not match ${GOLDEN}.out.\nExpected:\n${expectedOutput}\nActual:\n${output}")
+endif()
+
+set(expectedError "")
+if(EXISTS "${GOLDEN}.err")
+    file(READ "${GOLDEN}.err" expectedError)
+endif()
+if(NOT error STREQUAL expectedError)
+    message(FATAL_ERROR "Standard error does not match ${GOLDEN}.err.\nExpected:\n${expectedError}\nActual:\n${error}")
+endif()
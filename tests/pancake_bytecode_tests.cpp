@@ -0,0 +1,244 @@
+// Copyright (c) 2021 Matt Bolitho
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include "pancake.hpp"
+
+// Checks that compiled program (.pnckc) and snapshot (.pncks) files survive being written and read, and that
+// damaged files and files from other versions are rejected rather than trusted by the virtual machine.
+
+/// A program with labels, memory, a literal string, subroutine calls and a PANic handler.
+static char const* const Source = "\
+^{72}.^{105}.^{10}.\n\
+^{3}!{n}\n\
+:{loop}\n\
+?{n}z{done};?{n}c{square}_^{32}.?{n}<!{n}j{loop}\n\
+:{done};\n\
+^{0}^{5}/^{1}_|h{DivisionByZero}_|\n\
+:{square}&*r\n";
+
+static int failures = 0;
+
+static void Check(bool const condition, char const* const description)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "Failed: %s\n", description);
+        ++failures;
+    }
+}
+
+static std::string WriteProgram(Pancake::CompiledProgram const& program, std::size_t const stackCapacity = Pancake::DefaultStackCapacity,
+    std::size_t const returnStackCapacity = Pancake::DefaultReturnStackCapacity)
+{
+    std::ostringstream output{};
+    Pancake::PancakeBytecode::Write(program, Source, 3, stackCapacity, returnStackCapacity, output);
+    return output.str();
+}
+
+static bool IsRead(std::string const& data)
+{
+    Pancake::CompiledProgram program{};
+    return Pancake::PancakeBytecode::Read(data, program);
+}
+
+static bool IsSnapshotRead(std::string const& data)
+{
+    Pancake::PancakeSnapshot snapshot{};
+    return Pancake::PancakeBytecode::ReadSnapshot(data, snapshot);
+}
+
+static void CheckRoundTrip(Pancake::CompiledProgram const& program)
+{
+    auto const data = WriteProgram(program, 64, 8);
+    Pancake::CompiledProgram read{};
+    Pancake::PancakeBytecode::Origin origin{};
+    Check(Pancake::PancakeBytecode::Read(data, read, &origin), "A compiled program is read back.");
+
+    auto sameInstructions = read.instructions.size() == program.instructions.size();
+    for (std::size_t address = 0; sameInstructions && address < program.instructions.size(); ++address)
+    {
+        sameInstructions = read.instructions[address].opcode == program.instructions[address].opcode
+            && read.instructions[address].operand == program.instructions[address].operand
+            && read.instructions[address].checkStack == program.instructions[address].checkStack;
+    }
+    Check(sameInstructions, "Instructions are read back unchanged.");
+    Check(read.sourceOffsets == program.sourceOffsets && read.names == program.names && read.variables == program.variables
+        && read.panicHandlers == program.panicHandlers && read.strings == program.strings
+        && read.builtInPanicHandlers == program.builtInPanicHandlers && read.labelNames == program.labelNames
+        && read.labelAddresses == program.labelAddresses, "Tables are read back unchanged.");
+
+    Check(origin.sourceHash == Pancake::PancakeBytecode::HashSource(Source) && origin.sourceLength == std::strlen(Source)
+        && origin.optimizationLevel == 3, "The origin of a compiled program is read back.");
+    Check(origin.IsCompiledFor(64, 8) && !origin.IsCompiledFor(65, 8) && !origin.IsCompiledFor(64, 9),
+        "A compiled program is only compiled for the capacities it was written with.");
+}
+
+static void CheckDamagedPrograms(Pancake::CompiledProgram const& program)
+{
+    auto const data = WriteProgram(program);
+
+    auto truncatedRead = false;
+    for (std::size_t size = 0; size < data.size(); ++size)
+    {
+        truncatedRead = truncatedRead || IsRead(data.substr(0, size));
+    }
+    Check(!truncatedRead, "Truncated compiled programs are rejected.");
+
+    // The format version follows the eight magic bytes, and the byte order marker follows the version.
+    for (auto const version : { Pancake::PancakeBytecode::Version - 1, Pancake::PancakeBytecode::Version + 1 })
+    {
+        auto foreign = data;
+        std::memcpy(&foreign[8], &version, sizeof(version));
+        Check(!IsRead(foreign), "Compiled programs from other versions of the format are rejected.");
+    }
+    auto swapped = data;
+    std::swap(swapped[12], swapped[15]);
+    Check(!IsRead(swapped), "Compiled programs with the other byte order are rejected.");
+
+    // Write trusts the program it is given, so damaged programs can be written and must then be rejected.
+    auto const damaged = [&](auto const& damage)
+    {
+        auto copy = program;
+        damage(copy);
+        return WriteProgram(copy);
+    };
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy) { copy.instructions[0].opcode = static_cast<Pancake::Opcode>(Pancake::OpcodeCount); })),
+        "Unknown opcodes are rejected.");
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy) { copy.instructions.back().opcode = Pancake::Opcode::Pop; })),
+        "Programs which do not end with a terminate instruction are rejected.");
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy)
+    {
+        for (auto& instruction : copy.instructions)
+        {
+            if (Pancake::IsJump(instruction.opcode))
+            {
+                instruction.operand = copy.instructions.size();
+            }
+        }
+    })), "Jumps past the end of the program are rejected.");
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy) { copy.labelAddresses[0] = copy.instructions.size(); })),
+        "Labels past the end of the program are rejected.");
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy) { copy.sourceOffsets.pop_back(); })),
+        "Programs without a source offset for every instruction are rejected.");
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy)
+    {
+        for (auto& instruction : copy.instructions)
+        {
+            if (instruction.opcode == Pancake::Opcode::Store)
+            {
+                instruction.operand = copy.variables.size();
+            }
+        }
+    })), "Memory slots which do not exist are rejected.");
+    Check(!IsRead(damaged([](Pancake::CompiledProgram& copy)
+    {
+        for (auto& instruction : copy.instructions)
+        {
+            instruction.checkStack = false;
+        }
+    })), "Removed stack checks which can fail are rejected.");
+
+    std::ostringstream noStack{};
+    Pancake::PancakeBytecode::Write(program, Source, 3, 0, Pancake::DefaultReturnStackCapacity, noStack);
+    Check(!IsRead(noStack.str()), "Compiled programs for a stack with no capacity are rejected.");
+}
+
+static void CheckSnapshots(std::shared_ptr<Pancake::CompiledProgram const> const& program)
+{
+    Pancake::PancakeVirtualMachine machine(64, 8);
+    Pancake::StringOutputSink output{};
+    machine.SetOutput(output);
+    machine.Load(program);
+    machine.Step();
+    machine.Step();
+
+    std::ostringstream written{};
+    Pancake::PancakeBytecode::WriteSnapshot(machine.Capture(), Source, 3, written);
+    auto const data = written.str();
+
+    Pancake::PancakeSnapshot snapshot{};
+    Check(Pancake::PancakeBytecode::ReadSnapshot(data, snapshot), "A snapshot is read back.");
+    Check(snapshot.GetInstructionPointer() == machine.GetInstructionPointer() && snapshot.GetStack().size() == machine.GetStack().Size()
+        && snapshot.GetStackCapacity() == 64 && snapshot.GetReturnStackCapacity() == 8, "The state of a snapshot is read back.");
+
+    auto truncatedRead = false;
+    for (std::size_t size = 0; size < data.size(); ++size)
+    {
+        truncatedRead = truncatedRead || IsSnapshotRead(data.substr(0, size));
+    }
+    Check(!truncatedRead, "Truncated snapshots are rejected.");
+
+    auto foreign = data;
+    auto const version = Pancake::PancakeBytecode::Version + 1;
+    std::memcpy(&foreign[8], &version, sizeof(version));
+    Check(!IsSnapshotRead(foreign), "Snapshots from other versions of the format are rejected.");
+
+    auto restored = false;
+    Pancake::PancakeVirtualMachine sameMachine(64, 8);
+    sameMachine.SetOutput(output);
+    try
+    {
+        sameMachine.Restore(snapshot);
+        restored = true;
+    }
+    catch (std::runtime_error const&)
+    {
+    }
+    Check(restored, "A snapshot is restored into a virtual machine with the same capacities.");
+
+    for (auto const& capacities : { std::make_pair(32, 8), std::make_pair(64, 16) })
+    {
+        auto refused = false;
+        Pancake::PancakeVirtualMachine otherMachine(capacities.first, capacities.second);
+        try
+        {
+            otherMachine.Restore(snapshot);
+        }
+        catch (std::runtime_error const&)
+        {
+            refused = true;
+        }
+        Check(refused, "A snapshot is not restored into a virtual machine with other capacities.");
+    }
+}
+
+int main()
+{
+    try
+    {
+        auto const program = Pancake::PancakeInterpreter(64, 3, 8).Compile(Source);
+        CheckRoundTrip(*program);
+        CheckDamagedPrograms(*program);
+        CheckSnapshots(program);
+    }
+    catch (std::exception const& exception)
+    {
+        std::fprintf(stderr, "Failed: %s\n", exception.what());
+        return 1;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
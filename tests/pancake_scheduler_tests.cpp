@@ -0,0 +1,247 @@
+// Copyright (c) 2021 Matt Bolitho
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include "pancake.hpp"
+
+// Checks that the scheduler takes turns between programs, sets aside and wakes programs waiting for input, including
+// ones woken during their turn, reports PANics to completions and waits for every completion.
+// Build with -fsanitize=thread to check for races too.
+
+static constexpr std::size_t StackCapacity = 1024;
+static constexpr std::size_t ReturnStackCapacity = 64;
+
+/// How long a check waits for a program which should halt before it is taken as hung.
+static constexpr auto Timeout = std::chrono::seconds(30);
+
+static int failures = 0;
+
+static void Check(bool const condition, char const* const description)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "Failed: %s\n", description);
+        ++failures;
+    }
+}
+
+/// Waits for every scheduled program to halt, giving up on the whole test if they do not,
+/// since Wait never returns once a program is lost.
+static void WaitFor(Pancake::PancakeScheduler& scheduler, char const* const description)
+{
+    auto waited = std::async(std::launch::async, [&] { scheduler.Wait(); });
+    if (waited.wait_for(Timeout) != std::future_status::ready)
+    {
+        std::fprintf(stderr, "Failed: %s\n", description);
+        std::_Exit(1);
+    }
+}
+
+/// A virtual machine with a program loaded, writing to its own output.
+struct Job
+{
+    Pancake::PancakeVirtualMachine machine{ StackCapacity, ReturnStackCapacity };
+    Pancake::StringOutputSink output{};
+
+    explicit Job(char const* const source)
+    {
+        machine.SetOutput(output);
+        machine.Load(Pancake::PancakeInterpreter(StackCapacity, Pancake::DefaultOptimizationLevel, ReturnStackCapacity).Compile(source));
+    }
+};
+
+static void CheckPreemption()
+{
+    // Declared before the scheduler, which abandons the endless program when it is destroyed.
+    Job endless(":{loop}j{loop}");
+    Job finite("^{3}!{n}:{loop}?{n}z{done};?{n}_?{n}<!{n}j{loop}:{done};");
+    std::promise<std::string> finished{};
+
+    // A single thread can only finish the finite program if the endless one gives up its turns.
+    Pancake::PancakeScheduler scheduler(1, 100);
+    scheduler.Submit(endless.machine, [](Pancake::PancakeVirtualMachine&, std::exception_ptr) {});
+    scheduler.Submit(finite.machine, [&](Pancake::PancakeVirtualMachine&, std::exception_ptr const panic)
+    {
+        finished.set_value(panic ? "PANic" : finite.output.Text());
+    });
+
+    // A thread which never gives up its turn can never be joined either, so the test gives up at once.
+    auto result = finished.get_future();
+    if (result.wait_for(Timeout) != std::future_status::ready)
+    {
+        std::fprintf(stderr, "Failed: A finite program finishes alongside one which never halts.\n");
+        std::_Exit(1);
+    }
+    Check(result.get() == "321", "A program which takes turns writes the right output.");
+}
+
+static void CheckWake()
+{
+    Job adder(",,+_");
+    Pancake::QueueInputSource input{};
+    adder.machine.SetInput(input);
+    std::exception_ptr panic{};
+
+    Pancake::PancakeScheduler scheduler(2, 100);
+    scheduler.Submit(adder.machine, [&](Pancake::PancakeVirtualMachine&, std::exception_ptr const raised) { panic = raised; });
+
+    // Each piece arrives after the program has had time to wait for it, and the first number is split between two.
+    for (auto const* const piece : { "1", "2\n3", "4\n" })
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        input.Append(piece);
+        scheduler.Wake(adder.machine);
+    }
+    input.Close();
+    scheduler.Wake(adder.machine);
+    WaitFor(scheduler, "A program waiting for input is woken.");
+
+    Check(!panic, "A woken program does not PANic.");
+    Check(adder.output.Text() == "46", "A program reads input which arrives in pieces after it waits for it.");
+}
+
+/// Input which arrives while the program is running the turn in which it first finds none.
+class LateInputSource final : public Pancake::InputSource
+{
+    public:
+        LateInputSource(Pancake::PancakeScheduler& scheduler, Pancake::PancakeVirtualMachine& machine, std::string text)
+            : _scheduler(scheduler), _machine(machine), _text(std::move(text))
+        {
+        }
+
+        int Get() noexcept override
+        {
+            if (!_arrived)
+            {
+                _arrived = true;
+                _scheduler.Wake(_machine);
+                return Pending;
+            }
+            return _position < _text.size() ? static_cast<unsigned char>(_text[_position++]) : EOF;
+        }
+
+    private:
+        Pancake::PancakeScheduler& _scheduler;
+        Pancake::PancakeVirtualMachine& _machine;
+        std::string _text;
+        std::size_t _position = 0;
+        bool _arrived = false;
+};
+
+static void CheckWakeDuringTurn()
+{
+    Job adder(",,+_");
+    Pancake::PancakeScheduler scheduler(1);
+    LateInputSource input(scheduler, adder.machine, "12 34");
+    adder.machine.SetInput(input);
+
+    // The only wake-up comes before the program stops to wait, so setting it aside would lose it.
+    scheduler.Submit(adder.machine, [](Pancake::PancakeVirtualMachine&, std::exception_ptr) {});
+    WaitFor(scheduler, "A program woken while running a turn is run again.");
+    Check(adder.output.Text() == "46", "A program woken while running a turn reads its input.");
+}
+
+static void CheckPanic()
+{
+    Job divider("^{1}_^{0}^{5}/^{2}_");
+    std::exception_ptr panic{};
+
+    Pancake::PancakeScheduler scheduler(2);
+    scheduler.Submit(divider.machine, [&](Pancake::PancakeVirtualMachine&, std::exception_ptr const raised) { panic = raised; });
+    WaitFor(scheduler, "A program which PANics halts.");
+
+    auto type = Pancake::PanicType::DivisionByZero;
+    auto reported = false;
+    try
+    {
+        if (panic)
+        {
+            std::rethrow_exception(panic);
+        }
+    }
+    catch (Pancake::PancakePanic const& exception)
+    {
+        type = exception.GetPanicType();
+        reported = true;
+    }
+    Check(reported && type == Pancake::PanicType::DivisionByZero, "An unhandled PANic is passed to the completion.");
+    Check(divider.output.Text() == "1", "Output written before a PANic is kept.");
+}
+
+static void CheckWait()
+{
+    constexpr std::size_t JobCount = 8;
+    std::unique_ptr<Job> jobs[JobCount];
+    std::atomic<std::size_t> completed{ 0 };
+
+    Pancake::PancakeScheduler scheduler(3, 10);
+    WaitFor(scheduler, "Waiting with nothing scheduled returns.");
+    Check(completed == 0, "Waiting with nothing scheduled returns at once.");
+
+    for (auto& job : jobs)
+    {
+        job = std::make_unique<Job>("^{5}!{n}:{loop}?{n}z{done};?{n}<!{n}j{loop}:{done};^{7}_");
+        scheduler.Submit(job->machine, [&](Pancake::PancakeVirtualMachine&, std::exception_ptr)
+        {
+            // Slow completions, so Wait returning early would be seen.
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            ++completed;
+        });
+    }
+    WaitFor(scheduler, "Every scheduled program halts.");
+    Check(completed == JobCount, "Waiting returns once the last completion has finished.");
+
+    auto outputs = true;
+    for (auto const& job : jobs)
+    {
+        outputs = outputs && job->output.Text() == "7";
+    }
+    Check(outputs, "Every scheduled program writes its output.");
+}
+
+int main()
+{
+    try
+    {
+        CheckPreemption();
+        CheckWake();
+        CheckWakeDuringTurn();
+        CheckPanic();
+        CheckWait();
+    }
+    catch (std::exception const& exception)
+    {
+        std::fprintf(stderr, "Failed: %s\n", exception.what());
+        return 1;
+    }
+
+    return failures == 0 ? 0 : 1;
+}